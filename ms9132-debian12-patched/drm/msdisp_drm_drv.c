@@ -36,8 +36,6 @@
 #include "msdisp_drm_drv.h"
 #include "msdisp_plat_drv.h"
 
-#define	MSDISP_DRM_VBLANK_TIMER_OUT_MS				20
-
 static ushort msdisp_drm_initial_pipeline_count = 3;
 module_param_named(initial_pipeline_count,
 		   msdisp_drm_initial_pipeline_count, ushort, 0644);
@@ -76,12 +74,12 @@ static const struct file_operations msdisp_drm_driver_fops = {
 #else
 static int msdisp_drm_enable_vblank(struct drm_device *dev, unsigned int pipe)
 {
-	return 0;
+	return msdisp_drm_crtc_enable_vblank(drm_crtc_from_index(dev, pipe));
 }
 
 static void msdisp_drm_disable_vblank(struct drm_device *dev, unsigned int pipe)
 {
-
+	msdisp_drm_crtc_disable_vblank(drm_crtc_from_index(dev, pipe));
 }
 #endif
 
@@ -135,34 +133,54 @@ static struct drm_driver driver = {
 	.patchlevel = DRIVER_PATCH,
 };
 
-static void msdisp_drm_handle_page_flip(struct msdisp_drm_pipeline* pipeline)
+static struct msdisp_drm_pcpu_stat __percpu *msdisp_drm_stat_alloc(void)
 {
-	struct drm_crtc* crtc = pipeline->crtc;
-	struct drm_device* dev = crtc->dev;
-	unsigned long flags;
-
-	spin_lock_irqsave(&dev->event_lock, flags);
-	if (pipeline->event) {
-		drm_crtc_send_vblank_event(crtc, pipeline->event);
-		pipeline->event = NULL;
-		//drm_crtc_vblank_put(crtc);
+	struct msdisp_drm_pcpu_stat __percpu *pcpu_stat;
+	int cpu;
+
+	pcpu_stat = alloc_percpu(struct msdisp_drm_pcpu_stat);
+	if (!pcpu_stat) {
+		return NULL;
 	}
-	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	for_each_possible_cpu(cpu) {
+		u64_stats_init(&per_cpu_ptr(pcpu_stat, cpu)->syncp);
+	}
+
+	return pcpu_stat;
 }
 
-static void msidsip_drm_timer_func(struct timer_list* t)
+static void msdisp_drm_stat_free(struct msdisp_drm_device *msdisp)
 {
-	struct msdisp_drm_device *msdisp = from_timer(msdisp, t, vblank_timer); 
-	struct drm_crtc* crtc;
 	int i;
 
 	for (i = 0; i < msdisp->pipeline_cnt; i++) {
-		crtc = msdisp->pipeline[i].crtc;
-		drm_crtc_handle_vblank(crtc);
-		msdisp_drm_handle_page_flip(&msdisp->pipeline[i]);
+		free_percpu(msdisp->pipeline[i].pcpu_stat);
+		msdisp->pipeline[i].pcpu_stat = NULL;
 	}
+}
 
-	mod_timer(&msdisp->vblank_timer, jiffies + msecs_to_jiffies(MSDISP_DRM_VBLANK_TIMER_OUT_MS));
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+/* final put, the vblank timers and the flip path can't count anymore */
+static void msdisp_drm_stat_release(struct drm_device *dev, void *data)
+{
+	msdisp_drm_stat_free(data);
+}
+#endif
+
+/* undo what msdisp_drm_init set up outside the drm core */
+static void msdisp_drm_fini(struct msdisp_drm_device *msdisp)
+{
+	if (msdisp->frame_wq) {
+		destroy_workqueue(msdisp->frame_wq);
+		msdisp->frame_wq = NULL;
+	}
+
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+#else
+	// only called once the crtcs are off and their timers stopped
+	msdisp_drm_stat_free(msdisp);
+#endif
 }
 
 static int msdisp_drm_init(struct msdisp_drm_device *msdisp)
@@ -171,15 +189,31 @@ static int msdisp_drm_init(struct msdisp_drm_device *msdisp)
 	int i;
 	int ret = -ENOMEM;
 
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+	ret = drmm_add_action_or_reset(dev, msdisp_drm_stat_release, msdisp);
+	if (ret) {
+		return ret;
+	}
+	ret = -ENOMEM;
+#endif
+
 	for (i = 0; i < msdisp->pipeline_cnt; i++) {
 		msdisp->pipeline[i].drm_status = MSDISP_DRM_STATUS_DISABLE;
 		mutex_init(&msdisp->pipeline[i].hal_lock);
+		mutex_init(&msdisp->pipeline[i].stat_lock);
+		msdisp_drm_frame_init(&msdisp->pipeline[i]);
+		msdisp->pipeline[i].pcpu_stat = msdisp_drm_stat_alloc();
+		if (!msdisp->pipeline[i].pcpu_stat) {
+			goto err;
+		}
 	}
 
-	timer_setup(&msdisp->vblank_timer, msidsip_drm_timer_func, 0);
-	msdisp->vblank_timer.expires = (jiffies + msecs_to_jiffies(MSDISP_DRM_VBLANK_TIMER_OUT_MS));
-	add_timer(&msdisp->vblank_timer);
- 
+	msdisp->frame_wq = alloc_workqueue("msdisp_frame", WQ_UNBOUND | WQ_HIGHPRI, MSDISP_DRM_MAX_PIPELINE_CNT);
+	if (!msdisp->frame_wq) {
+		goto err;
+	}
+
+
 	ret = msdisp_drm_modeset_init(dev);
 	if (ret) {
 		goto err;
@@ -202,8 +236,10 @@ static int msdisp_drm_init(struct msdisp_drm_device *msdisp)
 	//printk("vblank enablde:%d\n", dev->vblank->enabled);
 
 	drm_kms_helper_poll_init(dev);
+	return 0;
 
 err:
+	msdisp_drm_fini(msdisp);
 	return ret;
 }
 
@@ -297,10 +333,13 @@ struct drm_device *msdisp_drm_device_create(struct device *parent)
 
 
 	ret = drm_dev_register(drm, 0);
-	if (ret)
+	if (ret) {
+		msdisp_drm_fini(msdisp_drm);
 		goto err_free;
+	}
 
 	msdisp_drm_sysfs_init(msdisp_drm);
+	msdisp_drm_debugfs_init(msdisp_drm);
 	return drm;
 
 err_free:
@@ -314,14 +353,25 @@ int msdisp_drm_device_remove(struct drm_device *drm)
 {
 	int i;
 	struct msdisp_drm_device* msdisp_drm = to_msdisp_drm(drm);
+	struct drm_crtc *crtc;
+
+	msdisp_drm_debugfs_exit(msdisp_drm);
+	msdisp_drm_sysfs_exit(msdisp_drm);
+	// no commit gets past this, then the crtcs are switched off and no more work is queued
+	drm_dev_unplug(drm);
+	drm_atomic_helper_shutdown(drm);
+
+	// the vblank timers touch the pipelines torn down below
+	drm_for_each_crtc(crtc, drm) {
+		msdisp_drm_crtc_stop_vblank(crtc);
+	}
 
 	for (i = 0; i < msdisp_drm->pipeline_cnt; i++) {
+		msdisp_drm_frame_flush(&msdisp_drm->pipeline[i]);
 		(void)kfifo_free(&msdisp_drm->pipeline[i].fifo);
 	}
 
-	del_timer(&msdisp_drm->vblank_timer);
-	msdisp_drm_sysfs_exit(msdisp_drm);
-	drm_dev_unplug(drm);
+	msdisp_drm_fini(msdisp_drm);
 
 	return 0;
 }
\ No newline at end of file
@@ -21,9 +21,16 @@
 #include <linux/kfifo.h>
 #include <linux/version.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/mutex.h>
 #include <linux/device.h>
 #include <linux/platform_device.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ktime.h>
 #if KERNEL_VERSION(5, 5, 0) <= LINUX_VERSION_CODE || defined(EL8)
 #include <drm/drm_drv.h>
 #include <drm/drm_fourcc.h>
@@ -50,6 +57,9 @@
 #include <linux/reservation.h>
 #endif
 
+#include "msdisp_usb_interface.h"
+#include "msdisp_common_util.h"
+
 #define MSDISP_DRM_STATUS_DISABLE				0
 #define MSDISP_DRM_STATUS_ENABLE				1
 
@@ -60,6 +70,7 @@ struct msdisp_usb_hal;
 struct drm_mode_create_dumb;
 struct msdisp_drm_connector;
 struct drm_pending_vblank_event;
+struct dentry;
 
 struct msdisp_drm_gem_object {
 	struct drm_gem_object base;
@@ -91,6 +102,7 @@ struct msdisp_drm_framebuffer {
 
 #define to_msdisp_drm_fb(x) container_of(x, struct msdisp_drm_framebuffer, base)
 
+/* per cpu event counters, only u64 fields, summed on read in msdisp_drm_sysfs.c */
 struct msdisp_drm_frame_stat {
 	u64 total;
 	u64 no_usb_hal;
@@ -101,19 +113,83 @@ struct msdisp_drm_frame_stat {
 	u64 cpu_access_fail;
 	u64 acquire_buf_fail;
 	u64 handle_fail;
+	/* flip events sent once the frame was out, and after waiting too long for it */
+	u64 flip_on_done;
+	u64 flip_timeout;
+	/* vblanks that would have let the client render a frame the wire couldn't take */
+	u64 renders_saved;
+	/* commits replaced before the frame worker picked them up */
+	u64 coalesced;
+};
+
+struct msdisp_drm_pcpu_stat {
+	struct msdisp_drm_frame_stat stat;
+	struct u64_stats_sync syncp;
+};
+
+/* count an event from any context, see usb_hal_stat_add() */
+#if BITS_PER_LONG == 64
+#define msdisp_drm_stat_inc(pipeline, field) this_cpu_inc((pipeline)->pcpu_stat->stat.field)
+#else
+#define msdisp_drm_stat_inc(pipeline, field) do { \
+	struct msdisp_drm_pcpu_stat *__s; \
+	unsigned long __flags; \
+	local_irq_save(__flags); \
+	__s = this_cpu_ptr((pipeline)->pcpu_stat); \
+	u64_stats_update_begin(&__s->syncp); \
+	__s->stat.field++; \
+	u64_stats_update_end(&__s->syncp); \
+	local_irq_restore(__flags); \
+} while (0)
+#endif
+
+
+/* what a commit left for the frame worker */
+struct msdisp_drm_frame {
+	struct drm_framebuffer *fb;
+	struct drm_rect rects[MSDISP_MAX_DAMAGE_RECTS];
+	/* -1 for the whole frame */
+	int rect_cnt;
+	u32 commit;
+	ktime_t commit_time;
 };
 
 struct msdisp_drm_pipeline {
 	struct device dev;
 	int dev_init;
+	/* global id of the usb device on it, what the hal names and traces it with */
+	int id;
 	struct drm_crtc* crtc;
 	struct drm_encoder* encoder;
 	struct msdisp_drm_connector* connector;
 	struct msdisp_usb_hal* usb_hal;
 	struct drm_pending_vblank_event* event;
+	/* commits with a frame so far, the one in progress arms its flip to wait for it */
+	u32 commit_seq;
+	int frame_armed;
+	u32 frame_commit;
+	/* flip_on_done state, protected by event_lock */
+	int flip_wait;
+	int flip_vblanks;
+	u32 flip_commit;
+	u32 sent_commit;
+	u32 sent_seq;
+	u32 done_seq;
+	ktime_t sent_time;
+	/* newest frame not picked up by frame_work yet, protected by frame_lock */
+	struct msdisp_drm_frame frame;
+	spinlock_t frame_lock;
+	struct work_struct frame_work;
 	struct mutex hal_lock;
 	struct kfifo fifo;
-	struct msdisp_drm_frame_stat frame_stat;
+	struct msdisp_drm_pcpu_stat __percpu *pcpu_stat;
+	/* counts at the last reset, shown counts are relative to it */
+	struct msdisp_drm_frame_stat stat_base;
+	struct mutex stat_lock;
+	/* debugfs dir, the hal adds its own stages below it */
+	struct dentry* debugfs;
+	struct msdisp_common_hist hist_commit_convert;
+	struct msdisp_common_hist hist_commit_trigger;
 	volatile unsigned int dump_fb_flag;
 	int reg_flag;
 	int drm_status;
@@ -124,10 +200,31 @@ struct msdisp_drm_pipeline {
 	char dump_fb_filename[256];
 };
 
+/* crtc and primary plane point back at their pipeline, no lookup per frame */
+struct msdisp_drm_crtc {
+	struct drm_crtc base;
+	struct msdisp_drm_pipeline *pipeline;
+	/* runs at the refresh of the enabled mode while vblank is on */
+	struct hrtimer vblank_timer;
+	ktime_t vblank_period;
+	bool vblank_on;
+};
+
+#define to_msdisp_drm_crtc(x) container_of(x, struct msdisp_drm_crtc, base)
+
+struct msdisp_drm_plane {
+	struct drm_plane base;
+	struct msdisp_drm_pipeline *pipeline;
+};
+
+#define to_msdisp_drm_plane(x) container_of(x, struct msdisp_drm_plane, base)
+
 struct msdisp_drm_device {
 	struct drm_device drm; //must be first field, so, drmm_add_final_kfree is not needed
-	struct timer_list vblank_timer;
 	struct device *parent;
+	/* converts and sends the frames of all pipelines, off the commit path */
+	struct workqueue_struct *frame_wq;
+	struct dentry *debugfs;
 	int pipeline_cnt;
 	struct msdisp_drm_pipeline pipeline[MSDISP_DRM_MAX_PIPELINE_CNT];
 };
@@ -169,11 +266,22 @@ int msdisp_drm_gem_fault(struct vm_fault *vmf);
 
 
 int msdisp_drm_modeset_init(struct drm_device *dev);
+int msdisp_drm_plane_format_supported(uint32_t format);
+void msdisp_drm_frame_init(struct msdisp_drm_pipeline *pipeline);
+void msdisp_drm_frame_flush(struct msdisp_drm_pipeline *pipeline);
+void msdisp_drm_frame_done(void *ctx, u32 seq);
+int msdisp_drm_crtc_enable_vblank(struct drm_crtc *crtc);
+void msdisp_drm_crtc_disable_vblank(struct drm_crtc *crtc);
+void msdisp_drm_crtc_stop_vblank(struct drm_crtc *crtc);
 struct drm_encoder * msdisp_drm_encoder_init(struct drm_device *dev);
 struct msdisp_drm_connector * msdisp_drm_connector_init(struct drm_device *dev, struct drm_encoder *encoder, int index);
 struct drm_device *msdisp_drm_device_create(struct device *parent);
 int msdisp_drm_device_remove(struct drm_device *dev);
 int msdisp_drm_get_pipeline_init_count(void);
+void msdisp_drm_debugfs_register(void);
+void msdisp_drm_debugfs_unregister(void);
+void msdisp_drm_debugfs_init(struct msdisp_drm_device *msdisp_drm);
+void msdisp_drm_debugfs_exit(struct msdisp_drm_device *msdisp_drm);
 
 
 #endif
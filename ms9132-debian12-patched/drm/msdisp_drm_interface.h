@@ -21,6 +21,7 @@ struct drm_device;
 struct msdisp_usb_hal;
 struct kfifo;
 struct kobject;
+struct dentry;
 
 struct platform_device* msdisp_platform_get_device(int id);
 int msdisp_platform_get_plat_device_index(struct platform_device* plat_dev);
@@ -32,4 +33,5 @@ int msdisp_drm_unregister_usb_hal(struct drm_device* drm, int pipeline_index);
 struct kfifo* msdisp_drm_get_kfifo(struct drm_device* drm, int pipeline_index);
 int msdisp_drm_get_pipeline_global_id(struct drm_device* drm, int pipeline_index);
 struct kobject* msdisp_drm_get_pipeline_kobject(struct drm_device* drm, int pipeline_index);
+struct dentry* msdisp_drm_get_pipeline_debugfs(struct drm_device* drm, int pipeline_index);
 #endif
@@ -41,37 +41,100 @@
 #include "msdisp_common_util.h"
 #include "msdisp_usb_interface.h"
 
+#define CREATE_TRACE_POINTS
+#include "msdisp_drm_trace.h"
+
 
 static struct msdisp_drm_pipeline* get_pipeline_by_plane(struct drm_plane* plane)
 {
-	struct msdisp_drm_device *msdisp_drm = to_msdisp_drm(plane->dev);
-	struct msdisp_drm_pipeline* pipeline = NULL;
-	int i;
+	return to_msdisp_drm_plane(plane)->pipeline;
+}
+
+static struct msdisp_drm_pipeline* get_pipeline_by_crtc(struct drm_crtc* crtc)
+{
+	return to_msdisp_drm_crtc(crtc)->pipeline;
+}
+
+/* a flip waiting for its frame goes out anyway after this many vblanks */
+#define MSDISP_DRM_FLIP_MAX_VBLANKS				6
 
-	for (i = 0; i < msdisp_drm->pipeline_cnt; i++) {
-		if (msdisp_drm->pipeline[i].crtc->primary == plane) {
-			pipeline = &msdisp_drm->pipeline[i];
-			break;
+static ushort msdisp_drm_flip_on_done = 0;
+module_param_named(flip_on_done, msdisp_drm_flip_on_done, ushort, 0644);
+MODULE_PARM_DESC(flip_on_done, "Send page flip events once the frame has been sent to the device, not at the next vblank (default: 0)");
+
+static void msdisp_drm_send_flip_locked(struct msdisp_drm_pipeline* pipeline)
+{
+	struct drm_crtc* crtc = pipeline->crtc;
+
+	drm_crtc_send_vblank_event(crtc, pipeline->event);
+	pipeline->event = NULL;
+	pipeline->flip_wait = 0;
+	drm_crtc_vblank_put(crtc);
+}
+
+/*
+ * The pending flip event goes out with the vblank that follows the commit. With
+ * flip_on_done it waits for the frame of its commit instead, so the client only
+ * renders as fast as the wire takes frames, force sends it regardless.
+ */
+static void msdisp_drm_handle_page_flip(struct msdisp_drm_pipeline* pipeline, int force)
+{
+	struct drm_crtc* crtc = pipeline->crtc;
+	struct drm_device* dev = crtc->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	if (pipeline->event) {
+		if (!force && pipeline->flip_wait && (++pipeline->flip_vblanks < MSDISP_DRM_FLIP_MAX_VBLANKS)) {
+			msdisp_drm_stat_inc(pipeline, renders_saved);
+		} else {
+			if (pipeline->flip_wait) {
+				msdisp_drm_stat_inc(pipeline, flip_timeout);
+			}
+			msdisp_drm_send_flip_locked(pipeline);
 		}
 	}
-
-	return pipeline;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
 }
 
-static struct msdisp_drm_pipeline* get_pipeline_by_crtc(struct drm_crtc* crtc)
+/*
+ * Send the waiting flip once the frame of its commit has been taken by the hal
+ * and sent, event_lock held. A commit whose frame couldn't be taken leaves
+ * sent_seq 0 and its flip goes out right away.
+ */
+static void msdisp_drm_flip_check_locked(struct msdisp_drm_pipeline* pipeline)
 {
-	struct msdisp_drm_device *msdisp_drm = to_msdisp_drm(crtc->dev);
-	struct msdisp_drm_pipeline* pipeline = NULL;
-	int i;
+	if (!pipeline->event || !pipeline->flip_wait) {
+		return;
+	}
 
-	for (i = 0; i < msdisp_drm->pipeline_cnt; i++) {
-		if (msdisp_drm->pipeline[i].crtc == crtc) {
-			pipeline = &msdisp_drm->pipeline[i];
-			break;
-		}
+	if ((s32)(pipeline->sent_commit - pipeline->flip_commit) < 0) {
+		return;
+	}
+
+	if (pipeline->sent_seq && ((s32)(pipeline->done_seq - pipeline->sent_seq) < 0)) {
+		return;
 	}
 
-	return pipeline;
+	msdisp_drm_stat_inc(pipeline, flip_on_done);
+	msdisp_drm_send_flip_locked(pipeline);
+}
+
+/* frame seq has been sent, called by the hal from its sender thread */
+void msdisp_drm_frame_done(void *ctx, u32 seq)
+{
+	struct msdisp_drm_pipeline* pipeline = ctx;
+	struct drm_device* dev = pipeline->crtc->dev;
+	unsigned long flags;
+
+	trace_msdisp_drm_frame_done(pipeline->id, seq);
+	spin_lock_irqsave(&dev->event_lock, flags);
+	pipeline->done_seq = seq;
+	if (seq && (seq == pipeline->sent_seq)) {
+		msdisp_common_hist_add(&pipeline->hist_commit_trigger, ktime_us_delta(ktime_get(), pipeline->sent_time));
+	}
+	msdisp_drm_flip_check_locked(pipeline);
+	spin_unlock_irqrestore(&dev->event_lock, flags);
 }
 
 void msdisp_crtc_update_event(struct drm_crtc *crtc)
@@ -83,18 +146,99 @@ void msdisp_crtc_update_event(struct drm_crtc *crtc)
 		unsigned long flags;
 
 		crtc->state->event->pipe = drm_crtc_index(crtc);
+		// a flip not sent yet is superseded, let it go now
+		msdisp_drm_handle_page_flip(pipeline, 1);
+
 		spin_lock_irqsave(&dev->event_lock, flags);
-		pipeline->event = crtc->state->event;
+		// the reference keeps the vblank timer running until the event is sent
+		if (drm_crtc_vblank_get(crtc) == 0) {
+			pipeline->event = crtc->state->event;
+			if (pipeline->frame_armed) {
+				pipeline->flip_commit = pipeline->frame_commit;
+				pipeline->flip_vblanks = 0;
+				pipeline->flip_wait = 1;
+				// the frame may be out already
+				msdisp_drm_flip_check_locked(pipeline);
+			}
+		} else {
+			drm_crtc_send_vblank_event(crtc, crtc->state->event);
+		}
 		crtc->state->event = NULL;
 		spin_unlock_irqrestore(&dev->event_lock, flags);
 	}
+	pipeline->frame_armed = 0;
+}
+
+static enum hrtimer_restart msdisp_drm_vblank_timer_func(struct hrtimer *timer)
+{
+	struct msdisp_drm_crtc *msdisp_crtc = container_of(timer, struct msdisp_drm_crtc, vblank_timer);
+
+	// forward first, the timestamp of this vblank is one period before the next expiry
+	hrtimer_forward_now(timer, msdisp_crtc->vblank_period);
+	drm_crtc_handle_vblank(&msdisp_crtc->base);
+	msdisp_drm_handle_page_flip(msdisp_crtc->pipeline, 0);
+
+	// vblank may have been turned off from within this callback
+	return READ_ONCE(msdisp_crtc->vblank_on) ? HRTIMER_RESTART : HRTIMER_NORESTART;
 }
 
+int msdisp_drm_crtc_enable_vblank(struct drm_crtc *crtc)
+{
+	struct msdisp_drm_crtc *msdisp_crtc = to_msdisp_drm_crtc(crtc);
+	struct drm_vblank_crtc *vblank = &crtc->dev->vblank[drm_crtc_index(crtc)];
+	int rate = drm_mode_vrefresh(&crtc->state->adjusted_mode);
+
+	// framedur_ns follows the pixel clock, the nominal refresh is the fallback
+	if (vblank->framedur_ns) {
+		msdisp_crtc->vblank_period = ns_to_ktime(vblank->framedur_ns);
+	} else {
+		msdisp_crtc->vblank_period = ns_to_ktime(NSEC_PER_SEC / (rate > 0 ? rate : 60));
+	}
+
+	WRITE_ONCE(msdisp_crtc->vblank_on, true);
+	hrtimer_start(&msdisp_crtc->vblank_timer, msdisp_crtc->vblank_period, HRTIMER_MODE_REL);
+	return 0;
+}
+
+/* also called from the timer callback once the last vblank user is gone, so it can't wait for it */
+void msdisp_drm_crtc_disable_vblank(struct drm_crtc *crtc)
+{
+	struct msdisp_drm_crtc *msdisp_crtc = to_msdisp_drm_crtc(crtc);
+
+	WRITE_ONCE(msdisp_crtc->vblank_on, false);
+	hrtimer_try_to_cancel(&msdisp_crtc->vblank_timer);
+}
+
+#if KERNEL_VERSION(5, 7, 0) <= LINUX_VERSION_CODE
+static bool msdisp_drm_get_vblank_timestamp(struct drm_crtc *crtc, int *max_error, ktime_t *vblank_time, bool in_vblank_irq)
+{
+	struct msdisp_drm_crtc *msdisp_crtc = to_msdisp_drm_crtc(crtc);
+	struct drm_vblank_crtc *vblank = &crtc->dev->vblank[drm_crtc_index(crtc)];
+
+	if (!READ_ONCE(vblank->enabled)) {
+		*vblank_time = ktime_get();
+		return true;
+	}
+
+	*vblank_time = ktime_sub(hrtimer_get_expires(&msdisp_crtc->vblank_timer), msdisp_crtc->vblank_period);
+	return true;
+}
+#endif
+
+/* stop the vblank timer for good, waits for a running callback */
+void msdisp_drm_crtc_stop_vblank(struct drm_crtc *crtc)
+{
+	struct msdisp_drm_crtc *msdisp_crtc = to_msdisp_drm_crtc(crtc);
+
+	WRITE_ONCE(msdisp_crtc->vblank_on, false);
+	hrtimer_cancel(&msdisp_crtc->vblank_timer);
+}
 
 static void msdisp_drm_crtc_destroy(struct drm_crtc *crtc)
 {
+	msdisp_drm_crtc_stop_vblank(crtc);
 	drm_crtc_cleanup(crtc);
-	kfree(crtc);
+	kfree(to_msdisp_drm_crtc(crtc));
 }
 
 void msdisp_drm_crtc_atomic_flush(struct drm_crtc *crtc, 
@@ -204,6 +348,8 @@ void msdisp_drm_crtc_atomic_disable(struct drm_crtc *crtc,
 	struct msdisp_usb_hal* usb_hal;
 
 	
+	// the timer stops with vblank, a flip still waiting for it goes out now
+	msdisp_drm_handle_page_flip(get_pipeline_by_crtc(crtc), 1);
 	drm_crtc_vblank_off(crtc);
 	if (crtc->state->event) {
 		unsigned long flags;
@@ -215,6 +361,7 @@ void msdisp_drm_crtc_atomic_disable(struct drm_crtc *crtc,
 	}
 	pipeline = get_pipeline_by_crtc(crtc);
 	pipeline->drm_status = MSDISP_DRM_STATUS_DISABLE;
+	msdisp_drm_frame_flush(pipeline);
     dev_info(dev->dev, "disable: pid=%d! comm=%s\n", task_pid_nr(current), current->comm);
 	mutex_lock(&pipeline->hal_lock);
 	usb_hal = pipeline->usb_hal;
@@ -236,18 +383,6 @@ static struct drm_crtc_helper_funcs msdisp_drm_helper_funcs = {
 	.atomic_flush = msdisp_drm_crtc_atomic_flush,
 };
 
-#if KERNEL_VERSION(5, 11, 0) <= LINUX_VERSION_CODE || defined(RPI) || defined(EL8)
-static int msdisp_drm_enable_vblank(struct drm_crtc *crtc)
-{
-	return 0;
-}
-
-static void msdisp_drm_disable_vblank(struct drm_crtc *crtc)
-{
-
-}
-#endif
-
 static const struct drm_crtc_funcs msdisp_drm_crtc_funcs = {
 	.reset                  = drm_atomic_helper_crtc_reset,
 	.destroy                = msdisp_drm_crtc_destroy,
@@ -257,35 +392,263 @@ static const struct drm_crtc_funcs msdisp_drm_crtc_funcs = {
 	.atomic_destroy_state   = drm_atomic_helper_crtc_destroy_state,
 
 #if KERNEL_VERSION(5, 11, 0) <= LINUX_VERSION_CODE || defined(RPI) || defined(EL8)
-	.enable_vblank          = msdisp_drm_enable_vblank,
-	.disable_vblank         = msdisp_drm_disable_vblank,
+	.enable_vblank          = msdisp_drm_crtc_enable_vblank,
+	.disable_vblank         = msdisp_drm_crtc_disable_vblank,
+#endif
+#if KERNEL_VERSION(5, 7, 0) <= LINUX_VERSION_CODE
+	.get_vblank_timestamp   = msdisp_drm_get_vblank_timestamp,
 #endif
 };
 
-static int msdisp_drm_handle_damage(struct msdisp_drm_framebuffer *efb, struct msdisp_drm_pipeline *pipeline)
+#if KERNEL_VERSION(5, 0, 0) <= LINUX_VERSION_CODE || defined(EL8)
+/* collect the damage clips of the commit, returns -1 when the whole frame must be sent */
+static int msdisp_drm_get_damage(struct drm_plane_state* old_state, struct drm_plane_state* state, struct drm_rect* rects)
+{
+	struct drm_atomic_helper_damage_iter iter;
+	struct drm_rect clip;
+	int i, cnt = 0;
+
+	drm_atomic_helper_damage_iter_init(&iter, old_state, state);
+	drm_atomic_for_each_plane_damage(&iter, &clip) {
+		if (cnt < MSDISP_MAX_DAMAGE_RECTS) {
+			rects[cnt++] = clip;
+			continue;
+		}
+
+		// too many clips, send their bounding box
+		for (i = 1; i < cnt; i++) {
+			rects[0].x1 = min(rects[0].x1, rects[i].x1);
+			rects[0].y1 = min(rects[0].y1, rects[i].y1);
+			rects[0].x2 = max(rects[0].x2, rects[i].x2);
+			rects[0].y2 = max(rects[0].y2, rects[i].y2);
+		}
+		rects[0].x1 = min(rects[0].x1, clip.x1);
+		rects[0].y1 = min(rects[0].y1, clip.y1);
+		rects[0].x2 = max(rects[0].x2, clip.x2);
+		rects[0].y2 = max(rects[0].y2, clip.y2);
+		cnt = 1;
+	}
+
+	return cnt ? cnt : -1;
+}
+#endif
+
+static void msdisp_drm_fb_release(void *ctx)
+{
+	drm_framebuffer_put((struct drm_framebuffer *)ctx);
+}
+
+/*
+ * Hand the framebuffer pages to the hal to send in place. The hal keeps its
+ * own reference until it is done with them, -EOPNOTSUPP if it has to copy.
+ */
+static int msdisp_drm_send_pages(struct msdisp_drm_framebuffer *efb, struct msdisp_usb_hal *usb_hal,
+	u8 *src, u32 len, struct drm_rect *rects, int rect_cnt)
+{
+	struct drm_framebuffer *fb = &efb->base;
+	int ret;
+
+	// imported buffers have no pages of their own, planes would need offsets
+	if (!usb_hal->funcs->update_frame_pages || efb->obj->base.import_attach || !efb->obj->pages ||
+	    fb->offsets[0] || (fb->format->num_planes > 1))
+		return -EOPNOTSUPP;
+
+	drm_framebuffer_get(fb);
+	ret = usb_hal->funcs->update_frame_pages(usb_hal, src, efb->obj->pages, fb->pitches[0], len, fb->format->format,
+		(rect_cnt > 0) ? rects : NULL, rect_cnt, msdisp_drm_fb_release, fb);
+	if (ret)
+		drm_framebuffer_put(fb);
+
+	return ret;
+}
+
+static int msdisp_drm_handle_damage(struct msdisp_drm_framebuffer *efb, struct msdisp_drm_pipeline *pipeline,
+	struct drm_rect* rects, int rect_cnt)
 {
 	struct drm_framebuffer* fb = &efb->base;
 	struct msdisp_usb_hal* usb_hal = pipeline->usb_hal;
+	u8* chroma[2] = { NULL, NULL };
 	u8* src;
-	int len;
+	int len, ret, i;
 
-	
+	src = (u8*)(efb->obj->vmapping) + fb->offsets[0];
+	len = fb->pitches[0] * fb->height;
+	ret = msdisp_drm_send_pages(efb, usb_hal, src, len, rects, rect_cnt);
+	if (ret != -EOPNOTSUPP)
+		return ret;
 
-#if 0
-	rect.x1 = 0;
-    rect.y1 = 0;
-    rect.x2 = fb->width;
-    rect.y2 = fb->height;
+	// fb create checked the planes all live in the first object
+	for (i = 1; i < fb->format->num_planes; i++)
+		chroma[i - 1] = (u8*)(efb->obj->vmapping) + fb->offsets[i];
 
-	dst_pitch = usb_hal->funcs->get_pitch(usb_hal, fb->width, fb->height);
+	return usb_hal->funcs->update_frame(usb_hal, src, fb->pitches[0], len, fb->format->format,
+		chroma[0], chroma[1], fb->pitches[1], (rect_cnt > 0) ? rects : NULL, rect_cnt);
+}
 
-	len = msdisp_fb_xrgb8888_to_bgr888_dstclip(dst_vaddr, dst_pitch, src_vaddr, fb, &rect);
-#endif
-	src = (u8*)(efb->obj->vmapping);
-	len = fb->pitches[0] * fb->height;
-	return usb_hal->funcs->update_frame(usb_hal, src, fb->pitches[0], len, fb->format->format, 1);
+/* the frame of commit has been handed to the hal as frame seq, 0 if it wasn't */
+static void msdisp_drm_frame_sent(struct msdisp_drm_pipeline* pipeline, struct msdisp_drm_frame* frame, u32 seq)
+{
+	struct drm_device* dev = pipeline->crtc->dev;
+	unsigned long flags;
+
+	trace_msdisp_drm_frame_sent(pipeline->id, frame->commit, seq);
+	spin_lock_irqsave(&dev->event_lock, flags);
+	pipeline->sent_commit = frame->commit;
+	pipeline->sent_seq = seq;
+	pipeline->sent_time = frame->commit_time;
+	msdisp_drm_flip_check_locked(pipeline);
+	spin_unlock_irqrestore(&dev->event_lock, flags);
 }
 
+/* map, convert and send what a commit left in pipeline->frame, runs on frame_wq */
+static void msdisp_drm_send_frame(struct msdisp_drm_pipeline* pipeline, struct msdisp_drm_frame* frame)
+{
+	struct drm_device* dev = pipeline->crtc->dev;
+	struct drm_framebuffer *fb = frame->fb;
+	struct msdisp_drm_framebuffer *efb = to_msdisp_drm_fb(fb);
+	struct dma_buf_attachment *import_attach;
+	struct msdisp_usb_hal* usb_hal;
+	u32 seq = 0;
+	int ret;
+
+	if (!efb->obj->vmapping) {
+		if (msdisp_drm_gem_vmap(efb->obj) == -ENOMEM) {
+			dev_err(dev->dev, "Failed to map scanout buffer\n");
+			msdisp_drm_stat_inc(pipeline, vmap_fail);
+			goto out;
+		}
+		if (!efb->obj->vmapping) {
+			dev_err(dev->dev, "Vmapping does not exists!\n");
+			msdisp_drm_stat_inc(pipeline, vmap_null);
+			goto out;
+		}
+	}
+
+	import_attach = efb->obj->base.import_attach;
+	if (import_attach) {
+		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
+					       DMA_FROM_DEVICE);
+		if (ret) {
+			dev_err(dev->dev, "dma_buf begin cpu access failed! ret=%d!\n", ret);
+			msdisp_drm_stat_inc(pipeline, cpu_access_fail);
+			goto out;
+		}
+	}
+
+	if (pipeline->dump_fb_flag) {
+        msdisp_common_save_buf_to_bmp(efb->obj->vmapping, fb->width, fb->height, fb->format->cpp[0], NULL, pipeline->dump_fb_filename);
+        pipeline->dump_fb_flag = 0;
+        dev_info(dev->dev, "msdisp finished save raw fb data to file:%s\n", pipeline->dump_fb_filename);
+    }
+
+	mutex_lock(&pipeline->hal_lock);
+	usb_hal = pipeline->usb_hal;
+	if (usb_hal) {
+		msdisp_common_hist_add(&pipeline->hist_commit_convert, ktime_us_delta(ktime_get(), frame->commit_time));
+	}
+	if (!usb_hal) {
+		msdisp_drm_stat_inc(pipeline, no_usb_hal);
+	} else if (msdisp_drm_handle_damage(efb, pipeline, frame->rects, frame->rect_cnt)) {
+		msdisp_drm_stat_inc(pipeline, handle_fail);
+	} else if (usb_hal->funcs->get_frame_seq) {
+		seq = usb_hal->funcs->get_frame_seq(usb_hal);
+	}
+	mutex_unlock(&pipeline->hal_lock);
+
+	if (import_attach)
+		dma_buf_end_cpu_access(import_attach->dmabuf,
+				       DMA_FROM_DEVICE);
+
+out:
+	msdisp_drm_frame_sent(pipeline, frame, seq);
+}
+
+static void msdisp_drm_frame_work(struct work_struct *work)
+{
+	struct msdisp_drm_pipeline* pipeline = container_of(work, struct msdisp_drm_pipeline, frame_work);
+	struct msdisp_drm_frame frame;
+
+	spin_lock(&pipeline->frame_lock);
+	frame = pipeline->frame;
+	pipeline->frame.fb = NULL;
+	spin_unlock(&pipeline->frame_lock);
+
+	if (!frame.fb) {
+		return;
+	}
+
+	msdisp_drm_send_frame(pipeline, &frame);
+	drm_framebuffer_put(frame.fb);
+}
+
+/* damaged pixels of a commit, only worked out while tracing */
+static u32 msdisp_drm_damage_area(struct drm_framebuffer* fb, const struct drm_rect* rects, int rect_cnt)
+{
+	u32 area = 0;
+	int i;
+
+	if (rect_cnt < 0) {
+		return fb->width * fb->height;
+	}
+
+	for (i = 0; i < rect_cnt; i++) {
+		area += drm_rect_width(&rects[i]) * drm_rect_height(&rects[i]);
+	}
+
+	return area;
+}
+
+/* the damage of a frame never sent is carried over to the one replacing it */
+static void msdisp_drm_frame_merge(struct msdisp_drm_frame* frame, const struct drm_rect* rects, int rect_cnt)
+{
+	int i;
+
+	if ((frame->rect_cnt < 0) || (rect_cnt < 0)) {
+		frame->rect_cnt = -1;
+		return;
+	}
+
+	for (i = 0; i < rect_cnt; i++) {
+		if (frame->rect_cnt < MSDISP_MAX_DAMAGE_RECTS) {
+			frame->rects[frame->rect_cnt++] = rects[i];
+			continue;
+		}
+
+		frame->rects[0].x1 = min(frame->rects[0].x1, rects[i].x1);
+		frame->rects[0].y1 = min(frame->rects[0].y1, rects[i].y1);
+		frame->rects[0].x2 = max(frame->rects[0].x2, rects[i].x2);
+		frame->rects[0].y2 = max(frame->rects[0].y2, rects[i].y2);
+	}
+}
+
+void msdisp_drm_frame_init(struct msdisp_drm_pipeline* pipeline)
+{
+	spin_lock_init(&pipeline->frame_lock);
+	INIT_WORK(&pipeline->frame_work, msdisp_drm_frame_work);
+}
+
+/* wait for the frame worker and drop a frame it hasn't picked up yet */
+void msdisp_drm_frame_flush(struct msdisp_drm_pipeline* pipeline)
+{
+	struct drm_framebuffer *fb;
+
+	spin_lock(&pipeline->frame_lock);
+	fb = pipeline->frame.fb;
+	pipeline->frame.fb = NULL;
+	spin_unlock(&pipeline->frame_lock);
+
+	if (fb) {
+		drm_framebuffer_put(fb);
+	}
+	cancel_work_sync(&pipeline->frame_work);
+}
+
+/*
+ * The commit only takes a reference on the framebuffer and its damage, the
+ * worker on frame_wq maps, converts and sends it. A commit arriving before the
+ * worker picked up the previous one replaces it, so the worker always sends
+ * the newest picture.
+ */
 static void msdisp_drm_plane_atomic_update(struct drm_plane *plane,
 #if KERNEL_VERSION(5, 13, 0) <= LINUX_VERSION_CODE
 				     struct drm_atomic_state *atom_state
@@ -298,15 +661,11 @@ static void msdisp_drm_plane_atomic_update(struct drm_plane *plane,
 	struct drm_plane_state *old_state = drm_atomic_get_old_plane_state(atom_state, plane);
 #else
 #endif
-	struct drm_device* dev;
 	struct msdisp_drm_device *msdisp_drm;
-	struct msdisp_usb_hal* usb_hal;
-	struct drm_framebuffer *fb;
-	struct msdisp_drm_framebuffer *efb;
-	struct dma_buf_attachment *import_attach;
-	struct msdisp_drm_frame_stat* stat;
+	struct drm_framebuffer *fb, *old_fb;
 	struct msdisp_drm_pipeline* pipeline;
-	int ret, lock_flag = 0;
+	struct drm_rect rects[MSDISP_MAX_DAMAGE_RECTS];
+	int rect_cnt = -1;
 
 
 	//printk("%s:entered! pid=%d! comm=%s\n", __func__, task_pid_nr(current), current->comm);
@@ -319,86 +678,61 @@ static void msdisp_drm_plane_atomic_update(struct drm_plane *plane,
 		printk("%s:Plane device is null\n", __func__);
 		return;
 	}
-	dev = plane->dev;
+	msdisp_drm = to_msdisp_drm(plane->dev);
 
 	pipeline = get_pipeline_by_plane(plane);
-	//msdisp_drm = to_msdisp_drm(dev);
-	stat = &pipeline->frame_stat;
-	stat->total++;
+	msdisp_drm_stat_inc(pipeline, total);
 
 	if (!old_state) {
 		//dev_err(dev->dev, "old_state is null!\n");
-		stat->no_old_state++;
+		msdisp_drm_stat_inc(pipeline, no_old_state);
 		return;
 	}
 
-	fb = old_state->fb;
+	// the damage clips describe the new state, convert from its framebuffer
+	fb = plane->state->fb;
 	if (!fb) {
 		//dev_err(dev->dev, "fb is null\n");
-		stat->no_fb++;
+		msdisp_drm_stat_inc(pipeline, no_fb);
 		return;
 	}
 
-	efb = to_msdisp_drm_fb(fb);
-
-	drm_framebuffer_get(&efb->base);
+#if KERNEL_VERSION(5, 0, 0) <= LINUX_VERSION_CODE || defined(EL8)
+	rect_cnt = msdisp_drm_get_damage(old_state, plane->state, rects);
+#endif
 
-	if (!efb->obj->vmapping) {
-		if (msdisp_drm_gem_vmap(efb->obj) == -ENOMEM) {
-			dev_err(dev->dev, "Failed to map scanout buffer\n");
-			stat->vmap_fail++;
-			goto err_fb;
-		}
-		if (!efb->obj->vmapping) {
-			dev_err(dev->dev, "Vmapping does not exists!\n");
-			stat->vmap_null++;
-			goto err_fb;
-		}
+	drm_framebuffer_get(fb);
+	pipeline->commit_seq++;
+	if (trace_msdisp_drm_update_begin_enabled()) {
+		trace_msdisp_drm_update_begin(pipeline->id, pipeline->commit_seq, rect_cnt, msdisp_drm_damage_area(fb, rects, rect_cnt));
 	}
 
-	import_attach = efb->obj->base.import_attach;
-	if (import_attach) {
-		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
-					       DMA_FROM_DEVICE);
-		if (ret) {
-			dev_err(dev->dev, "dma_buf begin cpu access failed! ret=%d!\n", ret);
-			stat->cpu_access_fail++;
-			goto err_fb;
-		}
+	spin_lock(&pipeline->frame_lock);
+	old_fb = pipeline->frame.fb;
+	if (old_fb) {
+		msdisp_drm_frame_merge(&pipeline->frame, rects, rect_cnt);
+		msdisp_drm_stat_inc(pipeline, coalesced);
+	} else {
+		pipeline->frame.rect_cnt = 0;
+		msdisp_drm_frame_merge(&pipeline->frame, rects, rect_cnt);
 	}
+	pipeline->frame.fb = fb;
+	pipeline->frame.commit = pipeline->commit_seq;
+	pipeline->frame.commit_time = ktime_get();
+	spin_unlock(&pipeline->frame_lock);
 
-	if (pipeline->dump_fb_flag) {
-        msdisp_common_save_buf_to_bmp(efb->obj->vmapping, fb->width, fb->height, fb->format->cpp[0], NULL, pipeline->dump_fb_filename);
-        pipeline->dump_fb_flag = 0;
-        dev_info(msdisp_drm->drm.dev, "msdisp finished save raw fb data to file:%s\n", pipeline->dump_fb_filename);
-    }
-
-	mutex_lock(&pipeline->hal_lock);
-	lock_flag = 1;
-	usb_hal = pipeline->usb_hal;
-	if (!pipeline->usb_hal) {
-		//dev_err(dev->dev, "usb_hal is null\n");
-		stat->no_usb_hal++;
-		goto end_cpu_access;
+	if (old_fb) {
+		drm_framebuffer_put(old_fb);
 	}
 
-	
-	if (msdisp_drm_handle_damage(efb, pipeline)) {
-		stat->handle_fail++;
+	if (msdisp_drm_flip_on_done) {
+		// the flip event of this commit waits for its frame
+		pipeline->frame_commit = pipeline->commit_seq;
+		pipeline->frame_armed = 1;
 	}
 
-end_cpu_access:
-	if (import_attach)
-		dma_buf_end_cpu_access(import_attach->dmabuf,
-				       DMA_FROM_DEVICE);
-
-
-err_fb:
-	drm_framebuffer_put(&efb->base);
-
-	if (lock_flag) {
-		mutex_unlock(&pipeline->hal_lock);
-	}
+	queue_work(msdisp_drm->frame_wq, &pipeline->frame_work);
+	trace_msdisp_drm_update_end(pipeline->id, pipeline->commit_seq, !!old_fb);
 }
 
 static const struct drm_plane_helper_funcs msdisp_drm_plane_helper_funcs = {
@@ -410,36 +744,64 @@ static const struct drm_plane_helper_funcs msdisp_drm_plane_helper_funcs = {
 #endif
 };
 
+static void msdisp_drm_plane_destroy(struct drm_plane *plane)
+{
+	drm_plane_cleanup(plane);
+	kfree(to_msdisp_drm_plane(plane));
+}
+
 static const struct drm_plane_funcs msdisp_drm_plane_funcs = {
 	.update_plane = drm_atomic_helper_update_plane,
 	.disable_plane = drm_atomic_helper_disable_plane,
-	.destroy = drm_plane_cleanup,
+	.destroy = msdisp_drm_plane_destroy,
 	.reset = drm_atomic_helper_plane_reset,
 	.atomic_duplicate_state = drm_atomic_helper_plane_duplicate_state,
 	.atomic_destroy_state = drm_atomic_helper_plane_destroy_state,
 };
 
+/* XRGB8888 first, it stays the default. The others are what the chip takes without conversion */
 static const uint32_t formats[] = {
 	DRM_FORMAT_XRGB8888,
 	//DRM_FORMAT_ARGB8888,
 	//DRM_FORMAT_XBGR8888,
 	//DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_RGB888,
+	DRM_FORMAT_BGR888,
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_YUV420,
 };
 
+int msdisp_drm_plane_format_supported(uint32_t format)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (formats[i] == format)
+			return 1;
+	}
+
+	return 0;
+}
+
 static struct drm_plane *msdisp_drm_create_plane(
 		struct drm_device *dev,
+		struct msdisp_drm_pipeline *pipeline,
 		enum drm_plane_type type,
 		const struct drm_plane_helper_funcs *helper_funcs)
 {
+	struct msdisp_drm_plane *msdisp_plane;
 	struct drm_plane *plane;
 	int ret;
 	char *plane_type = (type == DRM_PLANE_TYPE_CURSOR) ? "cursor" : "primary";
 
-	plane = kzalloc(sizeof(*plane), GFP_KERNEL);
-	if (plane == NULL) {
+	msdisp_plane = kzalloc(sizeof(*msdisp_plane), GFP_KERNEL);
+	if (msdisp_plane == NULL) {
 		dev_err(dev->dev, "Failed to allocate %s plane\n", plane_type);
 		return NULL;
 	}
+	msdisp_plane->pipeline = pipeline;
+	plane = &msdisp_plane->base;
 	plane->format_default = true;
 
 	ret = drm_universal_plane_init(dev,
@@ -455,7 +817,7 @@ static struct drm_plane *msdisp_drm_create_plane(
 
 	if (ret) {
 		dev_err(dev->dev, "Failed to initialize %s plane\n", plane_type);
-		kfree(plane);
+		kfree(msdisp_plane);
 		return NULL;
 	}
 
@@ -464,19 +826,28 @@ static struct drm_plane *msdisp_drm_create_plane(
 	return plane;
 }
 
-static struct drm_crtc* msdisp_drm_crtc_init(struct drm_device *dev)
+static struct drm_crtc* msdisp_drm_crtc_init(struct drm_device *dev, struct msdisp_drm_pipeline *pipeline)
 {
+	struct msdisp_drm_crtc* msdisp_crtc = NULL;
 	struct drm_crtc* crtc = NULL;
 	struct drm_plane *primary_plane = NULL;
 	struct drm_plane *cursor_plane = NULL;
 	int status = 0;
 
-	crtc = kzalloc(sizeof(struct drm_crtc), GFP_KERNEL);
-	if (!crtc) {
+	msdisp_crtc = kzalloc(sizeof(struct msdisp_drm_crtc), GFP_KERNEL);
+	if (!msdisp_crtc) {
 		return NULL;
 	}
+	msdisp_crtc->pipeline = pipeline;
+	crtc = &msdisp_crtc->base;
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+	hrtimer_setup(&msdisp_crtc->vblank_timer, msdisp_drm_vblank_timer_func, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&msdisp_crtc->vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	msdisp_crtc->vblank_timer.function = msdisp_drm_vblank_timer_func;
+#endif
 
-	primary_plane = msdisp_drm_create_plane(dev, DRM_PLANE_TYPE_PRIMARY,
+	primary_plane = msdisp_drm_create_plane(dev, pipeline, DRM_PLANE_TYPE_PRIMARY,
 					  &msdisp_drm_plane_helper_funcs);
 
 	if (!primary_plane) {
@@ -498,10 +869,36 @@ static struct drm_crtc* msdisp_drm_crtc_init(struct drm_device *dev)
 	return crtc;
 }
 
+/*
+ * The chip is told its input format at enable, a flip to a framebuffer of
+ * another format goes through a full modeset so the crtc is enabled again.
+ */
+static int msdisp_drm_atomic_check(struct drm_device *dev, struct drm_atomic_state *state)
+{
+	struct drm_plane *plane;
+	struct drm_plane_state *old_plane_state, *new_plane_state;
+	struct drm_crtc_state *crtc_state;
+	int i;
+
+	for_each_oldnew_plane_in_state(state, plane, old_plane_state, new_plane_state, i) {
+		if (!old_plane_state->fb || !new_plane_state->fb || !new_plane_state->crtc)
+			continue;
+		if (old_plane_state->fb->format->format == new_plane_state->fb->format->format)
+			continue;
+
+		crtc_state = drm_atomic_get_crtc_state(state, new_plane_state->crtc);
+		if (IS_ERR(crtc_state))
+			return PTR_ERR(crtc_state);
+		crtc_state->mode_changed = true;
+	}
+
+	return drm_atomic_helper_check(dev, state);
+}
+
 static const struct drm_mode_config_funcs msdisp_drm_mode_funcs = {
 	.fb_create = msdisp_drm_fb_user_fb_create,
 	.atomic_commit = drm_atomic_helper_commit,
-	.atomic_check = drm_atomic_helper_check
+	.atomic_check = msdisp_drm_atomic_check
 };
 
 int msdisp_drm_modeset_init(struct drm_device *dev)
@@ -529,7 +926,7 @@ int msdisp_drm_modeset_init(struct drm_device *dev)
 
 	pipeline_cnt = msdisp_drm_get_pipeline_init_count();
 	for (i = 0; i < pipeline_cnt; i++) {
-		crtc = msdisp_drm_crtc_init(dev);
+		crtc = msdisp_drm_crtc_init(dev, &msdisp_drm->pipeline[i]);
 		if (!crtc) {
 			dev_err(dev->dev, "Failed to init crtc%d\n", i);
 			goto err;
@@ -556,7 +953,7 @@ int msdisp_drm_modeset_init(struct drm_device *dev)
 		continue;
 err:
 		if (crtc) {
-			kfree(crtc);
+			kfree(to_msdisp_drm_crtc(crtc));
 		}
 
 		if (encoder) {
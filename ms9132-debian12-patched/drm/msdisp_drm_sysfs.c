@@ -26,54 +26,62 @@
 static ssize_t msdisp_drm_frame_show(struct device* dev, struct device_attribute* attr, char* buf)
 {
 	struct msdisp_drm_pipeline* pipeline = to_pipeline(dev);
-    struct msdisp_drm_frame_stat* stat = &pipeline->frame_stat;
-	char tmp[256];
-
-	*buf = 0;
-
-	sprintf(tmp, "total:%lld\n", stat->total);
-	strcat(buf, tmp);
-	sprintf(tmp, "no usb hal:%lld\n", stat->no_usb_hal);
-	strcat(buf, tmp);
-	sprintf(tmp, "no old state:%lld\n", stat->no_old_state);
-	strcat(buf, tmp);
-	sprintf(tmp, "no fb:%lld\n", stat->no_fb);
-	strcat(buf, tmp);
-	sprintf(tmp, "vmap fail:%lld\n", stat->vmap_fail);
-	strcat(buf, tmp);
-	sprintf(tmp, "vmap null:%lld\n", stat->vmap_null);
-	strcat(buf, tmp);
-	sprintf(tmp, "cpu access fail:%lld\n", stat->cpu_access_fail);
-	strcat(buf, tmp);
-    sprintf(tmp, "aquire buffer fail:%lld\n", stat->acquire_buf_fail);
-	strcat(buf, tmp);
-	sprintf(tmp, "handle fail:%lld\n", stat->handle_fail);
-	strcat(buf, tmp);
-
-	return strlen(buf);
+	struct msdisp_drm_frame_stat stat;
+	const u64* base = (const u64*)&pipeline->stat_base;
+	u64* cnt = (u64*)&stat;
+	int i, len = 0;
+
+	msdisp_common_stat_read(pipeline->pcpu_stat, &stat);
+	mutex_lock(&pipeline->stat_lock);
+	for (i = 0; i < sizeof(stat) / sizeof(u64); i++) {
+		cnt[i] -= base[i];
+	}
+	mutex_unlock(&pipeline->stat_lock);
+
+	len += sysfs_emit_at(buf, len, "total=%llu\n", stat.total);
+	len += sysfs_emit_at(buf, len, "no_usb_hal=%llu\n", stat.no_usb_hal);
+	len += sysfs_emit_at(buf, len, "no_old_state=%llu\n", stat.no_old_state);
+	len += sysfs_emit_at(buf, len, "no_fb=%llu\n", stat.no_fb);
+	len += sysfs_emit_at(buf, len, "vmap_fail=%llu\n", stat.vmap_fail);
+	len += sysfs_emit_at(buf, len, "vmap_null=%llu\n", stat.vmap_null);
+	len += sysfs_emit_at(buf, len, "cpu_access_fail=%llu\n", stat.cpu_access_fail);
+	len += sysfs_emit_at(buf, len, "acquire_buf_fail=%llu\n", stat.acquire_buf_fail);
+	len += sysfs_emit_at(buf, len, "handle_fail=%llu\n", stat.handle_fail);
+	len += sysfs_emit_at(buf, len, "flip_on_done=%llu\n", stat.flip_on_done);
+	len += sysfs_emit_at(buf, len, "flip_timeout=%llu\n", stat.flip_timeout);
+	len += sysfs_emit_at(buf, len, "renders_saved=%llu\n", stat.renders_saved);
+	len += sysfs_emit_at(buf, len, "coalesced=%llu\n", stat.coalesced);
+
+	return len;
+}
+
+/* any write starts the counters over from zero */
+static ssize_t msdisp_drm_frame_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	struct msdisp_drm_pipeline* pipeline = to_pipeline(dev);
+	struct msdisp_drm_frame_stat stat;
+
+	msdisp_common_stat_read(pipeline->pcpu_stat, &stat);
+	mutex_lock(&pipeline->stat_lock);
+	pipeline->stat_base = stat;
+	mutex_unlock(&pipeline->stat_lock);
+
+	return count;
 }
 
 static ssize_t msdisp_drm_pipeline_info_show(struct device* dev, struct device_attribute* attr, char* buf)
 {
 	struct msdisp_drm_pipeline* pipeline = to_pipeline(dev);
-	char tmp[256];
-
-	*buf = 0;
-
-	sprintf(tmp, "reg hal:%d\n", pipeline->reg_flag);
-	strcat(buf, tmp);
-	sprintf(tmp, "status :%d\n", pipeline->drm_status);
-	strcat(buf, tmp);
-	sprintf(tmp, "width:%d\n", pipeline->drm_width);
-	strcat(buf, tmp);
-	sprintf(tmp, "height:%d\n", pipeline->drm_height);
-	strcat(buf, tmp);
-	sprintf(tmp, "rate:%d\n", pipeline->drm_rate);
-	strcat(buf, tmp);
-	sprintf(tmp, "fb format:%x\n", pipeline->drm_fb_format);
-	strcat(buf, tmp);
-    
-	return strlen(buf);
+	int len = 0;
+
+	len += sysfs_emit_at(buf, len, "reg_hal=%d\n", pipeline->reg_flag);
+	len += sysfs_emit_at(buf, len, "status=%d\n", pipeline->drm_status);
+	len += sysfs_emit_at(buf, len, "width=%d\n", pipeline->drm_width);
+	len += sysfs_emit_at(buf, len, "height=%d\n", pipeline->drm_height);
+	len += sysfs_emit_at(buf, len, "rate=%d\n", pipeline->drm_rate);
+	len += sysfs_emit_at(buf, len, "fb_format=0x%x\n", pipeline->drm_fb_format);
+
+	return len;
 }
 
 static ssize_t msdisp_drm_dump_fb_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
@@ -98,7 +106,7 @@ out:
 }
 
 static DEVICE_ATTR(dump_fb, 0220, NULL, msdisp_drm_dump_fb_store);
-static DEVICE_ATTR(frame, 0444, msdisp_drm_frame_show, NULL);
+static DEVICE_ATTR(frame, 0644, msdisp_drm_frame_show, msdisp_drm_frame_store);
 static DEVICE_ATTR(info, 0444, msdisp_drm_pipeline_info_show, NULL);
 
 static struct attribute* msdisp_drm_attribute[] = {
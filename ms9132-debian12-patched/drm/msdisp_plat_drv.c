@@ -21,6 +21,7 @@
 
 #include "msdisp_plat_drv.h"
 #include "msdisp_plat_dev.h"
+#include "msdisp_drm_drv.h"
 
 
 #define MOD_VER							"1.0.1"
@@ -239,9 +240,12 @@ static int __init msdisp_init(void)
 	dev_set_drvdata(g_ctx.root_dev, &g_ctx);
 
 	usb_register_notify(&g_ctx.usb_notifier);
+	msdisp_drm_debugfs_register();
 	ret = platform_driver_register(&msdisp_platform_driver);
-	if (ret)
+	if (ret) {
+		msdisp_drm_debugfs_unregister();
 		return ret;
+	}
 
 	if (msdisp_initial_device_count)
 		return msdisp_platform_add_devices(
@@ -254,6 +258,7 @@ static void __exit msdisp_exit(void)
 {
 	msdisp_platform_remove_all_devices(g_ctx.root_dev);
 	platform_driver_unregister(&msdisp_platform_driver);
+	msdisp_drm_debugfs_unregister();
 
 	if (!PTR_ERR_OR_ZERO(g_ctx.root_dev)) {
 		usb_unregister_notify(&g_ctx.usb_notifier);
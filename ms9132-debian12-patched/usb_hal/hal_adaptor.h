@@ -21,6 +21,7 @@
 #define SDRAM_TYPE_TO_SIZE(a)        ((2 * 1024 * 1024) << (a))
 
 struct usb_device;
+struct urb;
 struct usb_device_id;
 //enum drm_mode_status;
 //struct drm_display_mode;
@@ -41,7 +42,14 @@ struct msdisp_hal_funcs
     s32 (*set_video_in_info)(struct usb_device* udev, u16 width, u16 height, u8 color, u8 byte_sel);
     s32 (*set_video_out_info)(struct usb_device* udev, u8 index, u8 color, u16 width, u16 height);
     s32 (*trigger_frame)(struct usb_device* udev, u8 index, u8 delay);
+    /* optional, prepares trigger_frame as a control urb that can be submitted from atomic context */
+    s32 (*fill_trigger_urb)(struct usb_device* udev, struct urb* urb, u8* setup, u8* buf, u32 buf_len, u8 index, u8 delay,
+        void (*complete)(struct urb* urb), void* context);
     s32 (*set_trans_mode)(struct usb_device* udev, u8 mode, u8* param, u8 param_cnt);
+    /* optional, manual block transfers: block alignment in pixels and the wire framing */
+    u8  (*get_block_align)(void);
+    s32 (*fill_block_header)(u8* buf, u32 len, u16 x, u16 y, u16 width, u16 height);
+    s32 (*fill_block_end)(u8* buf, u32 len);
     s32 (*set_trans_enable)(struct usb_device* udev, u8 enable);
     s32 (*set_video_enable)(struct usb_device* udev, u8 enable);
     s32 (*set_power_enable)(struct usb_device* udev, u8 enable);
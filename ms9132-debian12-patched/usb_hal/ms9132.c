@@ -458,6 +458,37 @@ s32 ms9132_trigger_frame(struct usb_device* udev, u8 index, u8 delay)
     return ms9132_hid_report(udev, 1, &hid, sizeof(hid));
 }
 
+/*
+ * Same report as ms9132_trigger_frame, built into caller owned setup and data
+ * buffers so the urb can be submitted from a bulk completion without sleeping.
+ */
+s32 ms9132_fill_trigger_urb(struct usb_device* udev, struct urb* urb, u8* setup, u8* buf, u32 buf_len, u8 index, u8 delay,
+    void (*complete)(struct urb* urb), void* context)
+{
+    struct usb_ctrlrequest* req = (struct usb_ctrlrequest*)setup;
+    struct ms9132_hid_video* hid = (struct ms9132_hid_video*)buf;
+
+    if (buf_len < sizeof(*hid)) {
+        return -EINVAL;
+    }
+
+    memset(hid, 0, sizeof(*hid));
+    hid->op = MS9132_HID_OP_VIDEO;
+    hid->sub_op = MS9132_HID_SUBOP_VIDEO_TRIGGER_FRAME;
+    hid->info.frame_index.index = index;
+    hid->info.frame_index.delay = delay;
+
+    req->bRequestType = MS9132_REQUEST_TYPE_SET;
+    req->bRequest = HID_REQ_SET_REPORT;
+    req->wValue = cpu_to_le16(MS9132_REQUEST_VALUE);
+    req->wIndex = cpu_to_le16(MS9132_REQUEST_INTERFACE);
+    req->wLength = cpu_to_le16(sizeof(*hid));
+
+    usb_fill_control_urb(urb, udev, usb_sndctrlpipe(udev, 0), setup, buf, sizeof(*hid), complete, context);
+
+    return 0;
+}
+
 s32 ms9132_set_trans_mode(struct usb_device* udev, u8 mode, u8* param, u8 param_cnt)
 {
     struct ms9132_hid_video hid;
@@ -494,6 +525,46 @@ s32 ms9132_set_trans_mode(struct usb_device* udev, u8 mode, u8* param, u8 param_
     return ms9132_hid_report(udev, 1, &hid, sizeof(hid));
 }
 
+u8 ms9132_get_block_align(void)
+{
+    return MS9132_BLOCK_ALIGN;
+}
+
+s32 ms9132_fill_block_header(u8* buf, u32 len, u16 x, u16 y, u16 width, u16 height)
+{
+    struct ms9132_block_header* hdr = (struct ms9132_block_header*)buf;
+
+    if ((len < sizeof(*hdr)) || (x % MS9132_BLOCK_ALIGN) || (width % MS9132_BLOCK_ALIGN)) {
+        return -EINVAL;
+    }
+
+    hdr->tag = MS9132_BLOCK_TAG;
+    hdr->type = MS9132_BLOCK_TAG_HEADER;
+    hdr->x = x / MS9132_BLOCK_ALIGN;
+    hdr->y_hi = ((y & 0xff00) >> 8);
+    hdr->y_lo = (y & 0xff);
+    hdr->width = width / MS9132_BLOCK_ALIGN;
+    hdr->height_hi = ((height & 0xff00) >> 8);
+    hdr->height_lo = (height & 0xff);
+
+    return sizeof(*hdr);
+}
+
+s32 ms9132_fill_block_end(u8* buf, u32 len)
+{
+    struct ms9132_block_header* hdr = (struct ms9132_block_header*)buf;
+
+    if (len < sizeof(*hdr)) {
+        return -EINVAL;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->tag = MS9132_BLOCK_TAG;
+    hdr->type = MS9132_BLOCK_TAG_END;
+
+    return sizeof(*hdr);
+}
+
 s32 ms9132_set_trans_enable(struct usb_device* udev, u8 enable)
 {
     struct ms9132_hid_video hid;
@@ -867,7 +938,11 @@ const struct msdisp_hal_funcs ms9132_funcs = {
     .set_video_in_info = ms9132_set_video_in_info,
     .set_video_out_info = ms9132_set_video_out_info,
     .trigger_frame = ms9132_trigger_frame,
+    .fill_trigger_urb = ms9132_fill_trigger_urb,
     .set_trans_mode = ms9132_set_trans_mode,
+    .get_block_align = ms9132_get_block_align,
+    .fill_block_header = ms9132_fill_block_header,
+    .fill_block_end = ms9132_fill_block_end,
     .set_trans_enable = ms9132_set_trans_enable,
     .set_video_enable = ms9132_set_video_enable,
     .set_power_enable = ms9132_set_power_enable,
@@ -72,9 +72,31 @@
 #define MS9132_TRANS_MODE_BYPASS_FRAME                  4
 #define MS9132_TRANS_MODE_BYPASS_MANAUAL_BLOCK          5
 
+/*
+ * Block header of the manual block transfer mode, followed by width * height
+ * pixels of the block. x and width are counted in MS9132_BLOCK_ALIGN pixels.
+ * Not documented for ms9132, this is the layout used by the ms912x family.
+ */
+#define MS9132_BLOCK_ALIGN                              16
+#define MS9132_BLOCK_TAG                                0xff
+#define MS9132_BLOCK_TAG_HEADER                         0x00
+#define MS9132_BLOCK_TAG_END                            0xc0
+
 
 #define HID_INFO_LEN                                    8
 
+struct ms9132_block_header
+{
+    u8 tag;
+    u8 type;
+    u8 x;
+    u8 y_hi;
+    u8 y_lo;
+    u8 width;
+    u8 height_hi;
+    u8 height_lo;
+};
+
 struct ms9132_hid_read_data
 {
     u8 op;
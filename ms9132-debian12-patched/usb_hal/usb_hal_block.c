@@ -0,0 +1,224 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_block.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/usb.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_buf.h"
+#include "usb_hal_xfer.h"
+#include "usb_hal_block.h"
+#include "hal_adaptor.h"
+
+/* room reserved for each block header and for the end marker */
+#define USB_HAL_BLOCK_HEADER_MAX                16
+
+/*
+ * Manual block transfers. Instead of the whole staging buffer only the changed
+ * rectangles are sent, each behind a block header from the hal, and the frame
+ * ends with an end marker before the trigger.
+ *
+ * The chip scans out of two frame slots and every frame is written to the slot
+ * the following trigger shows, so consecutive frames alternate slots. A slot has
+ * to catch up on every change made since it was last written, not only on the
+ * latest frame. The converter numbers its frames and keeps the damage of the
+ * last USB_HAL_BLOCK_HIST_CNT of them, the sender remembers which frame each slot
+ * holds and sends the union of the damage in between. Anything it can't account
+ * for (a failed transfer, a slot too far behind, a resend) sends the whole frame.
+ */
+
+/*
+ * New mode, nothing is known about the slots. Block mode only when the hal
+ * supports it and the mode width is block aligned, returns the transfer mode.
+ */
+u8 usb_hal_block_enable(struct usb_hal_dev* usb_dev, struct usb_hal_video_mode* mode)
+{
+	const struct msdisp_hal_funcs* funcs = usb_dev->hal_dev->funcs;
+	u8 align;
+	int i;
+
+	spin_lock(&usb_dev->buf_lock);
+	for (i = 0; i < USB_HAL_FRAME_SLOT_CNT; i++) {
+		usb_dev->slot_seq[i] = 0;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	if (!usb_dev->block_mode) {
+		return USH_HAL_TRANS_MODE_FRAME;
+	}
+
+	align = funcs->get_block_align();
+	if (align && (mode->width % align)) {
+		dev_info(&usb_dev->udev->dev, "width:%d not aligned to %d, use frame mode\n", mode->width, align);
+		return USH_HAL_TRANS_MODE_FRAME;
+	}
+
+	return USH_HAL_TRANS_MODE_MANUAL_BLOCK;
+}
+
+/* number the frame converted into usb_buf and keep its damage, rects == NULL is the whole frame */
+void usb_hal_block_record(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, const struct usb_hal_rect* rects, int rect_cnt)
+{
+	struct usb_hal_block_hist* hist;
+	u32 seq;
+	int i;
+
+	seq = ++usb_dev->block_seq;
+	if (!seq) {
+		seq = ++usb_dev->block_seq;
+	}
+
+	hist = &usb_dev->block_hist[seq % USB_HAL_BLOCK_HIST_CNT];
+	spin_lock(&usb_dev->buf_lock);
+	hist->seq = seq;
+	memset(&hist->damage, 0, sizeof(hist->damage));
+	if (!rects) {
+		hist->damage.full = 1;
+	} else {
+		for (i = 0; i < rect_cnt; i++) {
+			usb_hal_damage_add(&hist->damage, &rects[i]);
+		}
+	}
+	usb_buf->seq = seq;
+	spin_unlock(&usb_dev->buf_lock);
+}
+
+/* what a slot holding frame from needs to show frame to, lock held */
+static void usb_hal_block_collect_locked(struct usb_hal_dev* usb_dev, u32 from, u32 to, struct usb_hal_damage* damage)
+{
+	struct usb_hal_block_hist* hist;
+	u32 seq;
+
+	memset(damage, 0, sizeof(*damage));
+	if (!from || !to || ((s32)(to - from) < 0) || ((to - from) >= USB_HAL_BLOCK_HIST_CNT)) {
+		damage->full = 1;
+		return;
+	}
+
+	for (seq = from + 1; seq != to + 1; seq++) {
+		hist = &usb_dev->block_hist[seq % USB_HAL_BLOCK_HIST_CNT];
+		if (hist->seq != seq) {
+			damage->full = 1;
+			return;
+		}
+		usb_hal_damage_merge(damage, &hist->damage);
+	}
+}
+
+/* pack the damaged blocks of usb_buf into block_buf, returns the bytes to send */
+static u32 usb_hal_block_pack(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, struct usb_hal_damage* damage)
+{
+	const struct msdisp_hal_funcs* funcs = usb_dev->hal_dev->funcs;
+	struct usb_hal_buffer* out = &usb_dev->block_buf;
+	struct usb_hal_rect rect[USB_HAL_MAX_RECTS];
+	int width = usb_dev->mode.width;
+	int height = usb_dev->mode.height;
+	u32 line, cpp, total, pos = 0;
+	u8 align = funcs->get_block_align();
+	int i, y, cnt, ret;
+
+	if (!width || !height) {
+		return 0;
+	}
+
+	line = usb_buf->len / height;
+	cpp = line / width;
+	align = align ? align : 1;
+
+	cnt = damage->full ? 0 : damage->cnt;
+	for (i = 0; i < cnt; i++) {
+		rect[i].x1 = round_down(damage->rect[i].x1, align);
+		rect[i].x2 = min_t(int, round_up(damage->rect[i].x2, align), width);
+		rect[i].y1 = damage->rect[i].y1;
+		rect[i].y2 = damage->rect[i].y2;
+	}
+
+	// overlapping rectangles may add up to more than the buffer, send it whole then
+	total = USB_HAL_BLOCK_HEADER_MAX;
+	for (i = 0; i < cnt; i++) {
+		total += USB_HAL_BLOCK_HEADER_MAX + (rect[i].x2 - rect[i].x1) * (rect[i].y2 - rect[i].y1) * cpp;
+	}
+	if (damage->full || (total > out->size)) {
+		rect[0].x1 = 0;
+		rect[0].y1 = 0;
+		rect[0].x2 = width;
+		rect[0].y2 = height;
+		cnt = 1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		ret = funcs->fill_block_header(out->buf + pos, out->size - pos, rect[i].x1, rect[i].y1,
+			rect[i].x2 - rect[i].x1, rect[i].y2 - rect[i].y1);
+		if (ret < 0) {
+			dev_err(&usb_dev->udev->dev, "fill block header failed! ret=%d\n", ret);
+			continue;
+		}
+		pos += ret;
+
+		for (y = rect[i].y1; y < rect[i].y2; y++) {
+			memcpy(out->buf + pos, usb_buf->buf + y * line + rect[i].x1 * cpp, (rect[i].x2 - rect[i].x1) * cpp);
+			pos += (rect[i].x2 - rect[i].x1) * cpp;
+		}
+	}
+
+	ret = funcs->fill_block_end(out->buf + pos, out->size - pos);
+	if (ret > 0) {
+		pos += ret;
+	}
+
+	usb_hal_stat_inc(usb_dev, block_frames);
+	usb_hal_stat_add(usb_dev, block_rects, cnt);
+	usb_hal_stat_add(usb_dev, block_bytes, pos);
+
+	return pos;
+}
+
+/* start sending the blocks that bring the next slot up to usb_buf, returns the slot */
+int usb_hal_block_send(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer, struct usb_hal_buffer* usb_buf, int resend)
+{
+	struct usb_hal_damage damage;
+	int slot = ((0 == usb_dev->frame_index) ? 1 : 0);
+	u32 len;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_hal_block_collect_locked(usb_dev, usb_dev->slot_seq[slot], usb_buf->seq, &damage);
+	// unknown until the transfer made it
+	usb_dev->slot_seq[slot] = 0;
+	spin_unlock(&usb_dev->buf_lock);
+
+	if (resend) {
+		damage.full = 1;
+	}
+
+	len = usb_hal_block_pack(usb_dev, usb_buf, &damage);
+	// tracepoints follow the frame through the block buffer
+	usb_dev->block_buf.frame_seq = usb_buf->frame_seq;
+	usb_hal_xfer_begin(xfer, &usb_dev->block_buf, len, len);
+
+	return slot;
+}
+
+void usb_hal_block_done(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, int slot, int success)
+{
+	if (!success) {
+		return;
+	}
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_dev->slot_seq[slot] = usb_buf->seq;
+	spin_unlock(&usb_dev->buf_lock);
+}
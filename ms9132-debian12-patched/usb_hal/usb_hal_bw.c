@@ -0,0 +1,156 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_bw.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/math64.h>
+#include <linux/kobject.h>
+#include <linux/usb.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_bw.h"
+
+/*
+ * What the adapter puts on the bus: bulk data of the frames, the zero length
+ * packets ending them and the trigger_frame control transfers. The host
+ * controller is shared with everything else on it, see XHCI_CONTENTION.md, so
+ * utilization is given against what bulk gets in practice at the link speed,
+ * not the signalling rate.
+ */
+
+static unsigned short usb_hal_bw_uevent_pct = 80;
+module_param_named(bw_uevent_pct, usb_hal_bw_uevent_pct, ushort, 0644);
+MODULE_PARM_DESC(bw_uevent_pct, "Link utilization in percent over 10s that sends a change uevent, 0 to disable (default: 80)");
+
+static u64 usb_hal_bw_capacity(enum usb_device_speed speed)
+{
+	switch (speed) {
+	case USB_SPEED_LOW:
+		return 150 * 1000;
+	case USB_SPEED_FULL:
+		return 1000 * 1000;
+	case USB_SPEED_HIGH:
+	case USB_SPEED_WIRELESS:
+		return 40 * 1000 * 1000;
+	case USB_SPEED_SUPER:
+		return 400 * 1000 * 1000;
+#if KERNEL_VERSION(4, 6, 0) <= LINUX_VERSION_CODE
+	case USB_SPEED_SUPER_PLUS:
+		return 900 * 1000 * 1000;
+#endif
+	default:
+		return 40 * 1000 * 1000;
+	}
+}
+
+void usb_hal_bw_init(struct usb_hal_dev* usb_dev)
+{
+	spin_lock_init(&usb_dev->rate.lock);
+	usb_dev->bw_capacity = usb_hal_bw_capacity(usb_dev->udev->speed);
+	dev_info(&usb_dev->udev->dev, "link speed:%s capacity:%llu bytes/s\n", usb_speed_string(usb_dev->udev->speed),
+		usb_dev->bw_capacity);
+}
+
+void usb_hal_bw_add(struct usb_hal_dev* usb_dev, int kind, u64 bytes, u32 cnt)
+{
+	struct usb_hal_rate* rate = &usb_dev->rate;
+	time64_t sec = ktime_get_seconds();
+	int slot = (int)(sec % USB_HAL_RATE_SLOTS);
+	unsigned long flags;
+
+	spin_lock_irqsave(&rate->lock, flags);
+	if (rate->sec[slot] != sec) {
+		rate->sec[slot] = sec;
+		memset(rate->bytes[slot], 0, sizeof(rate->bytes[slot]));
+		memset(rate->cnt[slot], 0, sizeof(rate->cnt[slot]));
+	}
+	rate->bytes[slot][kind] += bytes;
+	rate->cnt[slot][kind] += cnt;
+	spin_unlock_irqrestore(&rate->lock, flags);
+}
+
+void usb_hal_bw_sum(struct usb_hal_dev* usb_dev, int window, u64* bytes, u64* cnt)
+{
+	struct usb_hal_rate* rate = &usb_dev->rate;
+	time64_t now = ktime_get_seconds();
+	unsigned long flags;
+	int i, k;
+
+	memset(bytes, 0, sizeof(u64) * USB_HAL_BW_KIND_CNT);
+	memset(cnt, 0, sizeof(u64) * USB_HAL_BW_KIND_CNT);
+
+	// only whole seconds count, the current one is still filling
+	spin_lock_irqsave(&rate->lock, flags);
+	for (i = 0; i < USB_HAL_RATE_SLOTS; i++) {
+		if ((rate->sec[i] >= now) || (rate->sec[i] < now - window)) {
+			continue;
+		}
+		for (k = 0; k < USB_HAL_BW_KIND_CNT; k++) {
+			bytes[k] += rate->bytes[i][k];
+			cnt[k] += rate->cnt[i][k];
+		}
+	}
+	spin_unlock_irqrestore(&rate->lock, flags);
+}
+
+u32 usb_hal_bw_util(struct usb_hal_dev* usb_dev, u64 bytes, int window)
+{
+	if (!usb_dev->bw_capacity || (window <= 0)) {
+		return 0;
+	}
+
+	return (u32)div64_u64(bytes * 1000, usb_dev->bw_capacity * window);
+}
+
+void usb_hal_bw_check(struct usb_hal_dev* usb_dev)
+{
+	struct usb_interface* interface = usb_dev->hal->interface;
+	time64_t now = ktime_get_seconds();
+	u64 bytes[USB_HAL_BW_KIND_CNT], cnt[USB_HAL_BW_KIND_CNT];
+	u64 total;
+	u32 util, pct = usb_hal_bw_uevent_pct;
+	char state[24], util_env[32], bps_env[40];
+	char* envp[] = { state, util_env, bps_env, NULL };
+	int high;
+
+	if (!pct || (usb_dev->bw_check_sec == now)) {
+		return;
+	}
+	usb_dev->bw_check_sec = now;
+
+	usb_hal_bw_sum(usb_dev, USB_HAL_BW_CHECK_WINDOW, bytes, cnt);
+	total = bytes[USB_HAL_BW_DATA] + bytes[USB_HAL_BW_CTRL];
+	util = usb_hal_bw_util(usb_dev, total, USB_HAL_BW_CHECK_WINDOW);
+
+	// util is per mille, go back to normal only well below the threshold
+	if (usb_dev->bw_high) {
+		high = (util + USB_HAL_BW_HYSTERESIS * 10 >= pct * 10);
+	} else {
+		high = (util >= pct * 10);
+	}
+	if (high == usb_dev->bw_high) {
+		return;
+	}
+	usb_dev->bw_high = high;
+
+	snprintf(state, sizeof(state), "MSDISP_BW=%s", high ? "high" : "normal");
+	snprintf(util_env, sizeof(util_env), "MSDISP_BW_UTIL=%u.%u", util / 10, util % 10);
+	snprintf(bps_env, sizeof(bps_env), "MSDISP_BW_BPS=%llu", div_u64(total, USB_HAL_BW_CHECK_WINDOW));
+	dev_info(&interface->dev, "link utilization %s: %u.%u%%\n", high ? "high" : "normal", util / 10, util % 10);
+	kobject_uevent_env(&interface->dev.kobj, KOBJ_CHANGE, envp);
+}
@@ -0,0 +1,37 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_bw.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_BW_H__
+#define __USB_HAL_BW_H__
+
+#include <linux/types.h>
+
+/* points of utilization below the threshold before it is reported normal again */
+#define USB_HAL_BW_HYSTERESIS                   10
+/* window the threshold is checked on, seconds */
+#define USB_HAL_BW_CHECK_WINDOW                 10
+
+struct usb_hal_dev;
+
+void usb_hal_bw_init(struct usb_hal_dev* usb_dev);
+/* cnt transfers of kind carried bytes, any context */
+void usb_hal_bw_add(struct usb_hal_dev* usb_dev, int kind, u64 bytes, u32 cnt);
+/* totals per kind over the last window whole seconds */
+void usb_hal_bw_sum(struct usb_hal_dev* usb_dev, int window, u64* bytes, u64* cnt);
+/* per mille of the link capacity used by bytes over window seconds */
+u32 usb_hal_bw_util(struct usb_hal_dev* usb_dev, u64 bytes, int window);
+/* sender thread, sends a uevent once utilization crosses bw_uevent_pct */
+void usb_hal_bw_check(struct usb_hal_dev* usb_dev);
+
+#endif
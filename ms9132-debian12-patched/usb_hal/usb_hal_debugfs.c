@@ -0,0 +1,94 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_debugfs.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_debugfs.h"
+#include "usb_hal_bw.h"
+
+/*
+ * Where the time of a frame goes, one file per stage under <pipeline>/hal:
+ *   convert_us      wall time of converting a frame into the staging buffer
+ *   convert_cpu_us  cpu time of that, summed over all stripe workers
+ *   xfer_us         first bulk urb submitted to the last one completed
+ *   trigger_us      trigger_frame control urb round trip
+ *   rate            data bytes and frames per second over the last 1, 10 and 60 seconds,
+ *                   all kinds of traffic are in the bandwidth attribute in sysfs
+ * Counters are only ever added to, reading them never stops the sender.
+ */
+
+static int usb_hal_rate_show(struct seq_file* m, void* data)
+{
+	static const int windows[] = { 1, 10, 60 };
+	struct usb_hal_dev* usb_dev = m->private;
+	u64 bytes[USB_HAL_BW_KIND_CNT], cnt[USB_HAL_BW_KIND_CNT];
+	u64 frames;
+	int w;
+
+	for (w = 0; w < ARRAY_SIZE(windows); w++) {
+		usb_hal_bw_sum(usb_dev, windows[w], bytes, cnt);
+		frames = cnt[USB_HAL_BW_DATA];
+		seq_printf(m, "%2ds bytes/s:%llu frames/s:%llu.%02llu\n", windows[w], div_u64(bytes[USB_HAL_BW_DATA], windows[w]),
+			div_u64(frames, windows[w]), div_u64((frames % windows[w]) * 100, windows[w]));
+	}
+
+	return 0;
+}
+
+static int usb_hal_rate_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, usb_hal_rate_show, inode->i_private);
+}
+
+static const struct file_operations usb_hal_rate_fops = {
+	.owner = THIS_MODULE,
+	.open = usb_hal_rate_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void usb_hal_debugfs_init(struct usb_hal* hal, struct dentry* parent)
+{
+	struct usb_hal_dev* usb_dev = (struct usb_hal_dev*)hal->private;
+	struct dentry* dir;
+
+	if (IS_ERR_OR_NULL(parent) || usb_dev->debugfs) {
+		return;
+	}
+
+	dir = debugfs_create_dir("hal", parent);
+	if (IS_ERR_OR_NULL(dir)) {
+		return;
+	}
+
+	debugfs_create_file("convert_us", 0444, dir, &usb_dev->hist_convert, &msdisp_common_hist_fops);
+	debugfs_create_file("convert_cpu_us", 0444, dir, &usb_dev->hist_convert_cpu, &msdisp_common_hist_fops);
+	debugfs_create_file("xfer_us", 0444, dir, &usb_dev->hist_xfer, &msdisp_common_hist_fops);
+	debugfs_create_file("trigger_us", 0444, dir, &usb_dev->hist_trigger, &msdisp_common_hist_fops);
+	debugfs_create_file("rate", 0444, dir, usb_dev, &usb_hal_rate_fops);
+	usb_dev->debugfs = dir;
+}
+
+void usb_hal_debugfs_exit(struct usb_hal_dev* usb_dev)
+{
+	debugfs_remove_recursive(usb_dev->debugfs);
+	usb_dev->debugfs = NULL;
+}
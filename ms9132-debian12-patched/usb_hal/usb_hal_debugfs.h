@@ -0,0 +1,24 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_debugfs.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_DEBUGFS_H__
+#define __USB_HAL_DEBUGFS_H__
+
+#include <linux/types.h>
+
+struct usb_hal_dev;
+
+void usb_hal_debugfs_exit(struct usb_hal_dev* usb_dev);
+
+#endif
@@ -19,17 +19,31 @@
 #include <linux/types.h>
 #include <linux/mutex.h>
 #include <linux/kthread.h>
-#include <linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 
 #include "usb_hal_interface.h"
+#include "msdisp_common_util.h"
 
 #define USH_HAL_TRANS_MODE_FRAME                      0
+#define USH_HAL_TRANS_MODE_MANUAL_BLOCK               3
 
 #define USB_HAL_COLOR_FORMAT_RGB565                   0    
 #define USB_HAL_COLOR_FORMAT_RGB888                   1
 #define USB_HAL_COLOR_FORMAT_YUV422                   2
 #define USB_HAL_COLOR_FORMAT_YUV444                   3
 
+/* what 32bpp RGB planes are packed into for the wire, applies at the next enable */
+#define USB_HAL_WIRE_FORMAT_RGB888                    0
+#define USB_HAL_WIRE_FORMAT_RGB565                    1
+#define USB_HAL_WIRE_FORMAT_YUV422                    2
+#define USB_HAL_WIRE_FORMAT_CNT                       3
+
 #define USB_HAL_DEV_STATE_UNKNOWN                0
 #define USB_HAL_DEV_STATE_ENABLED                1
 #define USB_HAL_DEV_STATE_DISABLED               2
@@ -41,17 +55,133 @@
 #define USB_HAL_BUF_TYPE_DMA		                1
 #define USB_HAL_BUF_TYPE_KMALLOC	                2
 #define USB_HAL_BUF_TYPE_VMALLOC                 3
+/* zero-copy, pages borrowed from the framebuffer */
+#define USB_HAL_BUF_TYPE_PAGES                   4
+
+#define USB_HAL_BUF_STATE_FREE                   0
+#define USB_HAL_BUF_STATE_FILLING                1
+#define USB_HAL_BUF_STATE_READY                  2
+#define USB_HAL_BUF_STATE_INFLIGHT               3
+#define USB_HAL_BUF_STATE_SHOWN                  4
 
+#define USB_HAL_BUF_CNT                          3
+/* zero-copy buffers, as many as staging ones so one is always free, see usb_hal_buf.c */
+#define USB_HAL_ZC_BUF_CNT                       3
 #define USB_HAL_BUF_SIZE			                (6 * 1024 * 1024)
 #define USB_HAL_BUF_DEF_LEN			            (3 * 1920 * 1080)
 
 #define USB_HAL_MAX_CUSTOM_MODE                 16
 
-struct sg_table;
+/* frames of damage kept for catching up the chip's frame slots in block mode */
+#define USB_HAL_BLOCK_HIST_CNT                  16
+#define USB_HAL_FRAME_SLOT_CNT                  2
+
+/* seconds of throughput kept */
+#define USB_HAL_RATE_SLOTS                      64
+
+/* kinds of traffic accounted per second, see usb_hal_bw.c */
+#define USB_HAL_BW_DATA                         0
+#define USB_HAL_BW_ZLP                          1
+#define USB_HAL_BW_CTRL                         2
+#define USB_HAL_BW_KIND_CNT                     3
+
+/* frame rate governor states, see usb_hal_gov.c */
+#define USB_HAL_GOV_STATIC                      0
+#define USB_HAL_GOV_IDLE                        1
+#define USB_HAL_GOV_ACTIVE                      2
+/* rows hashed per frame are every USB_HAL_GOV_SAMPLE_STEP one, phase rotating */
+#define USB_HAL_GOV_SAMPLE_STEP                 16
+
+struct page;
 struct usb_device;
 struct kfifo;
+struct dentry;
 
 struct msdisp_hal_dev;
+struct usb_hal_xfer;
+struct usb_hal_stripe;
+
+/* rectangles of a frame, full means the whole mode */
+struct usb_hal_damage
+{
+	struct usb_hal_rect rect[USB_HAL_MAX_RECTS];
+	int cnt;
+	int full;
+};
+
+struct usb_hal_conv;
+
+/* how frames are converted for the enabled mode and fourcc, resolved at enable */
+struct usb_hal_plan
+{
+	u32 fourcc;
+	/* columns x1..x2 of rows y..y+rows into the staging buffer */
+	void (*convert)(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows);
+	/* output bytes per row and per frame */
+	u32 line;
+	u32 out_len;
+	/* source bytes per pixel of the first plane */
+	u8 cpp;
+	/* separate chroma planes the source comes with, 2 for u and v */
+	u8 chroma_planes;
+	/* 32bpp source keeps the XRGB byte order */
+	u8 is_rgb;
+	/* damage clips are honoured, otherwise frames are converted whole */
+	u8 damage;
+	/* stripes may be sent while the rest of the frame is converted */
+	u8 stream;
+	/* the chip takes the source as it is, frames may go out zero-copy */
+	u8 native;
+};
+
+/*
+ * Bytes and transfers per second and kind of traffic, slot sec % USB_HAL_RATE_SLOTS.
+ * Data counts frames, zlp and ctrl count the transfers themselves.
+ */
+struct usb_hal_rate
+{
+	spinlock_t lock;
+	time64_t sec[USB_HAL_RATE_SLOTS];
+	u64 bytes[USB_HAL_RATE_SLOTS][USB_HAL_BW_KIND_CNT];
+	u32 cnt[USB_HAL_RATE_SLOTS][USB_HAL_BW_KIND_CNT];
+};
+
+/*
+ * Adaptive frame rate, thresholds are settable per device in sysfs. Load is the
+ * damage of the last window in per mille of the mode's pixels times its rate.
+ * Written by the converter, read by the sender thread.
+ */
+struct usb_hal_gov
+{
+    u32 enable;
+    u32 idle_fps;
+    u32 static_fps;
+    u32 active_pct;
+    u32 idle_pct;
+    u32 hold_ms;
+    u32 static_ms;
+
+    int state;
+    u32 load;
+    ktime_t window_start;
+    u64 window_pixels;
+    ktime_t last_active;
+    ktime_t last_change;
+    /* last frame taken for the wire, resends included */
+    u64 last_send_ns;
+    /* hashes of the sampled rows of full frames, one per phase */
+    u32 phase;
+    u32 sample_valid;
+    u32 sample[USB_HAL_GOV_SAMPLE_STEP];
+    /* wakes the sender once a held frame is due */
+    struct hrtimer timer;
+};
+
+struct usb_hal_block_hist
+{
+	u32 seq;
+	struct usb_hal_damage damage;
+};
 
 struct usb_hal_buffer
 {
@@ -60,19 +190,96 @@ struct usb_hal_buffer
     u32 len; 
     dma_addr_t dma_addr;
 	u32 type;
-    struct mutex mutex;
-	struct sg_table* sgt;
+	int index;
+	/* USB_HAL_BUF_STATE_*, protected by usb_hal_dev.buf_lock */
+	int state;
+	ktime_t frame_start;
+	/* frame number for block mode, 0 if unknown */
+	u32 seq;
+	/* frame number handed to frame_done once sent, 0 for none */
+	u32 frame_seq;
+	/* in flight but sent as manual blocks by the sender thread */
+	int block;
+	/* areas changed since this buffer was last written, only touched by the converter */
+	struct usb_hal_damage stale;
+	/* vmalloc buffer or framebuffer pages, used to build per urb scatterlists */
+	struct page** pages;
+	u32 page_cnt;
+	/* zero-copy buffers only, gives the pages back once the buffer is free again */
+	void (*release)(void* ctx);
+	void* release_ctx;
 };
 
+/*
+ * Event counters, kept per cpu and summed on read, see usb_hal_stat_add().
+ * Only u64 fields, usb_hal_sysfs.c adds them up as an array.
+ */
 struct usb_hal_dev_frame_stat {
     u64 send_total;
     u64 send_success;
     u64 update_event;
     u64 period_send;
     u64 state_error;
-    u64 try_lock_fail;
+    u64 no_free_buf;
+    u64 urb_submit;
+    u64 urb_complete;
+    u64 urb_error;
+    u64 urb_timeout;
+    u64 trigger_submit;
+    u64 trigger_error;
+    u64 xfer_bytes;
+    u64 xfer_time_us;
+    u64 stream_frames;
+    u64 stripe_frames;
+    u64 ready_replaced;
+    u64 event_wait;
+    u64 event_lost;
+    u64 damage_full;
+    u64 damage_pixels;
+    u64 block_frames;
+    u64 block_rects;
+    u64 block_bytes;
+    u64 zero_copy_frames;
+    /* urbs held back by the shaper until enough tokens accrued */
+    u64 shape_wait;
+    /* posted frames the governor held back, full frames whose sampled rows didn't change */
+    u64 gov_held;
+    u64 gov_unchanged;
+};
+
+struct usb_hal_pcpu_stat {
+    struct usb_hal_dev_frame_stat stat;
+    struct u64_stats_sync syncp;
 };
- 
+
+/* last values rather than counts, single writer */
+struct usb_hal_dev_frame_gauge {
+    u32 in_flight;
+    u32 in_flight_max;
+    u32 last_mbps;
+    u32 frame_latency_us;
+};
+
+/*
+ * Count n events from any context. 64 bit cpus add in one instruction, others
+ * need the sync so a reader on another cpu never sees half of a carry.
+ */
+#if BITS_PER_LONG == 64
+#define usb_hal_stat_add(usb_dev, field, n) this_cpu_add((usb_dev)->pcpu_stat->stat.field, (n))
+#else
+#define usb_hal_stat_add(usb_dev, field, n) do { \
+	struct usb_hal_pcpu_stat* __s; \
+	unsigned long __flags; \
+	local_irq_save(__flags); \
+	__s = this_cpu_ptr((usb_dev)->pcpu_stat); \
+	u64_stats_update_begin(&__s->syncp); \
+	__s->stat.field += (n); \
+	u64_stats_update_end(&__s->syncp); \
+	local_irq_restore(__flags); \
+} while (0)
+#endif
+#define usb_hal_stat_inc(usb_dev, field) usb_hal_stat_add(usb_dev, field, 1)
+
 struct usb_hal_dev {
     struct usb_hal* hal;
     const struct msdisp_hal_dev *hal_dev;
@@ -81,21 +288,60 @@ struct usb_hal_dev {
     struct usb_hal_video_mode mode;
     struct device* dma_dev;
 
-    volatile int thread_run_flag;
-    struct semaphore sema;
+    wait_queue_head_t thread_wait;
+    unsigned long thread_flags;
+    struct hrtimer refresh_timer;
     struct task_struct* thread;
     int index;
     u8 vpack_in;
     u8 vpack_out;
     u8 color_out;
+    /* USB_HAL_WIRE_FORMAT_*, vpack_in holds the one in use */
+    u8 wire_format;
     u8 vic;
     u8 trans_mode;
-    struct usb_hal_buffer usb_buf;
-    struct usb_hal_dev_frame_stat stat;
+    struct usb_hal_plan plan;
+    struct usb_hal_buffer usb_buf[USB_HAL_BUF_CNT];
+    struct usb_hal_buffer zc_buf[USB_HAL_ZC_BUF_CNT];
+    spinlock_t buf_lock;
+    /* newest finished frame not picked up by the sender yet, see usb_hal_buf.c */
+    struct usb_hal_buffer* mailbox;
+    /* last frame taken and last one reported sent, frame_done is protected by buf_lock */
+    u32 frame_seq;
+    u32 done_seq;
+    void (*frame_done)(void* ctx, u32 seq);
+    void* frame_done_ctx;
+    /* serializes writers of the control event fifo */
+    spinlock_t event_lock;
+    struct usb_hal_xfer* xfer;
+    /* multi-cpu conversion, NULL converts on the caller only */
+    struct usb_hal_stripe* stripe;
+    /* manual block transfers, see usb_hal_block.c */
+    int block_mode;
+    struct usb_hal_buffer block_buf;
+    struct usb_hal_block_hist block_hist[USB_HAL_BLOCK_HIST_CNT];
+    u32 block_seq;
+    u32 slot_seq[USB_HAL_FRAME_SLOT_CNT];
+    struct usb_hal_pcpu_stat __percpu *pcpu_stat;
+    struct usb_hal_dev_frame_gauge gauge;
+    /* counts at the last reset, shown counts are relative to it */
+    struct usb_hal_dev_frame_stat stat_base;
+    struct mutex stat_lock;
+    /* per stage latencies and throughput, shown in debugfs */
+    struct msdisp_common_hist hist_convert;
+    struct msdisp_common_hist hist_convert_cpu;
+    struct msdisp_common_hist hist_xfer;
+    struct msdisp_common_hist hist_trigger;
+    struct usb_hal_rate rate;
+    /* practical bytes per second of the link, and the last utilization reported */
+    u64 bw_capacity;
+    time64_t bw_check_sec;
+    int bw_high;
+    struct usb_hal_gov gov;
+    struct dentry* debugfs;
     int state;
     int bus_status;
     int first_buf_send;
-    int wait_send_cnt;
     unsigned char frame_index;
 
     struct usb_hal_video_mode custom_mode[USB_HAL_MAX_CUSTOM_MODE];
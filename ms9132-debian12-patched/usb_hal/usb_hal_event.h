@@ -19,7 +19,7 @@
 #define USB_HAL_EVENT_TYPE_BASE                  0x90000000
 #define USB_HAL_EVENT_TYPE_ENABLE				(USB_HAL_EVENT_TYPE_BASE + 1)
 #define USB_HAL_EVENT_TYPE_DISABLE				(USB_HAL_EVENT_TYPE_BASE + 2)
-#define USB_HAL_EVENT_TYPE_UPDATE				(USB_HAL_EVENT_TYPE_BASE + 3)
+/* frame updates are passed through the buffer mailbox, not as events */
 
 struct usb_hal_base_event {
 	unsigned int type;
@@ -40,11 +40,6 @@ struct usb_hal_event {
 			unsigned char resv[4];
 		}enable;
 
-		struct {
-            unsigned int len;
-			unsigned int resv[2];
-		}update;
-
 		struct {
 			unsigned int resv[3];
 		}disable;
@@ -0,0 +1,253 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_gov.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_gov.h"
+#include "usb_hal_thread.h"
+
+/*
+ * Every frame goes out whole in frame mode, so a cursor blinking at the vblank
+ * rate costs as much bus time as a video. The governor caps how often a posted
+ * frame is taken for the wire, by how much of the screen changed lately:
+ *   active  the load reached active_pct, or one frame changed that much, every frame is sent
+ *   idle    the load stayed below idle_pct for hold_ms, at most idle_fps
+ *   static  nothing changed for static_ms, at most static_fps
+ *
+ * Frames are never dropped, a held one waits in the mailbox and newer ones replace
+ * it, so the last picture is on screen at most a frame period later.
+ *
+ * Damage clips tell what changed. A frame without them, or with damage over the
+ * whole screen, may still be the same picture again, so a rotating subset of its rows is hashed and compared with the
+ * same rows last time. A change in rows not sampled yet shows within static_fps.
+ */
+
+static unsigned short usb_hal_gov_enable = 1;
+module_param_named(governor, usb_hal_gov_enable, ushort, 0644);
+MODULE_PARM_DESC(governor, "Lower the frame rate of new devices while little changes on screen (default: 1)");
+
+static unsigned short usb_hal_gov_idle_fps = 30;
+module_param_named(gov_idle_fps, usb_hal_gov_idle_fps, ushort, 0644);
+MODULE_PARM_DESC(gov_idle_fps, "Frames per second at most while little changes on screen (default: 30)");
+
+static unsigned short usb_hal_gov_static_fps = 1;
+module_param_named(gov_static_fps, usb_hal_gov_static_fps, ushort, 0644);
+MODULE_PARM_DESC(gov_static_fps, "Frames per second at most while nothing changes on screen (default: 1)");
+
+#define USB_HAL_GOV_DEF_ACTIVE_PCT              10
+#define USB_HAL_GOV_DEF_IDLE_PCT                2
+#define USB_HAL_GOV_DEF_HOLD_MS                 500
+#define USB_HAL_GOV_DEF_STATIC_MS               2000
+
+static const char* g_gov_state_name[] = {
+	"static", "idle", "active"
+};
+
+const char* usb_hal_gov_state_name(int state)
+{
+	if ((state < 0) || (state >= ARRAY_SIZE(g_gov_state_name))) {
+		return "unknown";
+	}
+
+	return g_gov_state_name[state];
+}
+
+static enum hrtimer_restart usb_hal_gov_timer_fn(struct hrtimer* timer)
+{
+	struct usb_hal_dev* usb_dev = container_of(timer, struct usb_hal_dev, gov.timer);
+
+	usb_hal_kick_thread(usb_dev);
+	return HRTIMER_NORESTART;
+}
+
+void usb_hal_gov_init(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_gov* gov = &usb_dev->gov;
+
+	gov->enable = usb_hal_gov_enable;
+	gov->idle_fps = max_t(u32, usb_hal_gov_idle_fps, 1);
+	gov->static_fps = max_t(u32, usb_hal_gov_static_fps, 1);
+	gov->active_pct = USB_HAL_GOV_DEF_ACTIVE_PCT;
+	gov->idle_pct = USB_HAL_GOV_DEF_IDLE_PCT;
+	gov->hold_ms = USB_HAL_GOV_DEF_HOLD_MS;
+	gov->static_ms = USB_HAL_GOV_DEF_STATIC_MS;
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+	hrtimer_setup(&gov->timer, usb_hal_gov_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&gov->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	gov->timer.function = usb_hal_gov_timer_fn;
+#endif
+	usb_hal_gov_reset(usb_dev);
+}
+
+/* sender thread stopped already */
+void usb_hal_gov_exit(struct usb_hal_dev* usb_dev)
+{
+	hrtimer_cancel(&usb_dev->gov.timer);
+}
+
+void usb_hal_gov_reset(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_gov* gov = &usb_dev->gov;
+	ktime_t now = ktime_get();
+
+	gov->state = USB_HAL_GOV_ACTIVE;
+	gov->load = 0;
+	gov->window_start = now;
+	gov->window_pixels = 0;
+	gov->last_active = now;
+	gov->last_change = now;
+	gov->phase = 0;
+	gov->sample_valid = 0;
+}
+
+/* whether the sampled rows of buf differ from the same rows last time */
+static int usb_hal_gov_changed(struct usb_hal_dev* usb_dev, const u8* buf, int pitch, u32 len)
+{
+	struct usb_hal_gov* gov = &usb_dev->gov;
+	u32 row = usb_dev->mode.width * usb_dev->plan.cpp;
+	int height = usb_dev->mode.height;
+	u32 phase = gov->phase++ % USB_HAL_GOV_SAMPLE_STEP;
+	u64 h = 0xcbf29ce484222325ULL;
+	const u32* p;
+	int changed, y, i;
+
+	if (!buf || !row || (row > pitch) || (pitch & 3) || ((u64)(height - 1) * pitch + row > len)) {
+		return 1;
+	}
+
+	// fnv-1a over 32 bit words, it only has to tell two pictures apart
+	for (y = phase; y < height; y += USB_HAL_GOV_SAMPLE_STEP) {
+		p = (const u32*)(buf + y * pitch);
+		for (i = 0; i < row / 4; i++) {
+			h = (h ^ p[i]) * 0x100000001b3ULL;
+		}
+	}
+
+	changed = (!(gov->sample_valid & BIT(phase)) || (gov->sample[phase] != (u32)(h ^ (h >> 32))));
+	gov->sample[phase] = (u32)(h ^ (h >> 32));
+	gov->sample_valid |= BIT(phase);
+
+	return changed;
+}
+
+void usb_hal_gov_update(struct usb_hal_dev* usb_dev, const u8* buf, int pitch, u32 len, const struct usb_hal_rect* rects, int rect_cnt)
+{
+	struct usb_hal_gov* gov = &usb_dev->gov;
+	u64 frame = (u64)usb_dev->mode.width * usb_dev->mode.height;
+	u32 rate = (usb_dev->mode.rate ? usb_dev->mode.rate : 60);
+	u64 pixels = 0;
+	ktime_t now;
+	s64 us;
+	int i;
+
+	if (!gov->enable || !frame) {
+		return;
+	}
+
+	now = ktime_get();
+	if (rects) {
+		for (i = 0; i < rect_cnt; i++) {
+			pixels += (u64)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+		}
+	}
+
+	// commits without damage clips come as one rect over the plane, that says nothing either
+	if (!rects || (pixels >= frame)) {
+		if (usb_hal_gov_changed(usb_dev, buf, pitch, len)) {
+			pixels = frame;
+		} else {
+			pixels = 0;
+			usb_hal_stat_inc(usb_dev, gov_unchanged);
+		}
+	}
+
+	if (pixels) {
+		gov->last_change = now;
+		if (USB_HAL_GOV_STATIC == gov->state) {
+			WRITE_ONCE(gov->state, USB_HAL_GOV_IDLE);
+		}
+	}
+	gov->window_pixels += pixels;
+
+	// one big change is enough for the full rate, scrolling and video start like that
+	if (pixels * 100 >= frame * gov->active_pct) {
+		WRITE_ONCE(gov->state, USB_HAL_GOV_ACTIVE);
+		gov->last_active = now;
+	}
+
+	us = ktime_us_delta(now, gov->window_start);
+	if (us >= USB_HAL_GOV_WINDOW_MS * USEC_PER_MSEC) {
+		gov->load = (u32)div64_u64(gov->window_pixels * 1000, div_u64(frame * rate * us, USEC_PER_SEC));
+		if (gov->load >= gov->active_pct * 10) {
+			WRITE_ONCE(gov->state, USB_HAL_GOV_ACTIVE);
+			gov->last_active = now;
+		} else if ((USB_HAL_GOV_ACTIVE == gov->state) && (gov->load < gov->idle_pct * 10) &&
+			(ktime_us_delta(now, gov->last_active) >= (s64)gov->hold_ms * USEC_PER_MSEC)) {
+			WRITE_ONCE(gov->state, USB_HAL_GOV_IDLE);
+		}
+		gov->window_start = now;
+		gov->window_pixels = 0;
+	}
+
+	if ((USB_HAL_GOV_IDLE == gov->state) && (ktime_us_delta(now, gov->last_change) >= (s64)gov->static_ms * USEC_PER_MSEC)) {
+		WRITE_ONCE(gov->state, USB_HAL_GOV_STATIC);
+	}
+}
+
+/* when the next frame may be taken, 0 if right away */
+static u64 usb_hal_gov_next_ns(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_gov* gov = &usb_dev->gov;
+	int state = READ_ONCE(gov->state);
+	u32 fps;
+
+	if (!gov->enable || (USB_HAL_GOV_ACTIVE == state)) {
+		return 0;
+	}
+
+	fps = ((USB_HAL_GOV_STATIC == state) ? gov->static_fps : gov->idle_fps);
+	return READ_ONCE(gov->last_send_ns) + div_u64(NSEC_PER_SEC, max_t(u32, fps, 1));
+}
+
+int usb_hal_gov_due(struct usb_hal_dev* usb_dev)
+{
+	return (ktime_get_ns() >= usb_hal_gov_next_ns(usb_dev));
+}
+
+void usb_hal_gov_sent(struct usb_hal_dev* usb_dev)
+{
+	WRITE_ONCE(usb_dev->gov.last_send_ns, ktime_get_ns());
+}
+
+void usb_hal_gov_hold(struct usb_hal_dev* usb_dev)
+{
+	u64 next = usb_hal_gov_next_ns(usb_dev);
+	u64 now = ktime_get_ns();
+
+	if (!READ_ONCE(usb_dev->mailbox)) {
+		return;
+	}
+
+	usb_hal_stat_inc(usb_dev, gov_held);
+	hrtimer_start(&usb_dev->gov.timer, ns_to_ktime((next > now) ? (next - now) : 0), HRTIMER_MODE_REL);
+}
@@ -0,0 +1,847 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_pack.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#define pr_fmt(fmt) "usb_hal: " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/version.h>
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+#include <linux/static_call.h>
+#endif
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#endif
+
+#include "usb_hal_pack.h"
+
+/* source bytes packed per kernel_fpu_begin/end section, bounds the time preemption is off */
+#define USB_HAL_PACK_FPU_CHUNK                  (64 * 1024)
+
+static unsigned short usb_hal_pack_simd = 1;
+module_param_named(pack_simd, usb_hal_pack_simd, ushort, 0444);
+MODULE_PARM_DESC(pack_simd, "Use SSSE3/AVX2 for RGB packing when the cpu has it (default: 1)");
+
+typedef void (*usb_hal_pack_rgb32_func)(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb);
+typedef void (*usb_hal_pack_bgr24_func)(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height);
+typedef void (*usb_hal_pack_yuv420_func)(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows);
+typedef void (*usb_hal_pack_uyvy_line_func)(u8* dst, const u8* ysrc, const u8* u0, const u8* v0, const u8* u1, const u8* v1,
+	u32 step, u32 pixels);
+
+struct usb_hal_pack_ops {
+	const char* name;
+	/* NULL if always usable */
+	int (*usable)(void);
+	usb_hal_pack_rgb32_func rgb32;
+	usb_hal_pack_bgr24_func bgr24;
+	usb_hal_pack_rgb32_func yuv422;
+	usb_hal_pack_yuv420_func yuv420;
+};
+
+static void usb_hal_rgb32_to_bgr888_line(u8 *dbuf, const u8 *sbuf, unsigned int pixels, int is_rgb)
+{
+	unsigned int x;
+
+    if (is_rgb) {
+        for (x = 0; x < pixels; x++) {
+            *dbuf++ = *sbuf;
+            *dbuf++ = *(sbuf + 1);
+            *dbuf++ = *(sbuf + 2);
+            sbuf += 4;
+	    }
+    } else {
+        for (x = 0; x < pixels; x++) {
+            *dbuf++ = *(sbuf + 2);
+            *dbuf++ = *(sbuf + 1);
+            *dbuf++ = *sbuf;
+            sbuf += 4;
+	    }
+    }
+}
+
+static void usb_hal_bgr24_to_rgb24_line(u8* dst, const u8* src, unsigned int pixels)
+{
+	unsigned int i;
+
+	for (i = 0; i < pixels; i++) {
+		dst[i * 3] = src[i * 3 + 2];
+		dst[i * 3 + 1] = src[i * 3 + 1];
+		dst[i * 3 + 2] = src[i * 3];
+	}
+}
+
+/*
+ * 4x4 ordered dither for RGB565. The threshold scaled to the quantization step
+ * is added before truncating, a fixed pattern in screen coordinates so partial
+ * updates line up with what is already on screen and still areas don't shimmer.
+ */
+static const u8 usb_hal_pack_bayer[4][4] = {
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 },
+};
+
+static void usb_hal_rgb32_to_rgb565_line(__le16* dst, const u8* src, unsigned int pixels, u32 x, u32 y, int is_rgb, int dither)
+{
+	const u8* bayer = usb_hal_pack_bayer[y & 3];
+	unsigned int i;
+	u32 r, g, b, t;
+
+	for (i = 0; i < pixels; i++) {
+		r = is_rgb ? src[2] : src[0];
+		g = src[1];
+		b = is_rgb ? src[0] : src[2];
+		if (dither) {
+			t = bayer[(x + i) & 3];
+			r = min_t(u32, r + (t >> 1), 255);
+			g = min_t(u32, g + (t >> 2), 255);
+			b = min_t(u32, b + (t >> 1), 255);
+		}
+		dst[i] = cpu_to_le16(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+		src += 4;
+	}
+}
+
+/*
+ * BT.709 limited range, 8 bit fixed point in the byte order of the source pixel,
+ * is_rgb (B, G, R) first. Chroma is taken from the sum of a pixel pair, hence
+ * one more bit of shift, and the offsets ride along with the rounding.
+ */
+static const s16 usb_hal_pack_yuv_coef[2][3][4] __aligned(16) = {
+	{ { 16, 157, 47, 0 }, { 112, -86, -26, 0 }, { -10, -102, 112, 0 } },
+	{ { 47, 157, 16, 0 }, { -26, -86, 112, 0 }, { 112, -102, -10, 0 } },
+};
+#define USB_HAL_PACK_Y_BIAS                     (128 + (16 << 8))
+#define USB_HAL_PACK_C_BIAS                     (256 + (128 << 9))
+
+static void usb_hal_rgb32_to_yuv422_line(u8* dst, const u8* src, unsigned int pixels, int is_rgb)
+{
+	const s16 (*c)[4] = usb_hal_pack_yuv_coef[is_rgb ? 0 : 1];
+	const u8 *p0, *p1;
+	s32 s0, s1, s2;
+	unsigned int i;
+
+	for (i = 0; i < pixels; i += 2) {
+		p0 = src;
+		// a lone last pixel pairs with itself
+		p1 = (i + 1 < pixels) ? (src + 4) : src;
+		s0 = p0[0] + p1[0];
+		s1 = p0[1] + p1[1];
+		s2 = p0[2] + p1[2];
+		dst[0] = (c[1][0] * s0 + c[1][1] * s1 + c[1][2] * s2 + USB_HAL_PACK_C_BIAS) >> 9;
+		dst[1] = (c[0][0] * p0[0] + c[0][1] * p0[1] + c[0][2] * p0[2] + USB_HAL_PACK_Y_BIAS) >> 8;
+		dst[2] = (c[2][0] * s0 + c[2][1] * s1 + c[2][2] * s2 + USB_HAL_PACK_C_BIAS) >> 9;
+		dst[3] = (c[0][0] * p1[0] + c[0][1] * p1[1] + c[0][2] * p1[2] + USB_HAL_PACK_Y_BIAS) >> 8;
+		src += 8;
+		dst += 4;
+	}
+}
+
+/* one UYVY row, chroma is the rounded average of the rows at u0/v0 and u1/v1 */
+static void usb_hal_uyvy_line(u8* dst, const u8* ysrc, const u8* u0, const u8* v0, const u8* u1, const u8* v1,
+	u32 step, u32 pixels)
+{
+	u32 i;
+
+	for (i = 0; i < pixels / 2; i++) {
+		dst[0] = ((u16)u0[i * step] + u1[i * step] + 1) >> 1;
+		dst[1] = ysrc[0];
+		dst[2] = ((u16)v0[i * step] + v1[i * step] + 1) >> 1;
+		dst[3] = ysrc[1];
+		ysrc += 2;
+		dst += 4;
+	}
+}
+
+/*
+ * Rows y..y+rows of a frame with half the chroma rows. Even rows take their
+ * chroma row, odd rows the average of the rows above and below, the last odd row
+ * a copy. Every output row is written once and only reads the source, so
+ * stripes can be converted in any order.
+ */
+static void usb_hal_pack_yuv420_rows(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows, usb_hal_pack_uyvy_line_func line)
+{
+	u32 last = DIV_ROUND_UP(height, 2) - 1;
+	u32 i, top, bottom;
+
+	for (i = y; i < y + rows; i++) {
+		top = min(i / 2, last);
+		bottom = ((i & 1) && (i + 1 < height)) ? min((i + 1) / 2, last) : top;
+		line(dst + i * width * 2, ybuf + i * ypitch, ubuf + top * stride, vbuf + top * stride,
+			ubuf + bottom * stride, vbuf + bottom * stride, step, width);
+	}
+}
+
+static void usb_hal_pack_yuv420_c(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows)
+{
+	usb_hal_pack_yuv420_rows(dst, ybuf, ypitch, ubuf, vbuf, stride, step, width, height, y, rows, usb_hal_uyvy_line);
+}
+
+static void usb_hal_pack_rgb32_c(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	u32 y;
+
+	for (y = 0; y < height; y++) {
+		usb_hal_rgb32_to_bgr888_line(dst, src, width, is_rgb);
+		src += pitch;
+		dst += dst_pitch;
+	}
+}
+
+static void usb_hal_pack_yuv422_c(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	u32 y;
+
+	for (y = 0; y < height; y++) {
+		usb_hal_rgb32_to_yuv422_line(dst, src, width, is_rgb);
+		src += pitch;
+		dst += dst_pitch;
+	}
+}
+
+static void usb_hal_pack_bgr24_c(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height)
+{
+	u32 y;
+
+	for (y = 0; y < height; y++) {
+		usb_hal_bgr24_to_rgb24_line(dst, src, width);
+		src += pitch;
+		dst += dst_pitch;
+	}
+}
+
+#ifdef CONFIG_X86_64
+
+/*
+ * The vector packers shuffle the colour bytes together with pshufb and write the
+ * staging buffer with non-temporal stores, it is read by the usb controller and
+ * not by the cpu. Those need aligned destinations, so every line starts with a
+ * few scalar pixels. A pixel is 3 bytes and 3 * 11 = 1 mod 32, which gives the
+ * count directly. The kernel is built without SSE, the asm below owns the
+ * vector registers between kernel_fpu_begin and kernel_fpu_end.
+ */
+
+/* pshufb masks taking the colour bytes of four 32bpp pixels into the low 12 bytes, is_rgb first */
+static const u8 usb_hal_pack_rgb32_mask[2][32] __aligned(32) = {
+	{ 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80,
+	  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80 },
+	{ 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0x80, 0x80, 0x80, 0x80,
+	  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0x80, 0x80, 0x80, 0x80 },
+};
+
+/*
+ * vpermd indices for the avx2 packer. After the shuffle each 128 bit lane holds
+ * 12 bytes, four ymm of 8 pixels become three stores of 32 bytes, each one a
+ * blend of two permuted inputs.
+ */
+static const u32 usb_hal_pack_avx2_perm[6][8] __aligned(32) = {
+	{ 0, 1, 2, 4, 5, 6, 6, 6 },
+	{ 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ 2, 4, 5, 6, 0, 0, 0, 0 },
+	{ 0, 0, 0, 0, 0, 1, 2, 4 },
+	{ 5, 6, 0, 0, 0, 0, 0, 0 },
+	{ 0, 0, 0, 1, 2, 4, 5, 6 },
+};
+
+/*
+ * pshufb masks swapping red and blue of 16 24bpp pixels in three xmm. Pixels
+ * straddle the registers, so each output takes bytes from its neighbours too.
+ */
+static const u8 usb_hal_pack_bgr24_mask[7][16] __aligned(16) = {
+	/* out0 from in0, in1 */
+	{ 2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1 },
+	/* out1 from in1, in0, in2 */
+	{ 0, 0x80, 4, 3, 2, 7, 6, 5, 10, 9, 8, 13, 12, 11, 0x80, 15 },
+	{ 0x80, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 0x80 },
+	/* out2 from in2, in1 */
+	{ 0x80, 3, 2, 1, 6, 5, 4, 9, 8, 7, 12, 11, 10, 15, 14, 13 },
+	{ 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+};
+
+/*
+ * Rows are packed inside kernel_fpu_begin/end, reopened every USB_HAL_PACK_FPU_CHUNK
+ * source bytes so preemption is not held off for a whole frame. The masks are
+ * loaded per line, nothing is lost across the gap. The sfence orders the
+ * non-temporal stores before the buffer is handed on.
+ */
+static inline void usb_hal_pack_fpu_yield(u32* done, u32 bytes)
+{
+	*done += bytes;
+	if (*done >= USB_HAL_PACK_FPU_CHUNK) {
+		asm volatile("sfence" : : : "memory");
+		kernel_fpu_end();
+		kernel_fpu_begin();
+		*done = 0;
+	}
+}
+
+/* pixels to write before dst is aligned to align (16 or 32) */
+static inline u32 usb_hal_pack_head(const u8* dst, u32 align)
+{
+	return (11 * (-(unsigned long)dst & (align - 1))) & (align - 1);
+}
+
+static int usb_hal_pack_has_ssse3(void)
+{
+	return boot_cpu_has(X86_FEATURE_SSSE3);
+}
+
+static int usb_hal_pack_has_avx2(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_AVX);
+}
+
+/* 16 pixels per step, xmm7 shuffle mask */
+static void usb_hal_rgb32_line_ssse3(u8* dst, const u8* src, u32 pixels, int is_rgb)
+{
+	u32 head = min_t(u32, pixels, usb_hal_pack_head(dst, 16));
+
+	usb_hal_rgb32_to_bgr888_line(dst, src, head, is_rgb);
+	dst += head * 3;
+	src += head * 4;
+	pixels -= head;
+
+	asm volatile("movdqa %0, %%xmm7" : : "m" (usb_hal_pack_rgb32_mask[is_rgb ? 0 : 1][0]));
+	for (; pixels >= 16; pixels -= 16) {
+		asm volatile(
+			"movdqu 0(%[s]), %%xmm0\n\t"
+			"movdqu 16(%[s]), %%xmm1\n\t"
+			"movdqu 32(%[s]), %%xmm2\n\t"
+			"movdqu 48(%[s]), %%xmm3\n\t"
+			"pshufb %%xmm7, %%xmm0\n\t"
+			"pshufb %%xmm7, %%xmm1\n\t"
+			"pshufb %%xmm7, %%xmm2\n\t"
+			"pshufb %%xmm7, %%xmm3\n\t"
+			"movdqa %%xmm1, %%xmm4\n\t"
+			"pslldq $12, %%xmm4\n\t"
+			"por %%xmm4, %%xmm0\n\t"
+			"psrldq $4, %%xmm1\n\t"
+			"movdqa %%xmm2, %%xmm4\n\t"
+			"pslldq $8, %%xmm4\n\t"
+			"por %%xmm4, %%xmm1\n\t"
+			"psrldq $8, %%xmm2\n\t"
+			"pslldq $4, %%xmm3\n\t"
+			"por %%xmm3, %%xmm2\n\t"
+			"movntdq %%xmm0, 0(%[d])\n\t"
+			"movntdq %%xmm1, 16(%[d])\n\t"
+			"movntdq %%xmm2, 32(%[d])\n\t"
+			: : [s] "r" (src), [d] "r" (dst) : "memory");
+		src += 64;
+		dst += 48;
+	}
+
+	usb_hal_rgb32_to_bgr888_line(dst, src, pixels, is_rgb);
+}
+
+/* 32 pixels per step, ymm7 shuffle mask, ymm8-ymm13 permute indices */
+static void usb_hal_rgb32_line_avx2(u8* dst, const u8* src, u32 pixels, int is_rgb)
+{
+	u32 head = min_t(u32, pixels, usb_hal_pack_head(dst, 32));
+
+	usb_hal_rgb32_to_bgr888_line(dst, src, head, is_rgb);
+	dst += head * 3;
+	src += head * 4;
+	pixels -= head;
+
+	asm volatile("vmovdqa %0, %%ymm7" : : "m" (usb_hal_pack_rgb32_mask[is_rgb ? 0 : 1][0]));
+	asm volatile("vmovdqa %0, %%ymm8" : : "m" (usb_hal_pack_avx2_perm[0][0]));
+	asm volatile("vmovdqa %0, %%ymm9" : : "m" (usb_hal_pack_avx2_perm[1][0]));
+	asm volatile("vmovdqa %0, %%ymm10" : : "m" (usb_hal_pack_avx2_perm[2][0]));
+	asm volatile("vmovdqa %0, %%ymm11" : : "m" (usb_hal_pack_avx2_perm[3][0]));
+	asm volatile("vmovdqa %0, %%ymm12" : : "m" (usb_hal_pack_avx2_perm[4][0]));
+	asm volatile("vmovdqa %0, %%ymm13" : : "m" (usb_hal_pack_avx2_perm[5][0]));
+	for (; pixels >= 32; pixels -= 32) {
+		asm volatile(
+			"vmovdqu 0(%[s]), %%ymm0\n\t"
+			"vmovdqu 32(%[s]), %%ymm1\n\t"
+			"vmovdqu 64(%[s]), %%ymm2\n\t"
+			"vmovdqu 96(%[s]), %%ymm3\n\t"
+			"vpshufb %%ymm7, %%ymm0, %%ymm0\n\t"
+			"vpshufb %%ymm7, %%ymm1, %%ymm1\n\t"
+			"vpshufb %%ymm7, %%ymm2, %%ymm2\n\t"
+			"vpshufb %%ymm7, %%ymm3, %%ymm3\n\t"
+			"vpermd %%ymm0, %%ymm8, %%ymm4\n\t"
+			"vpermd %%ymm1, %%ymm9, %%ymm5\n\t"
+			"vpblendd $0xc0, %%ymm5, %%ymm4, %%ymm4\n\t"
+			"vmovntdq %%ymm4, 0(%[d])\n\t"
+			"vpermd %%ymm1, %%ymm10, %%ymm4\n\t"
+			"vpermd %%ymm2, %%ymm11, %%ymm5\n\t"
+			"vpblendd $0xf0, %%ymm5, %%ymm4, %%ymm4\n\t"
+			"vmovntdq %%ymm4, 32(%[d])\n\t"
+			"vpermd %%ymm2, %%ymm12, %%ymm4\n\t"
+			"vpermd %%ymm3, %%ymm13, %%ymm5\n\t"
+			"vpblendd $0xfc, %%ymm5, %%ymm4, %%ymm4\n\t"
+			"vmovntdq %%ymm4, 64(%[d])\n\t"
+			: : [s] "r" (src), [d] "r" (dst) : "memory");
+		src += 128;
+		dst += 96;
+	}
+
+	usb_hal_rgb32_to_bgr888_line(dst, src, pixels, is_rgb);
+}
+
+/* 16 pixels per step, xmm8-xmm14 shuffle masks */
+static void usb_hal_bgr24_line_ssse3(u8* dst, const u8* src, u32 pixels)
+{
+	u32 head = min_t(u32, pixels, usb_hal_pack_head(dst, 16));
+
+	usb_hal_bgr24_to_rgb24_line(dst, src, head);
+	dst += head * 3;
+	src += head * 3;
+	pixels -= head;
+
+	asm volatile("movdqa %0, %%xmm8" : : "m" (usb_hal_pack_bgr24_mask[0][0]));
+	asm volatile("movdqa %0, %%xmm9" : : "m" (usb_hal_pack_bgr24_mask[1][0]));
+	asm volatile("movdqa %0, %%xmm10" : : "m" (usb_hal_pack_bgr24_mask[2][0]));
+	asm volatile("movdqa %0, %%xmm11" : : "m" (usb_hal_pack_bgr24_mask[3][0]));
+	asm volatile("movdqa %0, %%xmm12" : : "m" (usb_hal_pack_bgr24_mask[4][0]));
+	asm volatile("movdqa %0, %%xmm13" : : "m" (usb_hal_pack_bgr24_mask[5][0]));
+	asm volatile("movdqa %0, %%xmm14" : : "m" (usb_hal_pack_bgr24_mask[6][0]));
+	for (; pixels >= 16; pixels -= 16) {
+		asm volatile(
+			"movdqu 0(%[s]), %%xmm0\n\t"
+			"movdqu 16(%[s]), %%xmm1\n\t"
+			"movdqu 32(%[s]), %%xmm2\n\t"
+			"movdqa %%xmm0, %%xmm3\n\t"
+			"pshufb %%xmm8, %%xmm3\n\t"
+			"movdqa %%xmm1, %%xmm4\n\t"
+			"pshufb %%xmm9, %%xmm4\n\t"
+			"por %%xmm4, %%xmm3\n\t"
+			"movdqa %%xmm1, %%xmm4\n\t"
+			"pshufb %%xmm10, %%xmm4\n\t"
+			"movdqa %%xmm0, %%xmm5\n\t"
+			"pshufb %%xmm11, %%xmm5\n\t"
+			"por %%xmm5, %%xmm4\n\t"
+			"movdqa %%xmm2, %%xmm5\n\t"
+			"pshufb %%xmm12, %%xmm5\n\t"
+			"por %%xmm5, %%xmm4\n\t"
+			"pshufb %%xmm13, %%xmm2\n\t"
+			"pshufb %%xmm14, %%xmm1\n\t"
+			"por %%xmm1, %%xmm2\n\t"
+			"movntdq %%xmm3, 0(%[d])\n\t"
+			"movntdq %%xmm4, 16(%[d])\n\t"
+			"movntdq %%xmm2, 32(%[d])\n\t"
+			: : [s] "r" (src), [d] "r" (dst) : "memory");
+		src += 48;
+		dst += 48;
+	}
+
+	usb_hal_bgr24_to_rgb24_line(dst, src, pixels);
+}
+
+static const u32 usb_hal_pack_yuv_bias[2][4] __aligned(16) = {
+	{ USB_HAL_PACK_Y_BIAS, USB_HAL_PACK_Y_BIAS, USB_HAL_PACK_Y_BIAS, USB_HAL_PACK_Y_BIAS },
+	{ USB_HAL_PACK_C_BIAS, USB_HAL_PACK_C_BIAS, USB_HAL_PACK_C_BIAS, USB_HAL_PACK_C_BIAS },
+};
+
+/* Y0 Y1 Y2 Y3 U01 U23 V01 V23 to U01 Y0 V01 Y1 U23 Y2 V23 Y3 */
+static const u8 usb_hal_pack_uyvy_mask[16] __aligned(16) = {
+	4, 0, 6, 1, 5, 2, 7, 3, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+/*
+ * Four pixels at off into the low 8 bytes of out. Words of the pixels go
+ * through pmaddwd and phaddd for Y, the pair sums the same way for U and V,
+ * then everything is packed down to bytes and put in UYVY order.
+ */
+#define USB_HAL_PACK_YUV4(off, out)                         \
+	"movdqu " #off "(%[s]), %%xmm0\n\t"                     \
+	"movdqa %%xmm0, %%xmm1\n\t"                             \
+	"punpcklbw %%xmm7, %%xmm0\n\t"                          \
+	"punpckhbw %%xmm7, %%xmm1\n\t"                          \
+	"movdqa %%xmm0, %%xmm2\n\t"                             \
+	"pmaddwd %%xmm8, %%xmm2\n\t"                            \
+	"movdqa %%xmm1, %%xmm3\n\t"                             \
+	"pmaddwd %%xmm8, %%xmm3\n\t"                            \
+	"phaddd %%xmm3, %%xmm2\n\t"                             \
+	"paddd %%xmm11, %%xmm2\n\t"                             \
+	"psrad $8, %%xmm2\n\t"                                  \
+	"pshufd $0x4e, %%xmm0, %%xmm3\n\t"                      \
+	"paddw %%xmm3, %%xmm0\n\t"                              \
+	"pshufd $0x4e, %%xmm1, %%xmm3\n\t"                      \
+	"paddw %%xmm3, %%xmm1\n\t"                              \
+	"punpcklqdq %%xmm1, %%xmm0\n\t"                         \
+	"movdqa %%xmm0, %%xmm1\n\t"                             \
+	"pmaddwd %%xmm9, %%xmm0\n\t"                            \
+	"pmaddwd %%xmm10, %%xmm1\n\t"                           \
+	"phaddd %%xmm1, %%xmm0\n\t"                             \
+	"paddd %%xmm12, %%xmm0\n\t"                             \
+	"psrad $9, %%xmm0\n\t"                                  \
+	"packssdw %%xmm0, %%xmm2\n\t"                           \
+	"packuswb %%xmm2, %%xmm2\n\t"                           \
+	"pshufb %%xmm13, %%xmm2\n\t"                            \
+	"movdqa %%xmm2, %%" #out "\n\t"
+
+/* 8 pixels per step, xmm7 zero, xmm8-xmm10 Y/U/V coefficients, xmm11-xmm12 bias, xmm13 order */
+static void usb_hal_yuv422_line_ssse3(u8* dst, const u8* src, u32 pixels, int is_rgb)
+{
+	const s16 (*c)[4] = usb_hal_pack_yuv_coef[is_rgb ? 0 : 1];
+	u32 head;
+
+	// pairs must stay whole, only the odd widths miss that
+	if ((unsigned long)dst & 3) {
+		usb_hal_rgb32_to_yuv422_line(dst, src, pixels, is_rgb);
+		return;
+	}
+
+	head = min_t(u32, pixels, (-(unsigned long)dst & 15) / 2);
+	usb_hal_rgb32_to_yuv422_line(dst, src, head, is_rgb);
+	dst += head * 2;
+	src += head * 4;
+	pixels -= head;
+
+	asm volatile("pxor %xmm7, %xmm7");
+	asm volatile("movq %0, %%xmm8" : : "m" (c[0][0]));
+	asm volatile("movq %0, %%xmm9" : : "m" (c[1][0]));
+	asm volatile("movq %0, %%xmm10" : : "m" (c[2][0]));
+	asm volatile("punpcklqdq %xmm8, %xmm8");
+	asm volatile("punpcklqdq %xmm9, %xmm9");
+	asm volatile("punpcklqdq %xmm10, %xmm10");
+	asm volatile("movdqa %0, %%xmm11" : : "m" (usb_hal_pack_yuv_bias[0][0]));
+	asm volatile("movdqa %0, %%xmm12" : : "m" (usb_hal_pack_yuv_bias[1][0]));
+	asm volatile("movdqa %0, %%xmm13" : : "m" (usb_hal_pack_uyvy_mask[0]));
+	for (; pixels >= 8; pixels -= 8) {
+		asm volatile(
+			USB_HAL_PACK_YUV4(0, xmm5)
+			USB_HAL_PACK_YUV4(16, xmm6)
+			"punpcklqdq %%xmm6, %%xmm5\n\t"
+			"movntdq %%xmm5, 0(%[d])\n\t"
+			: : [s] "r" (src), [d] "r" (dst) : "memory");
+		src += 32;
+		dst += 16;
+	}
+
+	usb_hal_rgb32_to_yuv422_line(dst, src, pixels, is_rgb);
+}
+
+/*
+ * UYVY rows are a byte interleave of the averaged chroma pairs with the luma, so
+ * these only need SSE2. A row that can't keep its pairs aligned goes scalar.
+ */
+static void usb_hal_uyvy_line_sse2(u8* dst, const u8* ysrc, const u8* u0, const u8* v0, const u8* u1, const u8* v1,
+	u32 step, u32 pixels)
+{
+	u32 head;
+
+	if ((unsigned long)dst & 3) {
+		usb_hal_uyvy_line(dst, ysrc, u0, v0, u1, v1, step, pixels);
+		return;
+	}
+
+	head = min_t(u32, pixels, (-(unsigned long)dst & 15) / 2);
+	usb_hal_uyvy_line(dst, ysrc, u0, v0, u1, v1, step, head);
+	dst += head * 2;
+	ysrc += head;
+	u0 += head / 2 * step;
+	v0 += head / 2 * step;
+	u1 += head / 2 * step;
+	v1 += head / 2 * step;
+	pixels -= head;
+
+	for (; pixels >= 16; pixels -= 16) {
+		if (2 == step) {
+			// interleaved, v follows u
+			asm volatile(
+				"movdqu (%[u0]), %%xmm1\n\t"
+				"movdqu (%[u1]), %%xmm2\n\t"
+				"pavgb %%xmm2, %%xmm1\n\t"
+				: : [u0] "r" (u0), [u1] "r" (u1) : "memory");
+		} else {
+			asm volatile(
+				"movq (%[u0]), %%xmm1\n\t"
+				"movq (%[u1]), %%xmm2\n\t"
+				"pavgb %%xmm2, %%xmm1\n\t"
+				"movq (%[v0]), %%xmm3\n\t"
+				"movq (%[v1]), %%xmm2\n\t"
+				"pavgb %%xmm2, %%xmm3\n\t"
+				"punpcklbw %%xmm3, %%xmm1\n\t"
+				: : [u0] "r" (u0), [u1] "r" (u1), [v0] "r" (v0), [v1] "r" (v1) : "memory");
+		}
+		asm volatile(
+			"movdqu (%[y]), %%xmm0\n\t"
+			"movdqa %%xmm1, %%xmm2\n\t"
+			"punpcklbw %%xmm0, %%xmm1\n\t"
+			"punpckhbw %%xmm0, %%xmm2\n\t"
+			"movntdq %%xmm1, 0(%[d])\n\t"
+			"movntdq %%xmm2, 16(%[d])\n\t"
+			: : [y] "r" (ysrc), [d] "r" (dst) : "memory");
+		dst += 32;
+		ysrc += 16;
+		u0 += 8 * step;
+		v0 += 8 * step;
+		u1 += 8 * step;
+		v1 += 8 * step;
+	}
+
+	usb_hal_uyvy_line(dst, ysrc, u0, v0, u1, v1, step, pixels);
+}
+
+/* 32 pixels per step, vpermq puts the qwords where the in-lane unpacks need them */
+static void usb_hal_uyvy_line_avx2(u8* dst, const u8* ysrc, const u8* u0, const u8* v0, const u8* u1, const u8* v1,
+	u32 step, u32 pixels)
+{
+	u32 head;
+
+	if ((unsigned long)dst & 3) {
+		usb_hal_uyvy_line(dst, ysrc, u0, v0, u1, v1, step, pixels);
+		return;
+	}
+
+	head = min_t(u32, pixels, (-(unsigned long)dst & 31) / 2);
+	usb_hal_uyvy_line(dst, ysrc, u0, v0, u1, v1, step, head);
+	dst += head * 2;
+	ysrc += head;
+	u0 += head / 2 * step;
+	v0 += head / 2 * step;
+	u1 += head / 2 * step;
+	v1 += head / 2 * step;
+	pixels -= head;
+
+	for (; pixels >= 32; pixels -= 32) {
+		if (2 == step) {
+			asm volatile(
+				"vmovdqu (%[u0]), %%ymm1\n\t"
+				"vpavgb (%[u1]), %%ymm1, %%ymm1\n\t"
+				: : [u0] "r" (u0), [u1] "r" (u1) : "memory");
+		} else {
+			asm volatile(
+				"vmovdqu (%[u0]), %%xmm1\n\t"
+				"vpavgb (%[u1]), %%xmm1, %%xmm1\n\t"
+				"vmovdqu (%[v0]), %%xmm3\n\t"
+				"vpavgb (%[v1]), %%xmm3, %%xmm3\n\t"
+				"vpunpckhbw %%xmm3, %%xmm1, %%xmm2\n\t"
+				"vpunpcklbw %%xmm3, %%xmm1, %%xmm1\n\t"
+				"vinserti128 $1, %%xmm2, %%ymm1, %%ymm1\n\t"
+				: : [u0] "r" (u0), [u1] "r" (u1), [v0] "r" (v0), [v1] "r" (v1) : "memory");
+		}
+		asm volatile(
+			"vpermq $0xd8, (%[y]), %%ymm0\n\t"
+			"vpermq $0xd8, %%ymm1, %%ymm1\n\t"
+			"vpunpckhbw %%ymm0, %%ymm1, %%ymm2\n\t"
+			"vpunpcklbw %%ymm0, %%ymm1, %%ymm1\n\t"
+			"vmovntdq %%ymm1, 0(%[d])\n\t"
+			"vmovntdq %%ymm2, 32(%[d])\n\t"
+			: : [y] "r" (ysrc), [d] "r" (dst) : "memory");
+		dst += 64;
+		ysrc += 32;
+		u0 += 16 * step;
+		v0 += 16 * step;
+		u1 += 16 * step;
+		v1 += 16 * step;
+	}
+
+	usb_hal_uyvy_line(dst, ysrc, u0, v0, u1, v1, step, pixels);
+}
+
+static void usb_hal_pack_yuv420_simd(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows, usb_hal_pack_uyvy_line_func line)
+{
+	u32 done = 0;
+	u32 i;
+
+	if (!may_use_simd()) {
+		usb_hal_pack_yuv420_c(dst, ybuf, ypitch, ubuf, vbuf, stride, step, width, height, y, rows);
+		return;
+	}
+
+	kernel_fpu_begin();
+	for (i = y; i < y + rows; i++) {
+		usb_hal_pack_yuv420_rows(dst, ybuf, ypitch, ubuf, vbuf, stride, step, width, height, i, 1, line);
+		usb_hal_pack_fpu_yield(&done, width * 2);
+	}
+	asm volatile("sfence" : : : "memory");
+	kernel_fpu_end();
+}
+
+static void usb_hal_pack_yuv420_sse2(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows)
+{
+	usb_hal_pack_yuv420_simd(dst, ybuf, ypitch, ubuf, vbuf, stride, step, width, height, y, rows, usb_hal_uyvy_line_sse2);
+}
+
+static void usb_hal_pack_yuv420_avx2(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows)
+{
+	usb_hal_pack_yuv420_simd(dst, ybuf, ypitch, ubuf, vbuf, stride, step, width, height, y, rows, usb_hal_uyvy_line_avx2);
+}
+
+/* fallback does the rows when the fpu can't be used */
+static void usb_hal_pack_rgb32_simd(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb,
+	void (*line)(u8* dst, const u8* src, u32 pixels, int is_rgb), usb_hal_pack_rgb32_func fallback)
+{
+	u32 done = 0;
+	u32 y;
+
+	if (!may_use_simd()) {
+		fallback(dst, src, pitch, dst_pitch, width, height, is_rgb);
+		return;
+	}
+
+	kernel_fpu_begin();
+	for (y = 0; y < height; y++) {
+		line(dst, src, width, is_rgb);
+		src += pitch;
+		dst += dst_pitch;
+		usb_hal_pack_fpu_yield(&done, width * 4);
+	}
+	asm volatile("sfence" : : : "memory");
+	kernel_fpu_end();
+}
+
+static void usb_hal_pack_rgb32_ssse3(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	usb_hal_pack_rgb32_simd(dst, src, pitch, dst_pitch, width, height, is_rgb, usb_hal_rgb32_line_ssse3, usb_hal_pack_rgb32_c);
+}
+
+static void usb_hal_pack_rgb32_avx2(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	usb_hal_pack_rgb32_simd(dst, src, pitch, dst_pitch, width, height, is_rgb, usb_hal_rgb32_line_avx2, usb_hal_pack_rgb32_c);
+}
+
+static void usb_hal_pack_yuv422_ssse3(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	usb_hal_pack_rgb32_simd(dst, src, pitch, dst_pitch, width, height, is_rgb, usb_hal_yuv422_line_ssse3, usb_hal_pack_yuv422_c);
+}
+
+static void usb_hal_pack_bgr24_ssse3(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height)
+{
+	u32 done = 0;
+	u32 y;
+
+	if (!may_use_simd()) {
+		usb_hal_pack_bgr24_c(dst, src, pitch, dst_pitch, width, height);
+		return;
+	}
+
+	kernel_fpu_begin();
+	for (y = 0; y < height; y++) {
+		usb_hal_bgr24_line_ssse3(dst, src, width);
+		src += pitch;
+		dst += dst_pitch;
+		usb_hal_pack_fpu_yield(&done, width * 3);
+	}
+	asm volatile("sfence" : : : "memory");
+	kernel_fpu_end();
+}
+
+#endif
+
+/* best first, the last entry is always usable */
+static const struct usb_hal_pack_ops usb_hal_pack_ops[] = {
+#ifdef CONFIG_X86_64
+	/* bgr24 and yuv422 have no avx2 variant, they are rarely used */
+	{ "avx2", usb_hal_pack_has_avx2, usb_hal_pack_rgb32_avx2, usb_hal_pack_bgr24_ssse3, usb_hal_pack_yuv422_ssse3,
+		usb_hal_pack_yuv420_avx2 },
+	{ "ssse3", usb_hal_pack_has_ssse3, usb_hal_pack_rgb32_ssse3, usb_hal_pack_bgr24_ssse3, usb_hal_pack_yuv422_ssse3,
+		usb_hal_pack_yuv420_sse2 },
+#endif
+	{ "c", NULL, usb_hal_pack_rgb32_c, usb_hal_pack_bgr24_c, usb_hal_pack_yuv422_c, usb_hal_pack_yuv420_c },
+};
+
+static DEFINE_MUTEX(usb_hal_pack_lock);
+static const struct usb_hal_pack_ops* usb_hal_pack_cur;
+
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+DEFINE_STATIC_CALL(usb_hal_pack_rgb32_call, usb_hal_pack_rgb32_c);
+DEFINE_STATIC_CALL(usb_hal_pack_bgr24_call, usb_hal_pack_bgr24_c);
+DEFINE_STATIC_CALL(usb_hal_pack_yuv422_call, usb_hal_pack_yuv422_c);
+DEFINE_STATIC_CALL(usb_hal_pack_yuv420_call, usb_hal_pack_yuv420_c);
+#define usb_hal_pack_call(name)                 static_call(name)
+#define usb_hal_pack_update(name, func)         static_call_update(name, func)
+#else
+static usb_hal_pack_rgb32_func usb_hal_pack_rgb32_call = usb_hal_pack_rgb32_c;
+static usb_hal_pack_bgr24_func usb_hal_pack_bgr24_call = usb_hal_pack_bgr24_c;
+static usb_hal_pack_rgb32_func usb_hal_pack_yuv422_call = usb_hal_pack_yuv422_c;
+static usb_hal_pack_yuv420_func usb_hal_pack_yuv420_call = usb_hal_pack_yuv420_c;
+#define usb_hal_pack_call(name)                 (name)
+#define usb_hal_pack_update(name, func)         WRITE_ONCE(name, func)
+#endif
+
+void usb_hal_pack_init(void)
+{
+	const struct usb_hal_pack_ops* ops = NULL;
+	int i;
+
+	mutex_lock(&usb_hal_pack_lock);
+	if (usb_hal_pack_cur) {
+		mutex_unlock(&usb_hal_pack_lock);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(usb_hal_pack_ops); i++) {
+		ops = &usb_hal_pack_ops[i];
+		if (!ops->usable || (usb_hal_pack_simd && ops->usable())) {
+			break;
+		}
+	}
+
+	usb_hal_pack_update(usb_hal_pack_rgb32_call, ops->rgb32);
+	usb_hal_pack_update(usb_hal_pack_bgr24_call, ops->bgr24);
+	usb_hal_pack_update(usb_hal_pack_yuv422_call, ops->yuv422);
+	usb_hal_pack_update(usb_hal_pack_yuv420_call, ops->yuv420);
+	usb_hal_pack_cur = ops;
+	mutex_unlock(&usb_hal_pack_lock);
+
+	pr_info("rgb packing uses %s\n", ops->name);
+}
+
+const char* usb_hal_pack_name(void)
+{
+	const struct usb_hal_pack_ops* ops = READ_ONCE(usb_hal_pack_cur);
+
+	return ops ? ops->name : "none";
+}
+
+void usb_hal_pack_rgb32(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	usb_hal_pack_call(usb_hal_pack_rgb32_call)(dst, src, pitch, dst_pitch, width, height, is_rgb);
+}
+
+void usb_hal_pack_bgr24(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height)
+{
+	usb_hal_pack_call(usb_hal_pack_bgr24_call)(dst, src, pitch, dst_pitch, width, height);
+}
+
+void usb_hal_pack_yuv422(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb)
+{
+	usb_hal_pack_call(usb_hal_pack_yuv422_call)(dst, src, pitch, dst_pitch, width, height, is_rgb);
+}
+
+void usb_hal_pack_yuv420(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows)
+{
+	usb_hal_pack_call(usb_hal_pack_yuv420_call)(dst, ybuf, ypitch, ubuf, vbuf, stride, step, width, height, y, rows);
+}
+
+void usb_hal_pack_rgb565(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 x, u32 y, u32 width, u32 height, int is_rgb,
+	int dither)
+{
+	u32 i;
+
+	for (i = 0; i < height; i++) {
+		usb_hal_rgb32_to_rgb565_line((__le16*)dst, src, width, x, y + i, is_rgb, dither);
+		src += pitch;
+		dst += dst_pitch;
+	}
+}
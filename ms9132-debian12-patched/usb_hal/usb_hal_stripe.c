@@ -0,0 +1,226 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_stripe.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_stripe.h"
+
+/*
+ * A frame is converted in stripes of whole rows on a per device unbound
+ * workqueue. The caller queues one work item per extra cpu and then converts
+ * stripes itself as well, everyone takes the next unclaimed stripe until none
+ * is left, so a slow cpu doesn't hold up the frame. The caller returns once all
+ * workers are done, the job lives on its stack.
+ *
+ * Stripes finish out of order. ready() is only called for the prefix of rows
+ * that is complete, so the transmit engine can stream it as before.
+ */
+
+static unsigned short usb_hal_conv_workers = 0;
+module_param_named(conv_workers, usb_hal_conv_workers, ushort, 0644);
+MODULE_PARM_DESC(conv_workers, "CPUs converting one frame, 0 for the online CPUs, 1 to convert on the caller only (default: 0)");
+
+struct usb_hal_stripe_job {
+	const struct usb_hal_stripe_ops* ops;
+	void* ctx;
+	int height;
+	int rows;
+	int cnt;
+	/* next stripe to claim */
+	atomic_t next;
+	/* queued workers not finished yet */
+	atomic_t running;
+	struct completion done;
+	/* protects finished and ready */
+	spinlock_t lock;
+	int ready;
+	DECLARE_BITMAP(finished, USB_HAL_STRIPE_MAX_CNT);
+	/* ns spent converting, summed over everyone taking part */
+	atomic64_t cpu_ns;
+};
+
+struct usb_hal_stripe_worker {
+	struct work_struct work;
+	struct usb_hal_stripe_job* job;
+};
+
+struct usb_hal_stripe {
+	struct usb_hal_dev* usb_dev;
+	struct workqueue_struct* wq;
+	/* one frame at a time, the workers are reused */
+	struct mutex lock;
+	struct usb_hal_stripe_worker workers[USB_HAL_STRIPE_MAX_WORKERS];
+};
+
+static void usb_hal_stripe_finish(struct usb_hal_stripe_job* job, int index)
+{
+	int ready;
+
+	spin_lock(&job->lock);
+	set_bit(index, job->finished);
+	ready = job->ready;
+	while ((job->ready < job->cnt) && test_bit(job->ready, job->finished)) {
+		job->ready++;
+	}
+	if (job->ready != ready) {
+		ready = min(job->ready * job->rows, job->height);
+	} else {
+		ready = 0;
+	}
+	spin_unlock(&job->lock);
+
+	// the transmit engine ignores a watermark that moves back, no need to keep the lock
+	if (ready && job->ops->ready) {
+		job->ops->ready(job->ctx, ready);
+	}
+}
+
+static void usb_hal_stripe_loop(struct usb_hal_stripe_job* job)
+{
+	int i, y;
+	u64 start = ktime_get_ns();
+
+	while ((i = atomic_inc_return(&job->next) - 1) < job->cnt) {
+		y = i * job->rows;
+		job->ops->convert(job->ctx, y, min(job->rows, job->height - y));
+		usb_hal_stripe_finish(job, i);
+	}
+
+	// converting never sleeps, the wall time on this cpu is its cpu time
+	atomic64_add(ktime_get_ns() - start, &job->cpu_ns);
+}
+
+static void usb_hal_stripe_work(struct work_struct* work)
+{
+	struct usb_hal_stripe_worker* worker = container_of(work, struct usb_hal_stripe_worker, work);
+	struct usb_hal_stripe_job* job = worker->job;
+
+	usb_hal_stripe_loop(job);
+	if (atomic_dec_and_test(&job->running)) {
+		complete(&job->done);
+	}
+}
+
+/* cpus worth using for bytes of output */
+int usb_hal_stripe_workers(struct usb_hal_stripe* stripe, u32 bytes)
+{
+	int workers;
+
+	if (!stripe) {
+		return 1;
+	}
+
+	workers = usb_hal_conv_workers ? usb_hal_conv_workers : num_online_cpus();
+	workers = min_t(int, workers, bytes / USB_HAL_STRIPE_MIN_BYTES);
+
+	return clamp(workers, 1, USB_HAL_STRIPE_MAX_WORKERS);
+}
+
+/*
+ * Convert height rows in stripes of rows on up to workers cpus, returns when all
+ * are done with the cpu time they spent in ns.
+ */
+u64 usb_hal_stripe_run(struct usb_hal_stripe* stripe, int workers, int height, int rows, const struct usb_hal_stripe_ops* ops,
+	void* ctx)
+{
+	struct usb_hal_stripe_job job;
+	int i;
+
+	if (height <= 0) {
+		return 0;
+	}
+
+	rows = clamp(rows, 1, height);
+	if (DIV_ROUND_UP(height, rows) > USB_HAL_STRIPE_MAX_CNT) {
+		rows = DIV_ROUND_UP(height, USB_HAL_STRIPE_MAX_CNT);
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.ops = ops;
+	job.ctx = ctx;
+	job.height = height;
+	job.rows = rows;
+	job.cnt = DIV_ROUND_UP(height, rows);
+	atomic_set(&job.next, 0);
+	atomic64_set(&job.cpu_ns, 0);
+	spin_lock_init(&job.lock);
+	init_completion(&job.done);
+
+	workers = stripe ? min(workers, job.cnt) : 1;
+	if (workers <= 1) {
+		usb_hal_stripe_loop(&job);
+		return atomic64_read(&job.cpu_ns);
+	}
+
+	mutex_lock(&stripe->lock);
+	atomic_set(&job.running, workers - 1);
+	for (i = 0; i < workers - 1; i++) {
+		stripe->workers[i].job = &job;
+		queue_work(stripe->wq, &stripe->workers[i].work);
+	}
+
+	usb_hal_stripe_loop(&job);
+	wait_for_completion(&job.done);
+	mutex_unlock(&stripe->lock);
+
+	usb_hal_stat_inc(stripe->usb_dev, stripe_frames);
+	return atomic64_read(&job.cpu_ns);
+}
+
+struct usb_hal_stripe* usb_hal_stripe_create(struct usb_hal_dev* usb_dev, int index)
+{
+	struct usb_hal_stripe* stripe;
+	int i;
+
+	stripe = kzalloc(sizeof(*stripe), GFP_KERNEL);
+	if (!stripe) {
+		return NULL;
+	}
+
+	stripe->usb_dev = usb_dev;
+	mutex_init(&stripe->lock);
+	for (i = 0; i < USB_HAL_STRIPE_MAX_WORKERS; i++) {
+		INIT_WORK(&stripe->workers[i].work, usb_hal_stripe_work);
+	}
+
+	stripe->wq = alloc_workqueue("msdisp%d_conv", WQ_UNBOUND | WQ_HIGHPRI, USB_HAL_STRIPE_MAX_WORKERS - 1, index);
+	if (!stripe->wq) {
+		kfree(stripe);
+		return NULL;
+	}
+
+	return stripe;
+}
+
+void usb_hal_stripe_destroy(struct usb_hal_stripe* stripe)
+{
+	if (!stripe) {
+		return;
+	}
+
+	destroy_workqueue(stripe->wq);
+	kfree(stripe);
+}
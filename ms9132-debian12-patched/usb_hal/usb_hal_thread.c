@@ -12,95 +12,110 @@
  * usb_hal_thread.c -- Drm driver for MacroSilicon chip 913x and 912x
  */
  
+#include <linux/version.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
 #include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
 //#include <linux/compaction.h>
 
 #include "usb_hal_interface.h"
 #include "usb_hal_dev.h"
 #include "usb_hal_event.h"
 #include "usb_hal_thread.h"
+#include "usb_hal_xfer.h"
+#include "usb_hal_buf.h"
+#include "usb_hal_block.h"
+#include "usb_hal_bw.h"
+#include "usb_hal_gov.h"
 #include "hal_adaptor.h"
+#include "usb_hal_trace.h"
 
-struct usb_hal_api_context {
-	struct completion	done;
-	int			status;
-};
-
-static void usb_hal_api_blocking_completion(struct urb *urb)
+/*
+ * The transfer of usb_buf has been started by the converter or by the buffer pool.
+ * Wait for it, the zero length packet and the trigger go out with the urbs. The
+ * caller retires the buffer afterwards.
+ */
+static int usb_hal_dev_finish_frame(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer, struct usb_hal_buffer* usb_buf, int resend)
 {
-	struct usb_hal_api_context *ctx = urb->context;
+   int real_ret, ret, slot = 0;
+	struct usb_device* udev = usb_dev->udev;
 
-	ctx->status = urb->status;
-	complete(&ctx->done);
-}
+	real_ret = 0;
+	usb_hal_stat_inc(usb_dev, send_total);
 
-static int usb_hal_start_wait_urb(struct urb *urb, int timeout, int *actual_length)
-{
-	struct usb_hal_api_context ctx;
-	unsigned long expire;
-	int retval;
-
-	init_completion(&ctx.done);
-	urb->context = &ctx;
-	urb->actual_length = 0;
-	retval = usb_submit_urb(urb, GFP_NOIO);
-	if (unlikely(retval))
-		goto out;
+	// in block mode nothing has been sent yet
+	if (usb_buf->block) {
+		slot = usb_hal_block_send(usb_dev, xfer, usb_buf, resend);
+	}
 
-	expire = timeout ? msecs_to_jiffies(timeout) : MAX_SCHEDULE_TIMEOUT;
-	if (!wait_for_completion_timeout(&ctx.done, expire)) {
-		usb_kill_urb(urb);
-		retval = (ctx.status == -ENOENT ? -ETIMEDOUT : ctx.status);
-	} else
-		retval = ctx.status;
-out:
-	if (actual_length)
-		*actual_length = urb->actual_length;
+	ret = usb_hal_xfer_wait(xfer);
+	if (ret) {
+		dev_err(&udev->dev, "xfer buf%d failed!\n ret = %d\n", usb_buf->index, ret);
+		real_ret = ret;
+	} else {
+		usb_hal_stat_inc(usb_dev, send_success);
+	}
+
+	if (usb_buf->block) {
+		usb_hal_block_done(usb_dev, usb_buf, slot, !ret);
+	}
+
+	// hal can't chain the trigger, send it from here
+	if (!xfer->trigger_urb) {
+		usb_dev->frame_index = ((0 == usb_dev->frame_index) ? 1 : 0);
+		trace_usb_hal_trigger(usb_dev->index, usb_buf->frame_seq, usb_dev->frame_index, 0);
+		if (!usb_dev->hal_dev->funcs->trigger_frame(usb_dev->udev, usb_dev->frame_index, USB_HAL_XFER_TRIGGER_DELAY)) {
+			usb_hal_bw_add(usb_dev, USB_HAL_BW_CTRL, sizeof(struct usb_ctrlrequest) + USB_HAL_XFER_TRIGGER_LEN, 1);
+		}
+	}
 
-	return retval;
+	return real_ret;
 }
 
-static int usb_hal_dev_send_frame(struct usb_hal_dev* usb_dev, struct urb* data_urb, unsigned char* zero_msg, int ep)
+/* finish the frame on the wire, or resend the shown one to keep the chip fed */
+static int usb_hal_dev_send_frame(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer)
 {
-   int real_ret, ret, snd_len;
-	struct usb_device* udev = usb_dev->udev;
+	struct usb_hal_buffer* usb_buf;
+	int ret;
 
-	real_ret = 0;
-	usb_dev->stat.send_total++;
-	mutex_lock(&usb_dev->usb_buf.mutex);
-
-	usb_fill_bulk_urb(data_urb, udev, usb_sndbulkpipe(udev, ep), usb_dev->usb_buf.buf, usb_dev->usb_buf.len,
-			usb_hal_api_blocking_completion, NULL);
-		
-	if ((USB_HAL_BUF_TYPE_USB == usb_dev->usb_buf.type ) || (USB_HAL_BUF_TYPE_DMA == usb_dev->usb_buf.type)) {
-		data_urb->transfer_dma = usb_dev->usb_buf.dma_addr;
-		data_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	} else if (USB_HAL_BUF_TYPE_VMALLOC == usb_dev->usb_buf.type) {
-		data_urb->num_sgs = usb_dev->usb_buf.sgt->orig_nents;
-		data_urb->sg = usb_dev->usb_buf.sgt->sgl; 
+	int resend = 0;
+
+	usb_buf = usb_hal_buf_next(usb_dev);
+	if (!usb_buf) {
+		usb_buf = usb_hal_buf_resend(usb_dev);
+		resend = 1;
 	}
 
-	ret = usb_hal_start_wait_urb(data_urb, 2000, &snd_len);
-	if (ret) {
-		dev_err(&udev->dev, "wait urb failed!\n ret = %d\n", ret);
-		real_ret = ret;
-	} else {
-		usb_dev->stat.send_success++;
+	if (!usb_buf) {
+		return -EBUSY;
 	}
 
-    ret = usb_bulk_msg(udev, usb_sndbulkpipe(udev, ep), zero_msg, 0, &snd_len, 2000);
-    if (ret) {
-        dev_err(&udev->dev, "send zero msg failed! ret=%d\n", ret);
-    }
+	if (resend) {
+		trace_usb_hal_resend(usb_dev->index, usb_buf->frame_seq);
+	}
 
-	usb_dev->frame_index = ((0 == usb_dev->frame_index) ? 1 : 0);
-   	usb_dev->hal_dev->funcs->trigger_frame(usb_dev->udev, usb_dev->frame_index, 100);
+	ret = usb_hal_dev_finish_frame(usb_dev, xfer, usb_buf, resend);
+	usb_hal_buf_retire(usb_dev, usb_buf);
 
-    mutex_unlock(&usb_dev->usb_buf.mutex);
+	return ret;
+}
 
-	return real_ret;
+/* device is not enabled, drop the posted frame and drain the wire */
+static void usb_hal_dev_drop_update(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer)
+{
+	struct usb_hal_buffer* usb_buf;
+
+	usb_hal_buf_drop(usb_dev);
+	while ((usb_buf = usb_hal_buf_next(usb_dev)) != NULL) {
+		if (!usb_buf->block) {
+			(void)usb_hal_xfer_wait(xfer);
+		}
+		usb_hal_buf_retire(usb_dev, usb_buf);
+	}
+	usb_hal_buf_put_pages(usb_dev);
 }
 
 static void usb_hal_dev_do_enable(struct usb_hal_dev* usb_dev, struct usb_hal_event* event)
@@ -125,6 +140,8 @@ static void usb_hal_dev_do_enable(struct usb_hal_dev* usb_dev, struct usb_hal_ev
 		usb_dev->frame_index = 0;
 	}
 
+	usb_hal_xfer_set_trigger(usb_dev->xfer, 1);
+	usb_hal_gov_reset(usb_dev);
 	usb_dev->state = USB_HAL_DEV_STATE_ENABLED;
 	usb_dev->first_buf_send = 0;
 }
@@ -141,21 +158,52 @@ static void usb_hal_dev_do_disable(struct usb_hal_dev* usb_dev, struct usb_hal_e
         dev_err(&udev->dev, "hal dev disable event proc failed! ret=%d\n", ret);
     }
 
+	usb_hal_xfer_set_trigger(usb_dev->xfer, 0);
+
     usb_dev->state = USB_HAL_DEV_STATE_DISABLED;
 }
 
-static void usb_hal_dev_do_update(struct usb_hal_dev* usb_dev, struct urb* data_urb, unsigned char* zero_msg, int ep, struct usb_hal_event* event)
+/* frames finished per pass, the one on the wire and one posted, then control events get their turn */
+#define USB_HAL_UPDATE_BATCH    2
+
+/* send the frame on the wire and the newest posted one, returns frames handled */
+static int usb_hal_dev_do_update(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer)
 {
-    int ret;
+    int ret, cnt = 0;
 	const struct msdisp_hal_dev* hal_dev = usb_dev->hal_dev;
 	struct usb_device *udev = usb_dev->udev;
+	struct usb_hal_buffer* usb_buf;
+	int hold;
 
 	//printk("%s:enter!\n", __func__);
 
-	usb_dev->stat.update_event++;
-	usb_dev->wait_send_cnt = 0;
-    usb_dev->usb_buf.len = event->para.update.len;
-	ret = usb_hal_dev_send_frame(usb_dev, data_urb, zero_msg, ep);
+	ret = -EAGAIN;
+	hold = 0;
+	while (cnt < USB_HAL_UPDATE_BATCH) {
+		// the governor may leave the posted frame waiting, one on the wire is always finished.
+		// asked per frame, every frame taken pushes the next due time out
+		hold = !usb_hal_gov_due(usb_dev);
+		usb_buf = (hold ? usb_hal_buf_inflight(usb_dev) : usb_hal_buf_next(usb_dev));
+		if (!usb_buf) {
+			break;
+		}
+
+		usb_hal_stat_inc(usb_dev, update_event);
+		cnt++;
+		if (!usb_hal_dev_finish_frame(usb_dev, xfer, usb_buf, 0)) {
+			usb_dev->gauge.frame_latency_us = (u32)ktime_us_delta(ktime_get(), usb_buf->frame_start);
+			ret = 0;
+		}
+		usb_hal_buf_retire(usb_dev, usb_buf);
+	}
+
+	if (hold) {
+		usb_hal_gov_hold(usb_dev);
+	} else if ((cnt >= USB_HAL_UPDATE_BATCH) && READ_ONCE(usb_dev->mailbox)) {
+		// come back for it after the fifo and the stop check
+		usb_hal_kick_thread(usb_dev);
+	}
+
 	if (ret) {
 		goto out;
 	}
@@ -176,7 +224,7 @@ static void usb_hal_dev_do_update(struct usb_hal_dev* usb_dev, struct urb* data_
 		dev_info(&udev->dev, "start video success!\n");
 	}
 out:
-	return;
+	return cnt;
 }
 
 void usb_hal_dev_state_unknown(struct usb_hal_dev* usb_dev, struct usb_hal_event* event)
@@ -195,54 +243,73 @@ void usb_hal_dev_state_unknown(struct usb_hal_dev* usb_dev, struct usb_hal_event
     usb_hal_dev_do_enable(usb_dev, event);
 }
 
-void usb_hal_dev_state_enable(struct usb_hal_dev* usb_dev, struct urb* data_urb, unsigned char* zero_msg, int ep, struct usb_hal_event* event)
+void usb_hal_dev_state_enable(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer, struct usb_hal_event* event)
 {
     if (USB_HAL_EVENT_TYPE_DISABLE == event->base.type) {
         usb_hal_dev_do_disable(usb_dev, event);
         return ;
     }
+}
 
-    if (USB_HAL_EVENT_TYPE_UPDATE == event->base.type) {
-        usb_hal_dev_do_update(usb_dev, data_urb, zero_msg, ep, event);
-    }
+/* keepalive expired, let the thread resend the shown frame */
+static enum hrtimer_restart usb_hal_refresh_timer_fn(struct hrtimer* timer)
+{
+	struct usb_hal_dev* usb_dev = container_of(timer, struct usb_hal_dev, refresh_timer);
+
+	set_bit(USB_HAL_THREAD_REFRESH, &usb_dev->thread_flags);
+	wake_up(&usb_dev->thread_wait);
+
+	return HRTIMER_NORESTART;
 }
 
-void usb_hal_state_machine(struct usb_hal_dev* usb_dev, struct urb* data_urb, unsigned char* zero_msg, int ep, struct kfifo* fifo)
+/* the chip needs a frame every USB_HAL_BUF_TIMEOUT ms, restart the count from now */
+static void usb_hal_arm_refresh(struct usb_hal_dev* usb_dev)
 {
-    int len, ret;
+	hrtimer_start(&usb_dev->refresh_timer, ms_to_ktime(USB_HAL_BUF_TIMEOUT), HRTIMER_MODE_REL);
+}
+
+void usb_hal_state_machine(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer, struct kfifo* fifo)
+{
+    int len, refresh;
 	struct usb_hal_event event;
 
-    ret = down_timeout(&usb_dev->sema, msecs_to_jiffies(USB_HAL_BUF_WAIT_TIME));
+	clear_bit(USB_HAL_THREAD_KICK, &usb_dev->thread_flags);
+	refresh = test_and_clear_bit(USB_HAL_THREAD_REFRESH, &usb_dev->thread_flags);
     // if usb will be suspend, not process, until usb resume
 	if ( MS9132_USB_BUS_STATUS_SUSPEND == usb_dev->bus_status) {
 		return;
 	}
-	// event received, proc event
-    if (!ret) {
-        while ((len = kfifo_out(fifo, &event, sizeof(event)) != 0)) {
-            switch (usb_dev->state) {
-                case USB_HAL_DEV_STATE_UNKNOWN:
-                case USB_HAL_DEV_STATE_DISABLED:
-                    usb_hal_dev_state_unknown(usb_dev, &event);
-                    break;
-                case USB_HAL_DEV_STATE_ENABLED:
-                    usb_hal_dev_state_enable(usb_dev, data_urb, zero_msg, ep, &event);
-                    break;
-	        }
+	usb_hal_bw_check(usb_dev);
+	// control events first, they are never coalesced
+    while ((len = kfifo_out(fifo, &event, sizeof(event)) != 0)) {
+        switch (usb_dev->state) {
+            case USB_HAL_DEV_STATE_UNKNOWN:
+            case USB_HAL_DEV_STATE_DISABLED:
+                usb_hal_dev_state_unknown(usb_dev, &event);
+                break;
+            case USB_HAL_DEV_STATE_ENABLED:
+                usb_hal_dev_state_enable(usb_dev, xfer, &event);
+                break;
         }
-        return;
     }
 
-    // in enable state, must send frame to usb chip periodly. 
-    if ((USB_HAL_DEV_STATE_ENABLED == usb_dev->state) && (usb_dev->first_buf_send)) {
-		usb_dev->wait_send_cnt++;
-		if (usb_dev->wait_send_cnt < (USB_HAL_BUF_TIMEOUT / USB_HAL_BUF_WAIT_TIME)) {
-			return ;
-		}
+	// then the newest frame from the mailbox
+	if (USB_HAL_DEV_STATE_ENABLED != usb_dev->state) {
+		hrtimer_cancel(&usb_dev->refresh_timer);
+		usb_hal_dev_drop_update(usb_dev, xfer);
+		return;
+	}
 
-		usb_dev->stat.period_send++;
-		usb_dev->wait_send_cnt = 0;
-		(void)usb_hal_dev_send_frame(usb_dev, data_urb, zero_msg, ep);
+	if (usb_hal_dev_do_update(usb_dev, xfer)) {
+		usb_hal_arm_refresh(usb_dev);
+		return;
+	}
+
+    // in enable state, must send frame to usb chip periodly. 
+    if (refresh && (usb_dev->first_buf_send)) {
+		usb_hal_stat_inc(usb_dev, period_send);
+		(void)usb_hal_dev_send_frame(usb_dev, xfer);
+		usb_hal_arm_refresh(usb_dev);
 	}
 }
 
@@ -250,40 +317,57 @@ int usb_hal_state_machine_entry(void* data)
 {
     struct usb_hal* usb_hal = (struct usb_hal *)data;
     struct usb_hal_dev* usb_dev = (struct usb_hal_dev*)usb_hal->private;
-    //struct urb* urb;
-	struct urb* data_urb;
-    int ep;
-	unsigned char* zero_msg;
+	struct usb_hal_xfer* xfer;
     struct kfifo* fifo;
 
 	dev_info(&usb_dev->udev->dev, "state machine proc enter!\n");
 
     fifo = usb_dev->fifo;
 
-	zero_msg = kmalloc(8, GFP_KERNEL);
-	if (!zero_msg){
-		return -ENOMEM;
-	}
+	xfer = usb_dev->xfer;
 
-	data_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!data_urb) {
-		kfree(zero_msg);
-		return -ENOMEM;
-	}
+	/* sleep until a frame or event is posted, the keepalive fires or we are stopped */
+    while (!kthread_should_stop()) {
+		wait_event_interruptible(usb_dev->thread_wait, kthread_should_stop() ||
+			test_bit(USB_HAL_THREAD_KICK, &usb_dev->thread_flags) ||
+			test_bit(USB_HAL_THREAD_REFRESH, &usb_dev->thread_flags));
+		if (kthread_should_stop()) {
+			break;
+		}
 
-    ep = usb_dev->hal_dev->funcs->get_transfer_bulk_ep();
-	/* wait for drm enable */
-    while(usb_dev->thread_run_flag) {
-        usb_hal_state_machine(usb_dev, data_urb, zero_msg, ep, fifo);		
+        usb_hal_state_machine(usb_dev, xfer, fifo);
     }
 
-	usb_free_urb(data_urb);
-	kfree(zero_msg);
+	dev_info(&usb_dev->udev->dev, "state machine proc exit!\n");
 
     return 0;
 }
 
+void usb_hal_init_thread(struct usb_hal_dev* usb_dev)
+{
+	init_waitqueue_head(&usb_dev->thread_wait);
+	usb_dev->thread_flags = 0;
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+	hrtimer_setup(&usb_dev->refresh_timer, usb_hal_refresh_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&usb_dev->refresh_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	usb_dev->refresh_timer.function = usb_hal_refresh_timer_fn;
+#endif
+}
+
+/* a frame or control event is waiting for the sender */
+void usb_hal_kick_thread(struct usb_hal_dev* usb_dev)
+{
+	set_bit(USB_HAL_THREAD_KICK, &usb_dev->thread_flags);
+	wake_up(&usb_dev->thread_wait);
+}
+
+/* returns once the thread has exited, no frame is on the wire afterwards */
 void usb_hal_stop_thread(struct usb_hal_dev *usb_dev)
 {
-    usb_dev->thread_run_flag = 0;
-}
\ No newline at end of file
+	if (usb_dev->thread) {
+		kthread_stop(usb_dev->thread);
+		usb_dev->thread = NULL;
+	}
+	hrtimer_cancel(&usb_dev->refresh_timer);
+}
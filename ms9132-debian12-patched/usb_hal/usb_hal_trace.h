@@ -0,0 +1,148 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_trace.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM msdisp_usb
+
+#if !defined(__USB_HAL_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __USB_HAL_TRACE_H__
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Frame life in the usb hal, pipeline is the pipeline's global id (msdisp<pipeline>)
+ * and seq the frame number the drm side logs with msdisp_drm_frame_sent.
+ */
+
+DECLARE_EVENT_CLASS(usb_hal_convert,
+	TP_PROTO(int pipeline, u32 seq, u32 bytes),
+	TP_ARGS(pipeline, seq, bytes),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+		__field(u32, bytes)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+		__entry->bytes = bytes;
+	),
+	TP_printk("pipeline=%d seq=%u bytes=%u", __entry->pipeline, __entry->seq, __entry->bytes)
+);
+
+/* bytes of the frame that get converted, the damaged rows only */
+DEFINE_EVENT(usb_hal_convert, usb_hal_convert_start,
+	TP_PROTO(int pipeline, u32 seq, u32 bytes),
+	TP_ARGS(pipeline, seq, bytes)
+);
+
+DEFINE_EVENT(usb_hal_convert, usb_hal_convert_end,
+	TP_PROTO(int pipeline, u32 seq, u32 bytes),
+	TP_ARGS(pipeline, seq, bytes)
+);
+
+TRACE_EVENT(usb_hal_urb_submit,
+	TP_PROTO(int pipeline, u32 seq, u32 offset, u32 len),
+	TP_ARGS(pipeline, seq, offset, len),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+		__field(u32, offset)
+		__field(u32, len)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+		__entry->offset = offset;
+		__entry->len = len;
+	),
+	TP_printk("pipeline=%d seq=%u offset=%u len=%u", __entry->pipeline, __entry->seq, __entry->offset, __entry->len)
+);
+
+TRACE_EVENT(usb_hal_urb_complete,
+	TP_PROTO(int pipeline, u32 seq, int status, u32 bytes),
+	TP_ARGS(pipeline, seq, status, bytes),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+		__field(int, status)
+		__field(u32, bytes)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+		__entry->status = status;
+		__entry->bytes = bytes;
+	),
+	TP_printk("pipeline=%d seq=%u status=%d bytes=%u", __entry->pipeline, __entry->seq, __entry->status, __entry->bytes)
+);
+
+/* trigger_frame sent, chained from the last urb or from the sender thread */
+TRACE_EVENT(usb_hal_trigger,
+	TP_PROTO(int pipeline, u32 seq, u8 frame_index, int chained),
+	TP_ARGS(pipeline, seq, frame_index, chained),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+		__field(u8, frame_index)
+		__field(int, chained)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+		__entry->frame_index = frame_index;
+		__entry->chained = chained;
+	),
+	TP_printk("pipeline=%d seq=%u slot=%u chained=%d", __entry->pipeline, __entry->seq, __entry->frame_index, __entry->chained)
+);
+
+TRACE_EVENT(usb_hal_trigger_complete,
+	TP_PROTO(int pipeline, u32 seq, int status),
+	TP_ARGS(pipeline, seq, status),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+		__entry->status = status;
+	),
+	TP_printk("pipeline=%d seq=%u status=%d", __entry->pipeline, __entry->seq, __entry->status)
+);
+
+/* the keepalive ran out with nothing new, the shown frame is sent again */
+TRACE_EVENT(usb_hal_resend,
+	TP_PROTO(int pipeline, u32 seq),
+	TP_ARGS(pipeline, seq),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+	),
+	TP_printk("pipeline=%d seq=%u", __entry->pipeline, __entry->seq)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usb_hal_trace
+#include <trace/define_trace.h>
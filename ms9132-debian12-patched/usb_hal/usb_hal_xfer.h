@@ -0,0 +1,100 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_xfer.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_XFER_H__
+#define __USB_HAL_XFER_H__
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/usb.h>
+
+/* urbs kept in flight on the bulk endpoint while a frame is being sent */
+#define USB_HAL_XFER_URB_CNT                4
+/* bytes carried by one urb, multiple of PAGE_SIZE and of any bulk wMaxPacketSize */
+#define USB_HAL_XFER_CHUNK_SIZE             (512 * 1024)
+#define USB_HAL_XFER_CHUNK_PAGES            (USB_HAL_XFER_CHUNK_SIZE >> PAGE_SHIFT)
+/* whole frame timeout, ms */
+#define USB_HAL_XFER_TIMEOUT                2000
+/* trigger_frame report size and the delay passed to the chip */
+#define USB_HAL_XFER_TRIGGER_LEN            8
+#define USB_HAL_XFER_TRIGGER_DELAY          100
+
+struct usb_hal_dev;
+struct usb_hal_buffer;
+struct usb_hal_xfer;
+
+struct usb_hal_xfer_urb {
+	struct usb_hal_xfer* xfer;
+	struct urb* urb;
+	int busy;
+	/* only used for vmalloc and zero-copy buffers, one entry per page of the chunk */
+	struct scatterlist* sg;
+};
+
+struct usb_hal_xfer {
+	struct usb_hal_dev* usb_dev;
+	struct usb_anchor anchor;
+	spinlock_t lock;
+	struct completion done;
+	unsigned int pipe;
+	u16 maxp;
+	u32 chunk_size;
+	struct usb_hal_xfer_urb urbs[USB_HAL_XFER_URB_CNT];
+	/* control urb chained after the last bulk urb, NULL if the hal can't build it */
+	struct urb* trigger_urb;
+	u8* trigger_setup;
+	u8* trigger_buf;
+	int trigger_enable;
+
+	/*
+	 * Token bucket pacing the bulk urbs, protected by lock. shape_rate is bytes
+	 * per second, 0 sends as fast as the bus takes it. shape_burst is the depth
+	 * of the bucket and the largest urb while shaping.
+	 */
+	u32 shape_rate;
+	u32 shape_burst;
+	u64 shape_tokens;
+	ktime_t shape_time;
+	struct hrtimer shape_timer;
+	int shape_wait;
+
+	/* current frame, protected by lock */
+	struct usb_hal_buffer* buf;
+	u32 len;
+	/* bytes the producer has finished writing, urbs never go past it */
+	u32 ready;
+	u32 offset;
+	u32 completed;
+	int in_flight;
+	int status;
+	int finished;
+	int trigger_busy;
+	ktime_t start;
+	/* last bulk urb of the frame completed */
+	ktime_t trigger_start;
+};
+
+struct usb_hal_xfer* usb_hal_xfer_create(struct usb_hal_dev* usb_dev, int ep);
+void usb_hal_xfer_destroy(struct usb_hal_xfer* xfer);
+void usb_hal_xfer_begin(struct usb_hal_xfer* xfer, struct usb_hal_buffer* buf, u32 len, u32 ready);
+void usb_hal_xfer_publish(struct usb_hal_xfer* xfer, u32 ready);
+int usb_hal_xfer_wait(struct usb_hal_xfer* xfer);
+void usb_hal_xfer_set_trigger(struct usb_hal_xfer* xfer, int enable);
+void usb_hal_xfer_set_shaper(struct usb_hal_xfer* xfer, u32 rate, u32 burst);
+int usb_hal_xfer_send(struct usb_hal_xfer* xfer, struct usb_hal_buffer* buf, u32 len);
+
+#endif
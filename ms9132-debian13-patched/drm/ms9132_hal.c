@@ -19,6 +19,7 @@
 #include <linux/printk.h>
 
 #include <drm/drm_modes.h>
+#include <drm/drm_rect.h>
 
 #include "usb_hal_chip.h"
 #include "usb_hal_edid.h"
@@ -100,12 +101,45 @@ int ms9132_hal_disable(struct msdisp_usb_hal* usb_hal)
     return usb_hal_disable(hal);
 }
 
-int ms9132_hal_update_frame(struct msdisp_usb_hal* usb_hal, u8* buf, int pitch, u32 len, unsigned int fourcc, int try_lock)
+/* NULL when the clips don't fit, the frame is then sent whole */
+static struct usb_hal_rect* ms9132_hal_to_hal_rects(const struct drm_rect* rects, int rect_cnt, struct usb_hal_rect* hal_rects)
+{
+    int i;
+
+    if (!rects || (rect_cnt > USB_HAL_MAX_RECTS)) {
+        return NULL;
+    }
+
+    for (i = 0; i < rect_cnt; i++) {
+        hal_rects[i].x1 = clamp_t(int, rects[i].x1, 0, U16_MAX);
+        hal_rects[i].y1 = clamp_t(int, rects[i].y1, 0, U16_MAX);
+        hal_rects[i].x2 = clamp_t(int, rects[i].x2, 0, U16_MAX);
+        hal_rects[i].y2 = clamp_t(int, rects[i].y2, 0, U16_MAX);
+    }
+
+    return hal_rects;
+}
+
+int ms9132_hal_update_frame(struct msdisp_usb_hal* usb_hal, u8* buf, int pitch, u32 len, unsigned int fourcc, u8* ubuf, u8* vbuf, int uv_pitch,
+    const struct drm_rect* rects, int rect_cnt)
+{
+    struct msdisp_usb_device* msdisp_usb = (struct msdisp_usb_device *)usb_hal->private;
+    struct usb_hal* hal = msdisp_usb->hal;
+    struct usb_hal_rect hal_rects[USB_HAL_MAX_RECTS];
+    struct usb_hal_rect* r = ms9132_hal_to_hal_rects(rects, rect_cnt, hal_rects);
+
+    return usb_hal_update_frame(hal, buf, pitch, len, fourcc, ubuf, vbuf, uv_pitch, r, r ? rect_cnt : 0);
+}
+
+int ms9132_hal_update_frame_pages(struct msdisp_usb_hal* usb_hal, u8* buf, struct page** pages, int pitch, u32 len, unsigned int fourcc,
+    const struct drm_rect* rects, int rect_cnt, void (*release)(void* ctx), void* ctx)
 {
     struct msdisp_usb_device* msdisp_usb = (struct msdisp_usb_device *)usb_hal->private;
     struct usb_hal* hal = msdisp_usb->hal;
+    struct usb_hal_rect hal_rects[USB_HAL_MAX_RECTS];
+    struct usb_hal_rect* r = ms9132_hal_to_hal_rects(rects, rect_cnt, hal_rects);
 
-    return usb_hal_update_frame(hal, buf, pitch, len, fourcc, try_lock);
+    return usb_hal_update_frame_pages(hal, buf, pages, pitch, len, fourcc, r, r ? rect_cnt : 0, release, ctx);
 }
 
 int ms9132_hal_get_custom_cea_vic(struct msdisp_usb_hal* usb_hal, u8* buf, int size, int* cnt)
@@ -126,6 +160,20 @@ int ms9132_hal_get_custom_cea_vic(struct msdisp_usb_hal* usb_hal, u8* buf, int s
     return 0;
 }
 
+u32 ms9132_hal_get_frame_seq(struct msdisp_usb_hal* usb_hal)
+{
+    struct msdisp_usb_device* msdisp_usb = (struct msdisp_usb_device *)usb_hal->private;
+
+    return usb_hal_get_frame_seq(msdisp_usb->hal);
+}
+
+void ms9132_hal_set_frame_done(struct msdisp_usb_hal* usb_hal, void (*done)(void* ctx, u32 seq), void* ctx)
+{
+    struct msdisp_usb_device* msdisp_usb = (struct msdisp_usb_device *)usb_hal->private;
+
+    usb_hal_set_frame_done(msdisp_usb->hal, done, ctx);
+}
+
 struct msdisp_usb_hal_funcs ms9132_hal_funcs = {
     .get_hpd_status = ms9132_hal_get_hpd_status,
     .get_edid = ms9132_hal_get_edid,
@@ -133,7 +181,10 @@ struct msdisp_usb_hal_funcs ms9132_hal_funcs = {
     .enable = ms9132_hal_enable,
     .disable = ms9132_hal_disable,
     .update_frame = ms9132_hal_update_frame,
-    .get_custom_cea_vic = ms9132_hal_get_custom_cea_vic
+    .update_frame_pages = ms9132_hal_update_frame_pages,
+    .get_custom_cea_vic = ms9132_hal_get_custom_cea_vic,
+    .get_frame_seq = ms9132_hal_get_frame_seq,
+    .set_frame_done = ms9132_hal_set_frame_done
 };
 
 struct msdisp_usb_hal_funcs* msdisp_usb_find_usb_hal(const struct usb_device_id *id)
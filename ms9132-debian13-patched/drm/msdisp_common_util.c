@@ -12,8 +12,15 @@
  * msdisp_common_util.c -- Drm driver for MacroSilicon chip 913x and 912x
  */
 
+#include <linux/module.h>
+#include <linux/kernel.h>
 #include <linux/mutex.h>
 #include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 
 #include "msdisp_common_util.h"
 
@@ -69,4 +76,87 @@ void msdisp_common_save_buf_to_bmp(u8* buf, u32 width, u32 height, u32 cpp, stru
 	}
 
     filp_close(fp, NULL);
-}
\ No newline at end of file
+}
+
+void msdisp_common_hist_add(struct msdisp_common_hist* hist, s64 us)
+{
+	int i = 0;
+
+	if (us < 0) {
+		us = 0;
+	}
+	if (us) {
+		i = min_t(int, ilog2((u64)us) + 1, MSDISP_COMMON_HIST_BUCKETS - 1);
+	}
+
+	atomic64_inc(&hist->bucket[i]);
+	atomic64_inc(&hist->cnt);
+	atomic64_add(us, &hist->sum_us);
+}
+EXPORT_SYMBOL(msdisp_common_hist_add);
+
+static int msdisp_common_hist_show(struct seq_file* m, void* data)
+{
+	struct msdisp_common_hist* hist = m->private;
+	s64 cnt = atomic64_read(&hist->cnt);
+	s64 n;
+	int i;
+
+	seq_printf(m, "count:%lld avg:%lld\n", cnt, cnt ? div64_s64(atomic64_read(&hist->sum_us), cnt) : 0);
+	for (i = 0; i < MSDISP_COMMON_HIST_BUCKETS; i++) {
+		n = atomic64_read(&hist->bucket[i]);
+		if (!n) {
+			continue;
+		}
+
+		if (!i) {
+			seq_printf(m, "%10u-%-10u %lld\n", 0, 0, n);
+		} else if (i == MSDISP_COMMON_HIST_BUCKETS - 1) {
+			seq_printf(m, "%10u-%-10s %lld\n", 1U << (i - 1), "inf", n);
+		} else {
+			seq_printf(m, "%10u-%-10u %lld\n", 1U << (i - 1), (1U << i) - 1, n);
+		}
+	}
+
+	return 0;
+}
+
+static int msdisp_common_hist_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, msdisp_common_hist_show, inode->i_private);
+}
+
+const struct file_operations msdisp_common_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = msdisp_common_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+EXPORT_SYMBOL(msdisp_common_hist_fops);
+
+// each counter is read whole, a cpu counting meanwhile is retried on 32 bit
+void msdisp_common_stat_fold(const void __percpu* pcpu, size_t stat_off, size_t syncp_off, u64* sum, int cnt)
+{
+	const struct u64_stats_sync* syncp;
+	const u64* from;
+	const u8* base;
+	unsigned int start;
+	u64 val;
+	int cpu, i;
+
+	memset(sum, 0, cnt * sizeof(u64));
+	for_each_possible_cpu(cpu) {
+		base = per_cpu_ptr((const u8 __percpu*)pcpu, cpu);
+		from = (const u64*)(base + stat_off);
+		syncp = (const struct u64_stats_sync*)(base + syncp_off);
+		for (i = 0; i < cnt; i++) {
+			do {
+				start = u64_stats_fetch_begin(syncp);
+				val = from[i];
+			} while (u64_stats_fetch_retry(syncp, start));
+			sum[i] += val;
+		}
+	}
+}
+EXPORT_SYMBOL(msdisp_common_stat_fold);
@@ -15,8 +15,27 @@
 #ifndef __MSDISP_COMMON_UTIL_H__
 #define __MSDISP_COMMON_UTIL_H__
 #include <linux/types.h>
+#include <linux/version.h>
+#include <linux/stddef.h>
+#include <linux/atomic.h>
 
 struct mutex;
+struct file_operations;
+
+// sysfs files of both modules print through this
+#if KERNEL_VERSION(5, 10, 0) > LINUX_VERSION_CODE
+#define sysfs_emit_at(buf, at, fmt, ...) scnprintf((buf) + (at), PAGE_SIZE - (at), fmt, ##__VA_ARGS__)
+#endif
+
+/* log2 latency histogram, bucket 0 counts 0us, bucket i [2^(i-1), 2^i) us, the last one everything above */
+#define MSDISP_COMMON_HIST_BUCKETS 24
+
+struct msdisp_common_hist
+{
+    atomic64_t bucket[MSDISP_COMMON_HIST_BUCKETS];
+    atomic64_t cnt;
+    atomic64_t sum_us;
+};
 
 struct bmp_file_header
 {
@@ -44,4 +63,18 @@ struct bmp_info_header
 
 void msdisp_common_save_buf_to_bmp(u8* buf, u32 width, u32 height, u32 cpp, struct mutex* lock, const char* file_name);
 
+// shared with the usb module, the fops show the histogram passed as debugfs data
+void msdisp_common_hist_add(struct msdisp_common_hist* hist, s64 us);
+extern const struct file_operations msdisp_common_hist_fops;
+
+/*
+ * Per-cpu counters are a struct of u64 named stat next to the u64_stats_sync syncp guarding it,
+ * sum gets the counters of all cpus added up
+ */
+void msdisp_common_stat_fold(const void __percpu* pcpu, size_t stat_off, size_t syncp_off, u64* sum, int cnt);
+
+#define msdisp_common_stat_read(pcpu, sum) \
+	msdisp_common_stat_fold((pcpu), offsetof(typeof(*(pcpu)), stat), offsetof(typeof(*(pcpu)), syncp), \
+		(u64*)(sum), sizeof(*(sum)) / sizeof(u64))
+
 #endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * msdisp_drm_debugfs.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/version.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+
+#include <drm/drm_drv.h>
+
+#include "msdisp_drm_drv.h"
+
+/*
+ * msdisp/<device>/pipeline<n> in debugfs, latencies of a frame seen from drm:
+ *   commit_to_convert_us  atomic commit to the frame worker starting to convert it
+ *   commit_to_trigger_us  atomic commit to the chip told to show the frame
+ * The usb hal adds the stages in between to the hal dir below it.
+ */
+
+static struct dentry* msdisp_debugfs_root;
+
+void msdisp_drm_debugfs_register(void)
+{
+	msdisp_debugfs_root = debugfs_create_dir("msdisp", NULL);
+	if (IS_ERR(msdisp_debugfs_root)) {
+		msdisp_debugfs_root = NULL;
+	}
+}
+
+void msdisp_drm_debugfs_unregister(void)
+{
+	debugfs_remove_recursive(msdisp_debugfs_root);
+	msdisp_debugfs_root = NULL;
+}
+
+void msdisp_drm_debugfs_init(struct msdisp_drm_device * msdisp_drm)
+{
+	struct msdisp_drm_pipeline* pipeline;
+	struct dentry* dir;
+	char name[32];
+	int i;
+
+	if (!msdisp_debugfs_root) {
+		return;
+	}
+
+	dir = debugfs_create_dir(dev_name(msdisp_drm->drm.dev), msdisp_debugfs_root);
+	if (IS_ERR_OR_NULL(dir)) {
+		return;
+	}
+	msdisp_drm->debugfs = dir;
+
+	for (i = 0; i < msdisp_drm->pipeline_cnt; i++) {
+		pipeline = &msdisp_drm->pipeline[i];
+		snprintf(name, sizeof(name), "pipeline%d", i);
+		dir = debugfs_create_dir(name, msdisp_drm->debugfs);
+		if (IS_ERR_OR_NULL(dir)) {
+			continue;
+		}
+
+		debugfs_create_file("commit_to_convert_us", 0444, dir, &pipeline->hist_commit_convert, &msdisp_common_hist_fops);
+		debugfs_create_file("commit_to_trigger_us", 0444, dir, &pipeline->hist_commit_trigger, &msdisp_common_hist_fops);
+		pipeline->debugfs = dir;
+	}
+}
+
+void msdisp_drm_debugfs_exit(struct msdisp_drm_device * msdisp_drm)
+{
+	int i;
+
+	for (i = 0; i < msdisp_drm->pipeline_cnt; i++) {
+		msdisp_drm->pipeline[i].debugfs = NULL;
+	}
+	debugfs_remove_recursive(msdisp_drm->debugfs);
+	msdisp_drm->debugfs = NULL;
+}
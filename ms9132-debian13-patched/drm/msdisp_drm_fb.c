@@ -167,6 +167,37 @@ int msdisp_drm_fb_get_bpp(uint32_t format)
 	return info->cpp[0] * 8;
 }
 
+/*
+ * The hal reads every plane through the one mapping of the first object, so
+ * planar formats keep all their planes in that object. The chroma planes are
+ * handed over with one pitch, u and v have to share it. size is set to the
+ * bytes the fb spans.
+ */
+static int msdisp_drm_fb_check_planes(struct drm_device *dev,
+				      const struct drm_mode_fb_cmd2 *mode_cmd,
+				      u64 *size)
+{
+	const struct drm_format_info *info = drm_format_info(mode_cmd->pixel_format);
+	u64 end;
+	u32 height;
+	int i;
+
+	*size = 0;
+	for (i = 0; i < info->num_planes; i++) {
+		height = i ? DIV_ROUND_UP(mode_cmd->height, info->vsub) : mode_cmd->height;
+		if ((mode_cmd->handles[i] != mode_cmd->handles[0]) ||
+		    ((i > 1) && (mode_cmd->pitches[i] != mode_cmd->pitches[1]))) {
+			dev_err(dev->dev, "plane %d of format 0x%x not in the luma object or its pitch differs\n",
+				i, mode_cmd->pixel_format);
+			return -EINVAL;
+		}
+		end = mode_cmd->offsets[i] + (u64)mode_cmd->pitches[i] * height;
+		*size = max(*size, end);
+	}
+
+	return 0;
+}
+
 struct drm_framebuffer *msdisp_drm_fb_user_fb_create(
 					struct drm_device *dev,
 					struct drm_file *file,
@@ -175,14 +206,16 @@ struct drm_framebuffer *msdisp_drm_fb_user_fb_create(
 	struct drm_gem_object *obj;
 	struct msdisp_drm_framebuffer *efb;
 	int ret;
-	uint32_t size;
-	int bpp = msdisp_drm_fb_get_bpp(mode_cmd->pixel_format);
+	u64 size;
 
-	if (bpp != 32) {
-		dev_err(dev->dev, "Unsupported bpp (%d)\n", bpp);
+	if (!msdisp_drm_plane_format_supported(mode_cmd->pixel_format)) {
+		dev_err(dev->dev, "Unsupported format (0x%x)\n", mode_cmd->pixel_format);
 		return ERR_PTR(-EINVAL);
 	}
 
+	if (msdisp_drm_fb_check_planes(dev, mode_cmd, &size))
+		return ERR_PTR(-EINVAL);
+
 	dev_dbg(dev->dev, "fb id:0x%x format:0x%x handle:0x%x width:%d height:%d pitch:%d\n",  \
 		mode_cmd->fb_id, mode_cmd->pixel_format, mode_cmd->handles[0], mode_cmd->width, mode_cmd->height, mode_cmd->pitches[0]);
 
@@ -190,11 +223,10 @@ struct drm_framebuffer *msdisp_drm_fb_user_fb_create(
 	if (obj == NULL)
 		return ERR_PTR(-ENOENT);
 
-	size = mode_cmd->offsets[0] + mode_cmd->pitches[0] * mode_cmd->height;
 	size = ALIGN(size, PAGE_SIZE);
 
 	if (size > obj->size) {
-		dev_err(dev->dev, "object size not sufficient for fb %d %zu %u %d %d\n",
+		dev_err(dev->dev, "object size not sufficient for fb %llu %zu %u %d %d\n",
 			  size, obj->size, mode_cmd->offsets[0],
 			  mode_cmd->pitches[0], mode_cmd->height);
 		goto err_no_mem;
@@ -164,12 +164,12 @@ static int msdisp_drm_align_pitch(int width, int cpp)
 
 	switch (cpp) {
 	case 1:
-		pitch_mask = 255;
-		break;
 	case 2:
-		pitch_mask = 127;
-		break;
 	case 3:
+		// tight rows, the chip's own formats go out without a copy and
+		// planar luma gains nothing from padding
+		pitch_mask = 0;
+		break;
 	case 4:
 		pitch_mask = 63;
 		break;
@@ -162,6 +162,20 @@ struct kobject* msdisp_drm_get_pipeline_kobject(struct drm_device* drm, int pipe
 }
 EXPORT_SYMBOL(msdisp_drm_get_pipeline_kobject);
 
+struct dentry* msdisp_drm_get_pipeline_debugfs(struct drm_device* drm, int pipeline_index)
+{
+    if (!drm ) {
+        return NULL;
+    }
+
+    if (pipeline_index >= MSDISP_DRM_MAX_PIPELINE_CNT) {
+        return NULL;
+    }
+
+    return to_msdisp_drm(drm)->pipeline[pipeline_index].debugfs;
+}
+EXPORT_SYMBOL(msdisp_drm_get_pipeline_debugfs);
+
 int msdisp_drm_register_usb_hal(struct drm_device* drm, int pipeline_index, struct msdisp_usb_hal* usb_hal)
 {
     struct msdisp_drm_device* msdisp_drm = to_msdisp_drm(drm);
@@ -182,6 +196,11 @@ int msdisp_drm_register_usb_hal(struct drm_device* drm, int pipeline_index, stru
     }
     mutex_lock(&pipeline->hal_lock);
     pipeline->usb_hal = usb_hal;
+    pipeline->id = msdisp_drm_get_pipeline_global_id(drm, pipeline_index);
+    pipeline->done_seq = 0;
+    if (usb_hal->funcs->set_frame_done) {
+        usb_hal->funcs->set_frame_done(usb_hal, msdisp_drm_frame_done, pipeline);
+    }
     mutex_unlock(&pipeline->hal_lock);
     if (MSDISP_DRM_STATUS_ENABLE == pipeline->drm_status) {
         ret = usb_hal->funcs->enable(usb_hal, pipeline->drm_width, pipeline->drm_height, pipeline->drm_rate, pipeline->drm_fb_format);
@@ -205,6 +224,9 @@ int msdisp_drm_unregister_usb_hal(struct drm_device* drm, int pipeline_index)
 
     pipeline = &msdisp_drm->pipeline[pipeline_index];
     mutex_lock(&pipeline->hal_lock);
+    if (pipeline->usb_hal && pipeline->usb_hal->funcs->set_frame_done) {
+        pipeline->usb_hal->funcs->set_frame_done(pipeline->usb_hal, NULL, NULL);
+    }
     pipeline->usb_hal = NULL;
     pipeline->reg_flag = 0;
     mutex_unlock(&pipeline->hal_lock);
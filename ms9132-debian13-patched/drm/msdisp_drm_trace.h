@@ -0,0 +1,103 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * msdisp_drm_trace.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM msdisp_drm
+
+#if !defined(__MSDISP_DRM_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __MSDISP_DRM_TRACE_H__
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Frame life on the drm side, pipeline is the global id the usb hal traces
+ * with and commit the pipeline's commit_seq. msdisp_drm_frame_sent ties a
+ * commit to the frame seq of the usb hal events.
+ */
+
+/* area is the damaged pixels, all of them when rects is -1 */
+TRACE_EVENT(msdisp_drm_update_begin,
+	TP_PROTO(int pipeline, u32 commit, int rects, u32 area),
+	TP_ARGS(pipeline, commit, rects, area),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, commit)
+		__field(int, rects)
+		__field(u32, area)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->commit = commit;
+		__entry->rects = rects;
+		__entry->area = area;
+	),
+	TP_printk("pipeline=%d commit=%u rects=%d area=%u", __entry->pipeline, __entry->commit, __entry->rects, __entry->area)
+);
+
+/* coalesced when the frame replaced one the worker hadn't picked up yet */
+TRACE_EVENT(msdisp_drm_update_end,
+	TP_PROTO(int pipeline, u32 commit, int coalesced),
+	TP_ARGS(pipeline, commit, coalesced),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, commit)
+		__field(int, coalesced)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->commit = commit;
+		__entry->coalesced = coalesced;
+	),
+	TP_printk("pipeline=%d commit=%u coalesced=%d", __entry->pipeline, __entry->commit, __entry->coalesced)
+);
+
+/* seq 0 if the hal didn't take the frame */
+TRACE_EVENT(msdisp_drm_frame_sent,
+	TP_PROTO(int pipeline, u32 commit, u32 seq),
+	TP_ARGS(pipeline, commit, seq),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, commit)
+		__field(u32, seq)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->commit = commit;
+		__entry->seq = seq;
+	),
+	TP_printk("pipeline=%d commit=%u seq=%u", __entry->pipeline, __entry->commit, __entry->seq)
+);
+
+TRACE_EVENT(msdisp_drm_frame_done,
+	TP_PROTO(int pipeline, u32 seq),
+	TP_ARGS(pipeline, seq),
+	TP_STRUCT__entry(
+		__field(int, pipeline)
+		__field(u32, seq)
+	),
+	TP_fast_assign(
+		__entry->pipeline = pipeline;
+		__entry->seq = seq;
+	),
+	TP_printk("pipeline=%d seq=%u", __entry->pipeline, __entry->seq)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE msdisp_drm_trace
+#include <trace/define_trace.h>
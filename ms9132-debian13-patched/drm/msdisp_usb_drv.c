@@ -242,6 +242,7 @@ static int msdisp_usb_probe(struct usb_interface *interface,
 			dev_err(&udev->dev, "create syslink failed!ret=%d\n", ret);
 		}
 	}
+	usb_hal_debugfs_init(usb_dev->hal, msdisp_drm_get_pipeline_debugfs(usb_dev->drm, usb_dev->pipeline_index));
 	
 
 	//msdisp_usb_sysfs_init(interface);
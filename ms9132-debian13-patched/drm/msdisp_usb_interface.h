@@ -20,6 +20,11 @@ struct usb_device;
 struct usb_device_id;
 struct msdisp_usb_hal;
 struct drm_display_mode;
+struct drm_rect;
+struct page;
+
+/* damage clips handed to update_frame, more are merged into their bounding box */
+#define MSDISP_MAX_DAMAGE_RECTS     8
 
 
 struct msdisp_usb_hal_funcs
@@ -31,8 +36,16 @@ struct msdisp_usb_hal_funcs
     int (*mode_valid)(struct msdisp_usb_hal* usb_hal, int width, int height, int rate);
     int (*enable)(struct msdisp_usb_hal* usb_hal, int width, int height, int rate, unsigned int fourcc);
     int (*disable)(struct msdisp_usb_hal* usb_hal);
-    int (*update_frame)(struct msdisp_usb_hal* usb_hal, u8* buf, int pitch, u32 len, unsigned int fourcc, int try_lock);
+    /* ubuf and vbuf are the chroma planes of planar formats, uv_pitch apart, vbuf NULL when interleaved */
+    int (*update_frame)(struct msdisp_usb_hal* usb_hal, u8* buf, int pitch, u32 len, unsigned int fourcc, u8* ubuf, u8* vbuf, int uv_pitch,
+        const struct drm_rect* rects, int rect_cnt);
+    /* optional, send buf in place from its pages, -EOPNOTSUPP if it has to go through update_frame */
+    int (*update_frame_pages)(struct msdisp_usb_hal* usb_hal, u8* buf, struct page** pages, int pitch, u32 len, unsigned int fourcc,
+        const struct drm_rect* rects, int rect_cnt, void (*release)(void* ctx), void* ctx);
     int (*get_custom_cea_vic)(struct msdisp_usb_hal* usb_hal, u8* buf, int size, int* cnt);
+    /* optional, number of the last frame taken and a hook called with it once the frame has been sent */
+    u32 (*get_frame_seq)(struct msdisp_usb_hal* usb_hal);
+    void (*set_frame_done)(struct msdisp_usb_hal* usb_hal, void (*done)(void* ctx, u32 seq), void* ctx);
     //int (*get_pitch)(struct msdisp_usb_hal* usb_hal, int width, int height);
     //void (*wake_event_proc)(struct msdisp_usb_hal* usb_hal);
 };
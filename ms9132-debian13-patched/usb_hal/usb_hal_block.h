@@ -0,0 +1,34 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_block.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_BLOCK_H__
+#define __USB_HAL_BLOCK_H__
+
+#include <linux/types.h>
+
+struct usb_hal_dev;
+struct usb_hal_buffer;
+struct usb_hal_xfer;
+struct usb_hal_rect;
+struct usb_hal_video_mode;
+
+/* converter side */
+u8 usb_hal_block_enable(struct usb_hal_dev* usb_dev, struct usb_hal_video_mode* mode);
+void usb_hal_block_record(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, const struct usb_hal_rect* rects, int rect_cnt);
+
+/* sender side */
+int usb_hal_block_send(struct usb_hal_dev* usb_dev, struct usb_hal_xfer* xfer, struct usb_hal_buffer* usb_buf, int resend);
+void usb_hal_block_done(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, int slot, int success);
+
+#endif
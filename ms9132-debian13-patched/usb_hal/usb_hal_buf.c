@@ -0,0 +1,442 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_buf.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_buf.h"
+#include "usb_hal_xfer.h"
+#include "usb_hal_gov.h"
+
+/*
+ * Staging buffer pool. A buffer moves FREE -> FILLING -> READY -> INFLIGHT -> SHOWN
+ * and back to FREE when a newer frame is shown. There is at most one buffer in
+ * each of FILLING, READY, INFLIGHT and SHOWN, so with USB_HAL_BUF_CNT buffers the
+ * converter always finds a FREE or READY one and never waits for the wire.
+ *
+ * The READY buffer lives in a single slot mailbox. The converter posts a finished
+ * frame with xchg() and takes back whatever the sender did not pick up yet, so a
+ * burst of commits collapses into the newest frame instead of a queue of stale
+ * ones. When nothing is in flight the converter may instead start the transfer
+ * itself, which lets RGB frames stream while they are being converted.
+ *
+ * buf_lock only orders the state changes that decide who owns the wire.
+ *
+ * Each buffer also remembers what changed on screen since it was last written.
+ * A frame is converted only where the new damage or the buffer's own stale areas
+ * are, and its damage is added to the stale areas of the other buffers. The rest
+ * of the buffer already holds the current picture.
+ *
+ * Frames already in wire format may skip the staging buffers. A zero-copy buffer
+ * goes through the same states but points at the framebuffer pages, which stay
+ * borrowed until the buffer is FREE again, so a shown frame can still be resent.
+ * They are given back with release() after buf_lock is dropped, it may sleep.
+ *
+ * Every frame taken gets a frame_seq. The first time a buffer is retired its
+ * frame_seq is reported to frame_done, which covers the superseded frames too.
+ */
+
+/* what a zero-copy buffer borrowed, given back once buf_lock is dropped */
+struct usb_hal_buf_loan {
+	void (*release)(void* ctx);
+	void* ctx;
+};
+
+static const char* g_buf_state_name[] = {
+	"free", "filling", "ready", "inflight", "shown"
+};
+
+const char* usb_hal_buf_state_name(int state)
+{
+	if ((state < 0) || (state >= ARRAY_SIZE(g_buf_state_name))) {
+		return "unknown";
+	}
+
+	return g_buf_state_name[state];
+}
+
+static struct usb_hal_buffer* usb_hal_buf_find_in_locked(struct usb_hal_buffer* bufs, int cnt, int state)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (state == bufs[i].state) {
+			return &bufs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct usb_hal_buffer* usb_hal_buf_find_locked(struct usb_hal_dev* usb_dev, int state)
+{
+	struct usb_hal_buffer* usb_buf;
+
+	usb_buf = usb_hal_buf_find_in_locked(usb_dev->usb_buf, USB_HAL_BUF_CNT, state);
+	if (!usb_buf) {
+		usb_buf = usb_hal_buf_find_in_locked(usb_dev->zc_buf, USB_HAL_ZC_BUF_CNT, state);
+	}
+
+	return usb_buf;
+}
+
+/* nothing for staging buffers */
+static void usb_hal_buf_take_loan(struct usb_hal_buffer* usb_buf, struct usb_hal_buf_loan* loan)
+{
+	loan->release = usb_buf->release;
+	loan->ctx = usb_buf->release_ctx;
+	usb_buf->release = NULL;
+	usb_buf->release_ctx = NULL;
+}
+
+static void usb_hal_buf_return_loan(struct usb_hal_buf_loan* loan)
+{
+	if (loan->release) {
+		loan->release(loan->ctx);
+	}
+}
+
+/* hand usb_buf to the transmit engine, lock held and nothing else in flight */
+static void usb_hal_buf_begin_locked(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, u32 ready)
+{
+	usb_buf->state = USB_HAL_BUF_STATE_INFLIGHT;
+	usb_hal_gov_sent(usb_dev);
+	// blocks are packed and sent by the sender thread, see usb_hal_block.c
+	usb_buf->block = (USH_HAL_TRANS_MODE_MANUAL_BLOCK == usb_dev->trans_mode);
+	if (!usb_buf->block) {
+		usb_hal_xfer_begin(usb_dev->xfer, usb_buf, usb_buf->len, ready);
+	}
+}
+
+struct usb_hal_buffer* usb_hal_buf_acquire(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_buf_loan loan = { NULL, NULL };
+	struct usb_hal_buffer* usb_buf;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_buf = usb_hal_buf_find_in_locked(usb_dev->usb_buf, USB_HAL_BUF_CNT, USB_HAL_BUF_STATE_FREE);
+	if (!usb_buf) {
+		// the sender has not picked up the last frame yet, overwrite it
+		usb_buf = xchg(&usb_dev->mailbox, NULL);
+		if (usb_buf) {
+			usb_hal_stat_inc(usb_dev, ready_replaced);
+		}
+		// a zero-copy one is no use here, but dropping it frees a staging buffer
+		if (usb_buf && (USB_HAL_BUF_TYPE_PAGES == usb_buf->type)) {
+			usb_hal_buf_take_loan(usb_buf, &loan);
+			usb_buf->state = USB_HAL_BUF_STATE_FREE;
+			usb_buf = usb_hal_buf_find_in_locked(usb_dev->usb_buf, USB_HAL_BUF_CNT, USB_HAL_BUF_STATE_FREE);
+		}
+	}
+
+	if (usb_buf) {
+		usb_buf->state = USB_HAL_BUF_STATE_FILLING;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	usb_hal_buf_return_loan(&loan);
+	return usb_buf;
+}
+
+/*
+ * Zero-copy counterpart of usb_hal_buf_acquire(), the frame is sent straight
+ * from buf and its pages. release(ctx) is called once the buffer is free again.
+ */
+struct usb_hal_buffer* usb_hal_buf_acquire_pages(struct usb_hal_dev* usb_dev, u8* buf, struct page** pages, u32 page_cnt,
+	void (*release)(void* ctx), void* ctx)
+{
+	struct usb_hal_buf_loan loan = { NULL, NULL };
+	struct usb_hal_buffer* usb_buf;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_buf = usb_hal_buf_find_in_locked(usb_dev->zc_buf, USB_HAL_ZC_BUF_CNT, USB_HAL_BUF_STATE_FREE);
+	if (!usb_buf) {
+		usb_buf = xchg(&usb_dev->mailbox, NULL);
+		if (usb_buf) {
+			usb_hal_stat_inc(usb_dev, ready_replaced);
+		}
+		if (usb_buf && (USB_HAL_BUF_TYPE_PAGES != usb_buf->type)) {
+			usb_buf->state = USB_HAL_BUF_STATE_FREE;
+			usb_buf = usb_hal_buf_find_in_locked(usb_dev->zc_buf, USB_HAL_ZC_BUF_CNT, USB_HAL_BUF_STATE_FREE);
+		}
+	}
+
+	if (usb_buf) {
+		usb_hal_buf_take_loan(usb_buf, &loan);
+		usb_buf->state = USB_HAL_BUF_STATE_FILLING;
+		usb_buf->buf = buf;
+		usb_buf->pages = pages;
+		usb_buf->page_cnt = page_cnt;
+		usb_buf->size = page_cnt << PAGE_SHIFT;
+		usb_buf->release = release;
+		usb_buf->release_ctx = ctx;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	usb_hal_buf_return_loan(&loan);
+	return usb_buf;
+}
+
+/* start sending usb_buf before it is written, only if the wire is idle */
+int usb_hal_buf_start(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
+{
+	int started = 0;
+
+	spin_lock(&usb_dev->buf_lock);
+	if (!usb_hal_buf_find_locked(usb_dev, USB_HAL_BUF_STATE_INFLIGHT) && !READ_ONCE(usb_dev->mailbox)) {
+		usb_hal_buf_begin_locked(usb_dev, usb_buf, 0);
+		started = 1;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	return started;
+}
+
+/* usb_buf is fully written, post it unless it is already on the wire */
+void usb_hal_buf_post(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
+{
+	struct usb_hal_buf_loan loan = { NULL, NULL };
+	struct usb_hal_buffer* old;
+
+	if (USB_HAL_BUF_STATE_FILLING != usb_buf->state) {
+		return;
+	}
+
+	usb_buf->state = USB_HAL_BUF_STATE_READY;
+	old = xchg(&usb_dev->mailbox, usb_buf);
+	if (old) {
+		// never picked up by the sender, the newer frame supersedes it
+		usb_hal_buf_take_loan(old, &loan);
+		WRITE_ONCE(old->state, USB_HAL_BUF_STATE_FREE);
+		usb_hal_stat_inc(usb_dev, ready_replaced);
+		usb_hal_buf_return_loan(&loan);
+	}
+}
+
+/* frame the sender has to finish next: the one in flight, else the posted one */
+struct usb_hal_buffer* usb_hal_buf_next(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_buffer* usb_buf;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_buf = usb_hal_buf_find_locked(usb_dev, USB_HAL_BUF_STATE_INFLIGHT);
+	if (!usb_buf) {
+		usb_buf = xchg(&usb_dev->mailbox, NULL);
+		if (usb_buf) {
+			usb_hal_buf_begin_locked(usb_dev, usb_buf, usb_buf->len);
+		}
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	return usb_buf;
+}
+
+/* the frame on the wire, without taking the posted one */
+struct usb_hal_buffer* usb_hal_buf_inflight(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_buffer* usb_buf;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_buf = usb_hal_buf_find_locked(usb_dev, USB_HAL_BUF_STATE_INFLIGHT);
+	spin_unlock(&usb_dev->buf_lock);
+
+	return usb_buf;
+}
+
+/* send the shown frame again when the wire is idle and nothing is posted */
+struct usb_hal_buffer* usb_hal_buf_resend(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_buffer* usb_buf = NULL;
+
+	spin_lock(&usb_dev->buf_lock);
+	if (!usb_hal_buf_find_locked(usb_dev, USB_HAL_BUF_STATE_INFLIGHT) && !READ_ONCE(usb_dev->mailbox)) {
+		usb_buf = usb_hal_buf_find_locked(usb_dev, USB_HAL_BUF_STATE_SHOWN);
+		if (usb_buf) {
+			usb_hal_buf_begin_locked(usb_dev, usb_buf, usb_buf->len);
+		}
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	return usb_buf;
+}
+
+/* usb_buf has been sent and triggered */
+void usb_hal_buf_retire(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
+{
+	struct usb_hal_buf_loan loan = { NULL, NULL };
+	struct usb_hal_buffer* shown;
+	void (*done)(void* ctx, u32 seq) = NULL;
+	void* done_ctx = NULL;
+	u32 seq = usb_buf->frame_seq;
+
+	spin_lock(&usb_dev->buf_lock);
+	shown = usb_hal_buf_find_locked(usb_dev, USB_HAL_BUF_STATE_SHOWN);
+	if (shown && (shown != usb_buf)) {
+		usb_hal_buf_take_loan(shown, &loan);
+		shown->state = USB_HAL_BUF_STATE_FREE;
+	}
+	usb_buf->state = USB_HAL_BUF_STATE_SHOWN;
+	// a resend has nothing new to report
+	if (seq && (seq != usb_dev->done_seq)) {
+		usb_dev->done_seq = seq;
+		done = usb_dev->frame_done;
+		done_ctx = usb_dev->frame_done_ctx;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	usb_hal_buf_return_loan(&loan);
+	if (done) {
+		done(done_ctx, seq);
+	}
+}
+
+/* stamp a frame just taken from the converter side */
+void usb_hal_buf_set_seq(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
+{
+	u32 seq = usb_dev->frame_seq + 1;
+
+	if (!seq) {
+		seq++;
+	}
+	usb_buf->frame_seq = seq;
+	WRITE_ONCE(usb_dev->frame_seq, seq);
+}
+
+/* device is not enabled, throw the posted frame away */
+void usb_hal_buf_drop(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_buf_loan loan = { NULL, NULL };
+	struct usb_hal_buffer* usb_buf;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_buf = xchg(&usb_dev->mailbox, NULL);
+	if (usb_buf) {
+		usb_hal_buf_take_loan(usb_buf, &loan);
+		usb_buf->state = USB_HAL_BUF_STATE_FREE;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	usb_hal_buf_return_loan(&loan);
+}
+
+/* nothing is resent while the device is off, give back a shown zero-copy frame */
+void usb_hal_buf_put_pages(struct usb_hal_dev* usb_dev)
+{
+	struct usb_hal_buf_loan loan = { NULL, NULL };
+	struct usb_hal_buffer* usb_buf;
+
+	spin_lock(&usb_dev->buf_lock);
+	usb_buf = usb_hal_buf_find_in_locked(usb_dev->zc_buf, USB_HAL_ZC_BUF_CNT, USB_HAL_BUF_STATE_SHOWN);
+	if (usb_buf) {
+		usb_hal_buf_take_loan(usb_buf, &loan);
+		usb_buf->state = USB_HAL_BUF_STATE_FREE;
+	}
+	spin_unlock(&usb_dev->buf_lock);
+
+	usb_hal_buf_return_loan(&loan);
+}
+
+void usb_hal_damage_add(struct usb_hal_damage* damage, const struct usb_hal_rect* rect)
+{
+	struct usb_hal_rect* r;
+	int i;
+
+	if (damage->full) {
+		return;
+	}
+
+	for (i = 0; i < damage->cnt; i++) {
+		r = &damage->rect[i];
+		if ((rect->x1 >= r->x1) && (rect->x2 <= r->x2) && (rect->y1 >= r->y1) && (rect->y2 <= r->y2)) {
+			return;
+		}
+	}
+
+	if (damage->cnt < USB_HAL_MAX_RECTS) {
+		damage->rect[damage->cnt++] = *rect;
+		return;
+	}
+
+	// out of slots, collapse everything into the bounding box
+	r = &damage->rect[0];
+	for (i = 1; i < damage->cnt; i++) {
+		r->x1 = min(r->x1, damage->rect[i].x1);
+		r->y1 = min(r->y1, damage->rect[i].y1);
+		r->x2 = max(r->x2, damage->rect[i].x2);
+		r->y2 = max(r->y2, damage->rect[i].y2);
+	}
+	r->x1 = min(r->x1, rect->x1);
+	r->y1 = min(r->y1, rect->y1);
+	r->x2 = max(r->x2, rect->x2);
+	r->y2 = max(r->y2, rect->y2);
+	damage->cnt = 1;
+}
+
+void usb_hal_damage_merge(struct usb_hal_damage* damage, const struct usb_hal_damage* from)
+{
+	int i;
+
+	if (from->full) {
+		damage->full = 1;
+		return;
+	}
+
+	for (i = 0; i < from->cnt; i++) {
+		usb_hal_damage_add(damage, &from->rect[i]);
+	}
+}
+
+/*
+ * Work out what to convert into usb_buf for a frame with the given damage clips,
+ * already clipped to the mode. rects == NULL means the whole frame changed.
+ */
+void usb_hal_buf_take_damage(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, const struct usb_hal_rect* rects, int rect_cnt,
+	struct usb_hal_damage* damage)
+{
+	struct usb_hal_damage frame;
+	int i;
+
+	memset(&frame, 0, sizeof(frame));
+	if (!rects || (rect_cnt > USB_HAL_MAX_RECTS)) {
+		frame.full = 1;
+	} else {
+		for (i = 0; i < rect_cnt; i++) {
+			usb_hal_damage_add(&frame, &rects[i]);
+		}
+	}
+
+	for (i = 0; i < USB_HAL_BUF_CNT; i++) {
+		if (&usb_dev->usb_buf[i] != usb_buf) {
+			usb_hal_damage_merge(&usb_dev->usb_buf[i].stale, &frame);
+		}
+	}
+
+	*damage = usb_buf->stale;
+	usb_hal_damage_merge(damage, &frame);
+	memset(&usb_buf->stale, 0, sizeof(usb_buf->stale));
+}
+
+/* buffer contents no longer match the mode, the next frame in each is converted whole */
+void usb_hal_buf_invalidate(struct usb_hal_dev* usb_dev)
+{
+	int i;
+
+	for (i = 0; i < USB_HAL_BUF_CNT; i++) {
+		usb_dev->usb_buf[i].stale.cnt = 0;
+		usb_dev->usb_buf[i].stale.full = 1;
+	}
+}
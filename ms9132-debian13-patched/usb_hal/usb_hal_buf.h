@@ -0,0 +1,50 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_buf.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_BUF_H__
+#define __USB_HAL_BUF_H__
+
+#include <linux/types.h>
+
+struct usb_hal_dev;
+struct usb_hal_buffer;
+struct usb_hal_rect;
+struct usb_hal_damage;
+struct page;
+
+/* converter side */
+struct usb_hal_buffer* usb_hal_buf_acquire(struct usb_hal_dev* usb_dev);
+struct usb_hal_buffer* usb_hal_buf_acquire_pages(struct usb_hal_dev* usb_dev, u8* buf, struct page** pages, u32 page_cnt,
+	void (*release)(void* ctx), void* ctx);
+int usb_hal_buf_start(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf);
+void usb_hal_buf_post(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf);
+void usb_hal_buf_set_seq(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf);
+void usb_hal_buf_take_damage(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, const struct usb_hal_rect* rects, int rect_cnt,
+	struct usb_hal_damage* damage);
+void usb_hal_buf_invalidate(struct usb_hal_dev* usb_dev);
+
+void usb_hal_damage_add(struct usb_hal_damage* damage, const struct usb_hal_rect* rect);
+void usb_hal_damage_merge(struct usb_hal_damage* damage, const struct usb_hal_damage* from);
+
+/* sender side */
+struct usb_hal_buffer* usb_hal_buf_next(struct usb_hal_dev* usb_dev);
+struct usb_hal_buffer* usb_hal_buf_inflight(struct usb_hal_dev* usb_dev);
+struct usb_hal_buffer* usb_hal_buf_resend(struct usb_hal_dev* usb_dev);
+void usb_hal_buf_retire(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf);
+void usb_hal_buf_drop(struct usb_hal_dev* usb_dev);
+void usb_hal_buf_put_pages(struct usb_hal_dev* usb_dev);
+
+const char* usb_hal_buf_state_name(int state);
+
+#endif
@@ -0,0 +1,40 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_gov.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_GOV_H__
+#define __USB_HAL_GOV_H__
+
+#include <linux/types.h>
+
+/* damage is added up over this long before the load is updated, ms */
+#define USB_HAL_GOV_WINDOW_MS                   200
+
+struct usb_hal_dev;
+struct usb_hal_rect;
+
+void usb_hal_gov_init(struct usb_hal_dev* usb_dev);
+void usb_hal_gov_exit(struct usb_hal_dev* usb_dev);
+/* a new mode, start over at the full rate */
+void usb_hal_gov_reset(struct usb_hal_dev* usb_dev);
+/* converter, a frame with these clipped damage rects is coming, NULL for all of buf */
+void usb_hal_gov_update(struct usb_hal_dev* usb_dev, const u8* buf, int pitch, u32 len, const struct usb_hal_rect* rects, int rect_cnt);
+/* whether a posted frame may be taken for the wire now */
+int usb_hal_gov_due(struct usb_hal_dev* usb_dev);
+/* a frame was taken for the wire, buf_lock held */
+void usb_hal_gov_sent(struct usb_hal_dev* usb_dev);
+/* sender thread, a posted frame was held back, wake up once it is due */
+void usb_hal_gov_hold(struct usb_hal_dev* usb_dev);
+const char* usb_hal_gov_state_name(int state);
+
+#endif
@@ -24,7 +24,6 @@
 #include <linux/mm_types.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
-#include <linux/semaphore.h>
 #include <linux/completion.h>
 #include <linux/scatterlist.h>
 #include <linux/kfifo.h>
@@ -37,15 +36,49 @@
 #include "usb_hal_event.h"
 #include "usb_hal_dev.h"
 #include "usb_hal_thread.h"
+#include "usb_hal_xfer.h"
+#include "usb_hal_buf.h"
+#include "usb_hal_block.h"
+#include "usb_hal_pack.h"
+#include "usb_hal_stripe.h"
+#include "usb_hal_debugfs.h"
+#include "usb_hal_bw.h"
+#include "usb_hal_gov.h"
 #include "hal_adaptor.h"
 #include "ms9132_hid.h"
 
+#define CREATE_TRACE_POINTS
+#include "usb_hal_trace.h"
+
 void usb_hal_sysfs_init(struct usb_interface *interface);
 void usb_hal_sysfs_exit(struct usb_interface *interface);
 
+static unsigned short usb_hal_stream_stripe_kb = 128;
+module_param_named(stream_stripe_kb, usb_hal_stream_stripe_kb, ushort, 0644);
+MODULE_PARM_DESC(stream_stripe_kb, "Stripe size in KB for overlapping RGB conversion with transfer, 0 to disable (default: 128)");
+
+static unsigned short usb_hal_trans_block = 0;
+module_param_named(trans_block, usb_hal_trans_block, ushort, 0644);
+MODULE_PARM_DESC(trans_block, "Send only changed blocks in manual block transfer mode, experimental, applies to new devices (default: 0)");
+
+static unsigned short usb_hal_wire_format = USB_HAL_WIRE_FORMAT_RGB888;
+module_param_named(wire_format, usb_hal_wire_format, ushort, 0644);
+MODULE_PARM_DESC(wire_format, "Wire format of 32bpp planes for new devices, 0 RGB888, 1 RGB565, 2 YUV422 (default: 0)");
+
+static unsigned short usb_hal_zero_copy = 0;
+module_param_named(zero_copy, usb_hal_zero_copy, ushort, 0644);
+MODULE_PARM_DESC(zero_copy, "Send framebuffers already in wire format and tightly pitched without copying them (default: 0)");
+
+static unsigned short usb_hal_wire_dither = 1;
+module_param_named(wire_dither, usb_hal_wire_dither, ushort, 0644);
+MODULE_PARM_DESC(wire_dither, "Ordered dither when packing to RGB565 (default: 1)");
+
 #define USB_HAL_COLOR_FORMAT_RGB                0
 #define USB_HAL_COLOR_FORMAT_YUV                1
 
+#define USB_HAL_EVENT_POST_RETRY                100
+#define USB_HAL_EVENT_POST_WAIT                 10
+
 struct fourcc_format_desc {
     u32 fourcc;
     u8 color_fmt;
@@ -78,6 +111,8 @@ static struct fourcc_format_desc g_support_arr[] = {
 
 static int g_support_num = (sizeof(g_support_arr) / sizeof(struct fourcc_format_desc));
 
+static void usb_hal_plan_init(struct usb_hal_dev* usb_dev, struct fourcc_format_desc* desc);
+
 int usb_hal_get_hpd_status(struct usb_hal* hal, u32* status)
 {
     struct usb_hal_dev* usb_dev;
@@ -220,6 +255,50 @@ int usb_hal_is_support_fourcc(u32 fourcc)
     return desc ? 1 : 0;
 }
 
+/*
+ * Control events must not be lost: enable carries the whole video setup and a lost
+ * disable leaves the chip scanning out. The fifo only holds control events now, so
+ * it is full only if the sender is stuck; wait for it a while before giving up.
+ */
+static int usb_hal_post_event(struct usb_hal_dev* usb_dev, struct usb_hal_event* event)
+{
+    int retry = USB_HAL_EVENT_POST_RETRY;
+
+    while (!kfifo_in_spinlocked(usb_dev->fifo, event, sizeof(*event), &usb_dev->event_lock)) {
+        if (!retry--) {
+            usb_hal_stat_inc(usb_dev, event_lost);
+            dev_err(&usb_dev->udev->dev, "event fifo full, lost event:%x\n", event->base.type);
+            return -ENOSPC;
+        }
+
+        usb_hal_stat_inc(usb_dev, event_wait);
+        usb_hal_kick_thread(usb_dev);
+        msleep(USB_HAL_EVENT_POST_WAIT);
+    }
+
+    usb_hal_kick_thread(usb_dev);
+    return 0;
+}
+
+/* what the chip is fed for desc, 32bpp RGB is packed to the wire format of the device */
+static u8 usb_hal_wire_vpack_in(struct usb_hal_dev* usb_dev, struct fourcc_format_desc* desc)
+{
+    if ((USB_HAL_COLOR_FORMAT_RGB != desc->color_fmt) || (32 != desc->bpp)) {
+        return desc->vpack_in;
+    }
+
+    switch (usb_dev->wire_format) {
+        case USB_HAL_WIRE_FORMAT_RGB565:
+            return USB_HAL_COLOR_FORMAT_RGB565;
+        case USB_HAL_WIRE_FORMAT_YUV422:
+            return USB_HAL_COLOR_FORMAT_YUV422;
+        default:
+            break;
+    }
+
+    return desc->vpack_in;
+}
+
 int usb_hal_enable(struct usb_hal* hal, struct usb_hal_video_mode* mode, u32 fourcc)
 {
     struct usb_hal_dev* usb_dev;
@@ -244,10 +323,13 @@ int usb_hal_enable(struct usb_hal* hal, struct usb_hal_video_mode* mode, u32 fou
     }
 
     usb_dev->mode = *mode;
+    usb_hal_buf_invalidate(usb_dev);
+    usb_dev->trans_mode = usb_hal_block_enable(usb_dev, mode);
 
     desc = usb_hal_find_desc(fourcc);
     usb_dev->color_out = ((desc->bpp > 16) ? USB_HAL_COLOR_FORMAT_RGB888 : USB_HAL_COLOR_FORMAT_RGB565);
-    usb_dev->vpack_in = desc->vpack_in;
+    usb_dev->vpack_in = usb_hal_wire_vpack_in(usb_dev, desc);
+    usb_hal_plan_init(usb_dev, desc);
 
     color_in = ((usb_dev->vpack_out << 4) | usb_dev->vpack_in);
 
@@ -261,10 +343,7 @@ int usb_hal_enable(struct usb_hal* hal, struct usb_hal_video_mode* mode, u32 fou
     event.para.enable.color_in = color_in;
     event.para.enable.color_out = usb_dev->color_out;
 
-    kfifo_in(usb_dev->fifo, &event, sizeof(event));
-	up(&usb_dev->sema);
-
-    return 0;
+    return usb_hal_post_event(usb_dev, &event);
 }
 
 int usb_hal_disable(struct usb_hal* hal)
@@ -280,10 +359,8 @@ int usb_hal_disable(struct usb_hal* hal)
     memset(&event, 0, sizeof(event));
     event.base.type = USB_HAL_EVENT_TYPE_DISABLE;
 	event.base.length =  sizeof(event);
-    kfifo_in(usb_dev->fifo, &event, sizeof(event));
-	up(&usb_dev->sema);
 
-    return 0;
+    return usb_hal_post_event(usb_dev, &event);
 }
 
 int usb_hal_is_disabled(struct usb_hal* hal)
@@ -298,73 +375,102 @@ int usb_hal_is_disabled(struct usb_hal* hal)
     return (USB_HAL_DEV_STATE_DISABLED == usb_dev->state) ? 1 : 0;
 }
 
-static void usb_hal_rgb32_to_bgr888_line(u8 *dbuf, u8 *sbuf, unsigned int pixels, int is_rgb)
+/* frame number of the last frame usb_hal_update_frame(_pages) took, 0 before the first */
+u32 usb_hal_get_frame_seq(struct usb_hal* hal)
 {
-	unsigned int x;
+    struct usb_hal_dev* usb_dev;
 
-    if (is_rgb) {
-        for (x = 0; x < pixels; x++) {
-            *dbuf++ = *sbuf;
-            *dbuf++ = *(sbuf + 1);
-            *dbuf++ = *(sbuf + 2);
-            sbuf += 4;
-	    }
-    } else {
-        for (x = 0; x < pixels; x++) {
-            *dbuf++ = *(sbuf + 2);
-            *dbuf++ = *(sbuf + 1);
-            *dbuf++ = *sbuf;
-            sbuf += 4;
-	    }
+    if (!hal) {
+        return 0;
     }
-	
+
+    usb_dev = (struct usb_hal_dev*)hal->private;
+    return READ_ONCE(usb_dev->frame_seq);
 }
 
-int usb_hal_cpy_rgb32_to_rgb24(char* src, char* dst, int pitch, int width, int height, int is_rgb)
+/*
+ * done(ctx, seq) is called from the sender thread once frame seq has been sent,
+ * frames it superseded are done as well. A call already on its way may still
+ * reach the old hook after it is replaced, ctx has to outlive the device.
+ */
+void usb_hal_set_frame_done(struct usb_hal* hal, void (*done)(void* ctx, u32 seq), void* ctx)
 {
-    size_t linepixels = width;
-	size_t dst_len = linepixels * 3;
-	unsigned y, lines = height;
-	int cpy_len = 0;
+    struct usb_hal_dev* usb_dev;
 
-	for (y = 0; y < lines; y++) {
-		usb_hal_rgb32_to_bgr888_line(dst, src, linepixels, is_rgb);
-		cpy_len += dst_len;
-		src += pitch;
-		dst += dst_len;
-	}
+    if (!hal) {
+        return;
+    }
 
-	return cpy_len;
+    usb_dev = (struct usb_hal_dev*)hal->private;
+    spin_lock(&usb_dev->buf_lock);
+    usb_dev->frame_done = done;
+    usb_dev->frame_done_ctx = ctx;
+    spin_unlock(&usb_dev->buf_lock);
 }
 
-static void usb_hal_cpy_bgr24_to_rgb24(char* src, char* dst, int pix_cnt)
+/* one frame being converted, shared by the stripe workers */
+struct usb_hal_conv {
+    struct usb_hal_dev* usb_dev;
+    const struct usb_hal_plan* plan;
+    u8* dst;
+    u8* buf;
+    int pitch;
+    struct usb_hal_damage* damage;
+    /* chroma planes of planar formats, vbuf NULL when interleaved */
+    u8* ubuf;
+    u8* vbuf;
+    int uv_pitch;
+};
+
+/* the chip's own format, only the pitch padding has to go */
+static void usb_hal_conv_copy(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
 {
-	int i;
-	for (i = 0; i < pix_cnt; i++){
-		dst[i * 3] = src[i * 3 + 2];
-		dst[i * 3 + 1] = src[i * 3 + 1];
-		dst[i * 3 + 2] = src[i * 3];
-	}
+    u32 line = conv->plan->line;
+    int cpp = conv->plan->cpp;
+    int i;
+
+    if ((conv->pitch == line) && (0 == x1) && (conv->usb_dev->mode.width == x2)) {
+        memcpy(conv->dst + y * line, conv->buf + y * line, rows * line);
+        return;
+    }
+
+    for (i = y; i < y + rows; i++) {
+        memcpy(conv->dst + i * line + x1 * cpp, conv->buf + i * conv->pitch + x1 * cpp, (x2 - x1) * cpp);
+    }
 }
 
-static int usb_hal_rgb_copy(struct usb_hal_dev* usb_dev, u8* buf, int pitch, u32 len, struct fourcc_format_desc* desc)
+static void usb_hal_conv_bgr24(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
 {
-    int cpy_len;
-    struct usb_hal_buffer* usb_buf = &usb_dev->usb_buf;
+    u32 line = conv->plan->line;
 
-    if ((DRM_FORMAT_RGB565 == desc->fourcc) || (DRM_FORMAT_RGB888 == desc->fourcc)) {
-        memcpy(usb_buf->buf, buf, len);
-        cpy_len = len;
-    } else if (DRM_FORMAT_BGR888 == desc->fourcc) {
-        usb_hal_cpy_bgr24_to_rgb24(buf, usb_buf->buf, usb_dev->mode.width * usb_dev->mode.height);
-        cpy_len = len;
-    } else {
-        int is_rgb;
-        is_rgb = ((DRM_FORMAT_XRGB8888 == desc->fourcc) || (DRM_FORMAT_ARGB8888 == desc->fourcc)) ? 1 : 0;
-        cpy_len = usb_hal_cpy_rgb32_to_rgb24(buf, usb_buf->buf, pitch, usb_dev->mode.width, usb_dev->mode.height, is_rgb);
-    }
+    usb_hal_pack_bgr24(conv->dst + y * line + x1 * 3, conv->buf + y * conv->pitch + x1 * 3, conv->pitch, line, x2 - x1, rows);
+}
+
+static void usb_hal_conv_rgb24(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
+{
+    u32 line = conv->plan->line;
 
-    return cpy_len;
+    usb_hal_pack_rgb32(conv->dst + y * line + x1 * 3, conv->buf + y * conv->pitch + x1 * 4, conv->pitch, line, x2 - x1, rows,
+        conv->plan->is_rgb);
+}
+
+static void usb_hal_conv_rgb565(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
+{
+    u32 line = conv->plan->line;
+
+    usb_hal_pack_rgb565(conv->dst + y * line + x1 * 2, conv->buf + y * conv->pitch + x1 * 4, conv->pitch, line, x1, y, x2 - x1, rows,
+        conv->plan->is_rgb, usb_hal_wire_dither);
+}
+
+static void usb_hal_conv_yuv422(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
+{
+    u32 line = conv->plan->line;
+
+    // chroma is shared by pixel pairs, keep them whole
+    x1 = round_down(x1, 2);
+    x2 = min_t(int, round_up(x2, 2), conv->usb_dev->mode.width);
+    usb_hal_pack_yuv422(conv->dst + y * line + x1 * 2, conv->buf + y * conv->pitch + x1 * 4, conv->pitch, line, x2 - x1, rows,
+        conv->plan->is_rgb);
 }
 
 static void cpy_yplane_to_yuv422p(struct yuv422p_pix* dst, u8* ybuf, int width, int height)
@@ -396,174 +502,238 @@ static void cpy_uvplane_to_yuv422p(struct yuv422p_pix* dst, u8* uvbuf, int width
     }
 }
 
-static void cpy_u_v_plane_to_yuv422p(struct yuv422p_pix* dst, u8* ubuf, u8* vbuf, int width, int height, int dy)
+#if 0
+static int usb_hal_cpy_nv24_to_yuv444p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
 {
-    int i, j;
-
-    for (i = 0; i < height / dy; i += 1) {
-        for (j = 0; j < width / 2; j += 1) {
-            dst->u0 = *ubuf;
-            dst->v0 = *vbuf;
-            ubuf++;
-            vbuf++;
-            dst += 1;
-        }
-        dst += ((dy - 1) * width / 2);
-    }
+    return 0;
 }
 
-static void scale_up_linear(struct yuv422p_pix* dst, int width, int height)
+static int usb_hal_yuv422_to_yuv422p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
 {
-    int i, j;
-    struct yuv422p_pix *top, *bottom, *cur, *row, *prev_row, *next_row;
-
-    for (i = 1; i < height - 1; i += 2) {
-        prev_row = dst + (i - 1) * width / 2;
-        row = dst + i * width / 2;
-        next_row = dst + (i + 1) * width / 2;
-        for (j = 0; j < width / 2; j++) {
-            cur = row + j;
-            top = prev_row + j;
-            bottom = next_row + j;
-
-            cur->u0 = ((u16)top->u0 + (u16)bottom->u0) / 2;
-            cur->v0 = ((u16)top->v0 + (u16)bottom->v0) / 2;
-        }
-    }
+    return 0;
+}
 
-    // process last row
-    cur = dst + (height - 1) * width / 2;
-    top = dst + (height - 2) * width / 2;
-    for (i = 0; i < width / 2; i++) {
-        cur->u0 = top->u0;
-        cur->v0 = top->v0;
-        cur++;
-        top++;
-    }
+static int usb_hal_yuv444_to_yuv444p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
+{
+    return 0;
 }
+#endif
 
-static int usb_hal_cpy_nv16_to_yuv422p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
+/* the yuv converters take whole rows, every plane at its own offset and pitch */
+static void usb_hal_conv_nv12(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
 {
-    int width, height;
-    //u8* dst, uv_start;
-    u8 *uv_start;
-    struct usb_hal_buffer* usb_buf = &usb_dev->usb_buf;
-    struct yuv422p_pix* dst;
+    // luma and chroma in one pass, each output row is written once
+    usb_hal_pack_yuv420(conv->dst, conv->buf, conv->pitch, conv->ubuf, conv->ubuf + 1, conv->uv_pitch, 2,
+        conv->usb_dev->mode.width, conv->usb_dev->mode.height, y, rows);
+}
 
-    width = usb_dev->mode.width;
-    height = usb_dev->mode.height;
+static void usb_hal_conv_yuv420(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
+{
+    usb_hal_pack_yuv420(conv->dst, conv->buf, conv->pitch, conv->ubuf, conv->vbuf, conv->uv_pitch, 1,
+        conv->usb_dev->mode.width, conv->usb_dev->mode.height, y, rows);
+}
 
-    //dst = usb_buf->buf + 1;
-    dst = (struct yuv422p_pix*)usb_buf->buf;
-    cpy_yplane_to_yuv422p(dst, buf, width, height);
+static void usb_hal_conv_nv16(const struct usb_hal_conv* conv, int x1, int x2, int y, int rows)
+{
+    struct yuv422p_pix* dst = (struct yuv422p_pix*)conv->dst;
+    int width = conv->usb_dev->mode.width;
 
-    uv_start = (buf + width * height);
-    cpy_uvplane_to_yuv422p(dst, uv_start, width, height, 1);
-    
-    return len;
+    cpy_yplane_to_yuv422p(dst + y * width / 2, conv->buf + y * conv->pitch, width, rows);
+    cpy_uvplane_to_yuv422p(dst + y * width / 2, conv->ubuf + y * conv->uv_pitch, width, rows, 1);
 }
 
-static int usb_hal_cpy_nv12_to_yuv422p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
+/*
+ * Resolve how frames of desc are converted on the wire format in use, once at
+ * enable. The per frame path then only follows usb_dev->plan.
+ */
+static void usb_hal_plan_init(struct usb_hal_dev* usb_dev, struct fourcc_format_desc* desc)
 {
-    int width, height;
-    //u8* dst, uv_start;
-    u8 *uv_start;
-    struct usb_hal_buffer* usb_buf = &usb_dev->usb_buf;
-    struct yuv422p_pix* dst;
-
-    width = usb_dev->mode.width;
-    height = usb_dev->mode.height;
+    struct usb_hal_plan* plan = &usb_dev->plan;
+    u32 width = usb_dev->mode.width;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->fourcc = desc->fourcc;
+    plan->cpp = desc->bpp / 8;
+    plan->is_rgb = ((DRM_FORMAT_XRGB8888 == desc->fourcc) || (DRM_FORMAT_ARGB8888 == desc->fourcc)) ? 1 : 0;
+
+    if (USB_HAL_COLOR_FORMAT_YUV == desc->color_fmt) {
+        switch (desc->fourcc) {
+            case DRM_FORMAT_NV12:
+                plan->convert = usb_hal_conv_nv12;
+                plan->chroma_planes = 1;
+                break;
+            case DRM_FORMAT_YUV420:
+                plan->convert = usb_hal_conv_yuv420;
+                plan->chroma_planes = 2;
+                break;
+            default:
+                plan->convert = usb_hal_conv_nv16;
+                plan->chroma_planes = 1;
+                break;
+        }
+        plan->line = width * 2;
+    } else if ((DRM_FORMAT_RGB565 == desc->fourcc) || (DRM_FORMAT_RGB888 == desc->fourcc)) {
+        plan->convert = usb_hal_conv_copy;
+        plan->line = width * plan->cpp;
+        plan->native = 1;
+    } else if (DRM_FORMAT_BGR888 == desc->fourcc) {
+        plan->convert = usb_hal_conv_bgr24;
+        plan->line = width * 3;
+    } else if (USB_HAL_COLOR_FORMAT_YUV422 == usb_dev->vpack_in) {
+        plan->convert = usb_hal_conv_yuv422;
+        plan->line = width * 2;
+    } else if (USB_HAL_COLOR_FORMAT_RGB565 == usb_dev->vpack_in) {
+        plan->convert = usb_hal_conv_rgb565;
+        plan->line = width * 2;
+    } else {
+        plan->convert = usb_hal_conv_rgb24;
+        plan->line = width * 3;
+    }
 
-    //dst = usb_buf->buf + 1;
-    dst = (struct yuv422p_pix*)usb_buf->buf;
-    cpy_yplane_to_yuv422p(dst, buf, width, height);
+    // yuv planes are converted whole, only rgb follows the damage and streams
+    plan->damage = (USB_HAL_COLOR_FORMAT_RGB == desc->color_fmt);
+    plan->stream = plan->damage;
+    plan->out_len = plan->line * usb_dev->mode.height;
+}
 
-    uv_start = (buf + width * height);
-    cpy_uvplane_to_yuv422p(dst, uv_start, width, height, 2);
-    scale_up_linear(dst, width, height);
+static void usb_hal_conv_stripe(void* ctx, int y, int n)
+{
+    struct usb_hal_conv* conv = ctx;
+    struct usb_hal_damage* damage = conv->damage;
+    struct usb_hal_rect* r;
+    int i, y1, y2;
 
-    //printk("%s:w0h0:y0:0x%x y1:0x%x u0:0x%x v0:0x%x\n", __func__, dst->y0, dst->y1, dst->u0, dst->v0);
-    //dst += width / 2;
-    //printk("%s:w1h0:y0:0x%x y1:0x%x u0:0x%x v0:0x%x\n", __func__, dst->y0, dst->y1, dst->u0, dst->v0);
-    //dst += width / 2;
-    //printk("%s:w2h0:y0:0x%x y1:0x%x u0:0x%x v0:0x%x\n", __func__, dst->y0, dst->y1, dst->u0, dst->v0);
+    if (damage->full) {
+        conv->plan->convert(conv, 0, conv->usb_dev->mode.width, y, n);
+        return;
+    }
 
-    return width * height * 2;
+    for (i = 0; i < damage->cnt; i++) {
+        r = &damage->rect[i];
+        y1 = max_t(int, r->y1, y);
+        y2 = min_t(int, r->y2, y + n);
+        if (y1 < y2) {
+            conv->plan->convert(conv, r->x1, r->x2, y1, y2 - y1);
+        }
+    }
 }
 
-static int usb_hal_cpy_yuv420_to_yuv422p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
+static void usb_hal_conv_ready(void* ctx, int rows)
 {
-    int width, height;
-    //u8* dst, uv_start;
-    u8 *ubuf, *vbuf;
-    struct usb_hal_buffer* usb_buf = &usb_dev->usb_buf;
-    struct yuv422p_pix* dst;
+    struct usb_hal_conv* conv = ctx;
 
-    width = usb_dev->mode.width;
-    height = usb_dev->mode.height;
-
-    //dst = usb_buf->buf + 1;
-    dst = (struct yuv422p_pix*)usb_buf->buf;
-    cpy_yplane_to_yuv422p(dst, buf, width, height);
+    usb_hal_xfer_publish(conv->usb_dev->xfer, conv->plan->line * rows);
+}
 
-    ubuf = (buf + width * height);
-    vbuf = ubuf + width * height / 4;
-    cpy_u_v_plane_to_yuv422p(dst, ubuf, vbuf, width, height, 2);
-    scale_up_linear(dst, width, height);
+static const struct usb_hal_stripe_ops usb_hal_conv_stripe_ops = {
+    .convert = usb_hal_conv_stripe,
+};
 
-    return width * height * 2;
-}
+static const struct usb_hal_stripe_ops usb_hal_conv_stream_ops = {
+    .convert = usb_hal_conv_stripe,
+    .ready = usb_hal_conv_ready,
+};
 
-#if 0
-static int usb_hal_cpy_nv24_to_yuv444p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
+/*
+ * In stream mode the frame is converted in stripes of about usb_hal_stream_stripe_kb
+ * and every finished stripe is published to the transmit engine, which is already
+ * sending the previous ones. Stripes are whole rows and only the converted prefix
+ * of usb_buf is ever published, see usb_hal_stripe.c.
+ *
+ * Only the damaged part of each stripe is converted, the rest of usb_buf already
+ * holds the current picture. Returns the bytes of usb_buf that are valid.
+ */
+static int usb_hal_conv_frame(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf, u8* buf, int pitch, u8* ubuf, u8* vbuf, int uv_pitch,
+    struct usb_hal_damage* damage, int stream)
 {
-    return 0;
-}
+    const struct usb_hal_plan* plan = &usb_dev->plan;
+    struct usb_hal_conv conv;
+    int width = usb_dev->mode.width;
+    int height = usb_dev->mode.height;
+    int rows, i, workers;
+    u32 pixels = 0;
+    struct usb_hal_rect* r;
+    ktime_t start;
+    u64 cpu_ns;
+
+    if (!height || !width || !pitch) {
+        return 0;
+    }
 
-static int usb_hal_yuv422_to_yuv422p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
-{
-    return 0;
-}
+    if (damage->full) {
+        pixels = width * height;
+    } else {
+        for (i = 0; i < damage->cnt; i++) {
+            r = &damage->rect[i];
+            pixels += (r->x2 - r->x1) * (r->y2 - r->y1);
+        }
+    }
 
-static int usb_hal_yuv444_to_yuv444p(struct usb_hal_dev* usb_dev, u8* buf, u32 len)
-{
-    return 0;
+    workers = usb_hal_stripe_workers(usb_dev->stripe, pixels * (plan->line / width));
+    if (stream) {
+        rows = ((u32)usb_hal_stream_stripe_kb << 10) / plan->line;
+    } else {
+        // a few stripes per cpu so the damaged ones spread out
+        rows = DIV_ROUND_UP(height, workers * 4);
+    }
+
+    conv.usb_dev = usb_dev;
+    conv.plan = plan;
+    conv.dst = usb_buf->buf;
+    conv.buf = buf;
+    conv.pitch = pitch;
+    conv.damage = damage;
+    conv.ubuf = ubuf;
+    conv.vbuf = vbuf;
+    conv.uv_pitch = uv_pitch;
+    trace_usb_hal_convert_start(usb_dev->index, usb_buf->frame_seq, pixels * (plan->line / width));
+    start = ktime_get();
+    cpu_ns = usb_hal_stripe_run(usb_dev->stripe, workers, height, rows, stream ? &usb_hal_conv_stream_ops : &usb_hal_conv_stripe_ops,
+        &conv);
+    trace_usb_hal_convert_end(usb_dev->index, usb_buf->frame_seq, pixels * (plan->line / width));
+
+    msdisp_common_hist_add(&usb_dev->hist_convert, ktime_us_delta(ktime_get(), start));
+    msdisp_common_hist_add(&usb_dev->hist_convert_cpu, div_u64(cpu_ns, NSEC_PER_USEC));
+    usb_hal_stat_add(usb_dev, damage_pixels, pixels);
+    return plan->out_len;
 }
-#endif
 
-static int usb_hal_yuv_copy(struct usb_hal_dev* usb_dev, u8* buf, u32 len, struct fourcc_format_desc* desc)
+/* clip the damage to the mode, NULL if it ends up covering the whole frame */
+static const struct usb_hal_rect* usb_hal_clip_rects(struct usb_hal_dev* usb_dev, const struct usb_hal_rect* rects, int* rect_cnt,
+    struct usb_hal_rect* clip)
 {
-    int cpy_len;
+    u16 width = usb_dev->mode.width;
+    u16 height = usb_dev->mode.height;
+    int i, cnt = 0;
 
-    switch (desc->fourcc)
-    {
-        case DRM_FORMAT_NV16:
-            cpy_len = usb_hal_cpy_nv16_to_yuv422p(usb_dev, buf, len);
-            break;
-        case DRM_FORMAT_NV24:
-            break;
-        case DRM_FORMAT_NV12:
-            cpy_len = usb_hal_cpy_nv12_to_yuv422p(usb_dev, buf, len);
-            break;
-        case DRM_FORMAT_YUV420:
-            cpy_len = usb_hal_cpy_yuv420_to_yuv422p(usb_dev, buf, len);
-            break;
-        case DRM_FORMAT_YUV422:
-            break;
-        default:
-            break;
+    if (!rects || (*rect_cnt <= 0) || (*rect_cnt > USB_HAL_MAX_RECTS)) {
+        return NULL;
+    }
+
+    for (i = 0; i < *rect_cnt; i++) {
+        clip[cnt].x1 = min(rects[i].x1, width);
+        clip[cnt].y1 = min(rects[i].y1, height);
+        clip[cnt].x2 = min(rects[i].x2, width);
+        clip[cnt].y2 = min(rects[i].y2, height);
+        if ((clip[cnt].x1 < clip[cnt].x2) && (clip[cnt].y1 < clip[cnt].y2)) {
+            cnt++;
+        }
     }
 
-    return cpy_len;
+    *rect_cnt = cnt;
+    return clip;
 }
 
-int usb_hal_update_frame(struct usb_hal* hal, u8* buf, int pitch, u32 len, u32 fourcc, int try_lock)
+int usb_hal_update_frame(struct usb_hal* hal, u8* buf, int pitch, u32 len, u32 fourcc, u8* ubuf, u8* vbuf, int uv_pitch,
+    const struct usb_hal_rect* rects, int rect_cnt)
 {
     struct usb_hal_dev* usb_dev;
-    struct fourcc_format_desc* desc;
-    struct usb_hal_event event;
+    const struct usb_hal_plan* plan;
     struct usb_hal_buffer* usb_buf;
+    struct usb_hal_rect clip[USB_HAL_MAX_RECTS];
+    struct usb_hal_damage damage;
     int cpy_len = 0;
+    int stream;
 
 
     if (!hal || !buf) {
@@ -573,38 +743,122 @@ int usb_hal_update_frame(struct usb_hal* hal, u8* buf, int pitch, u32 len, u32 f
     usb_dev = (struct usb_hal_dev*)hal->private;
 
     if (usb_dev->state != USB_HAL_DEV_STATE_ENABLED) {
-        usb_dev->stat.state_error++;
+        usb_hal_stat_inc(usb_dev, state_error);
         return -EPERM;
     }
 
-    usb_buf = &usb_dev->usb_buf;
-    desc = usb_hal_find_desc(fourcc);
+    plan = &usb_dev->plan;
+    // a flip to another format goes through a modeset, anything else is a stale frame
+    if (fourcc != plan->fourcc) {
+        usb_hal_stat_inc(usb_dev, state_error);
+        return -EINVAL;
+    }
+
+    if (((plan->chroma_planes > 0) && !ubuf) || ((plan->chroma_planes > 1) && !vbuf)) {
+        return -EINVAL;
+    }
+
+    // with a free or superseded staging buffer always available this never waits for the wire
+    usb_buf = usb_hal_buf_acquire(usb_dev);
+    if (!usb_buf) {
+        usb_hal_stat_inc(usb_dev, no_free_buf);
+        return -EBUSY;
+    }
 
-    if (try_lock) {
-        int ret;
-        ret = mutex_trylock(&usb_buf->mutex);
-        if (!ret) {
-            usb_dev->stat.try_lock_fail++;
-            return -EBUSY;
+    usb_hal_buf_set_seq(usb_dev, usb_buf);
+    usb_buf->frame_start = ktime_get();
+    rects = usb_hal_clip_rects(usb_dev, rects, &rect_cnt, clip);
+    usb_hal_gov_update(usb_dev, buf, pitch, len, rects, rect_cnt);
+    if (USH_HAL_TRANS_MODE_MANUAL_BLOCK == usb_dev->trans_mode) {
+        usb_hal_block_record(usb_dev, usb_buf, rects, rect_cnt);
+    }
+    usb_hal_buf_take_damage(usb_dev, usb_buf, rects, rect_cnt, &damage);
+    if (!plan->damage) {
+        damage.full = 1;
+    }
+    if (damage.full) {
+        usb_hal_stat_inc(usb_dev, damage_full);
+    }
+
+    stream = 0;
+    if ((usb_hal_stream_stripe_kb > 0) && plan->stream && (USH_HAL_TRANS_MODE_FRAME == usb_dev->trans_mode) &&
+        usb_hal_gov_due(usb_dev)) {
+        usb_buf->len = plan->out_len;
+        stream = usb_hal_buf_start(usb_dev, usb_buf);
+        if (stream) {
+            usb_hal_stat_inc(usb_dev, stream_frames);
         }
-    } else {
-        mutex_lock(&usb_buf->mutex);
     }
     
-    if (USB_HAL_COLOR_FORMAT_RGB == desc->color_fmt) {
-        cpy_len = usb_hal_rgb_copy(usb_dev, buf, pitch, len, desc);
-    } else {
-        cpy_len = usb_hal_yuv_copy(usb_dev, buf, len, desc);
+    cpy_len = usb_hal_conv_frame(usb_dev, usb_buf, buf, pitch, ubuf, vbuf, uv_pitch, &damage, stream);
+
+    if (!stream) {
+        usb_buf->len = cpy_len;
     }
 
-    mutex_unlock(&usb_buf->mutex);
+    // frames go through the mailbox, only control events use the fifo
+    usb_hal_buf_post(usb_dev, usb_buf);
+	usb_hal_kick_thread(usb_dev);
 
-    memset(&event, 0, sizeof(event));
-    event.base.type = USB_HAL_EVENT_TYPE_UPDATE;
-    event.base.length = sizeof(event);
-    event.para.update.len = cpy_len;
-    kfifo_in(usb_dev->fifo, &event, sizeof(event));
-	up(&usb_dev->sema);
+    return 0;
+}
+
+/*
+ * Send a frame straight from the pages behind buf, without a staging buffer.
+ * Only for formats the chip takes as they are with rows pitch apart and no
+ * padding, -EOPNOTSUPP otherwise and the caller converts as usual.
+ *
+ * On success release(ctx) is called once the frame is neither on the wire nor
+ * kept for resending, on error it is not called at all.
+ */
+int usb_hal_update_frame_pages(struct usb_hal* hal, u8* buf, struct page** pages, int pitch, u32 len, u32 fourcc,
+    const struct usb_hal_rect* rects, int rect_cnt, void (*release)(void* ctx), void* ctx)
+{
+    struct usb_hal_dev* usb_dev;
+    struct usb_hal_buffer* usb_buf;
+    struct usb_hal_rect clip[USB_HAL_MAX_RECTS];
+    struct usb_hal_damage damage;
+    const struct usb_hal_plan* plan;
+
+    if (!hal || !buf || !pages || !release) {
+        return -EINVAL;
+    }
+
+    usb_dev = (struct usb_hal_dev*)hal->private;
+    plan = &usb_dev->plan;
+    if (!usb_hal_zero_copy || !plan->native || (fourcc != plan->fourcc) || !usb_dev->udev->bus->sg_tablesize) {
+        return -EOPNOTSUPP;
+    }
+
+    if (usb_dev->state != USB_HAL_DEV_STATE_ENABLED) {
+        usb_hal_stat_inc(usb_dev, state_error);
+        return -EPERM;
+    }
+
+    if ((pitch != plan->line) || (len < plan->out_len)) {
+        return -EOPNOTSUPP;
+    }
+
+    usb_buf = usb_hal_buf_acquire_pages(usb_dev, buf, pages, DIV_ROUND_UP(len, PAGE_SIZE), release, ctx);
+    if (!usb_buf) {
+        usb_hal_stat_inc(usb_dev, no_free_buf);
+        return -EBUSY;
+    }
+
+    usb_hal_buf_set_seq(usb_dev, usb_buf);
+    usb_buf->frame_start = ktime_get();
+    rects = usb_hal_clip_rects(usb_dev, rects, &rect_cnt, clip);
+    usb_hal_gov_update(usb_dev, buf, pitch, len, rects, rect_cnt);
+    if (USH_HAL_TRANS_MODE_MANUAL_BLOCK == usb_dev->trans_mode) {
+        usb_hal_block_record(usb_dev, usb_buf, rects, rect_cnt);
+    }
+    // nothing to convert, but the staging buffers fall behind by this damage
+    usb_hal_buf_take_damage(usb_dev, usb_buf, rects, rect_cnt, &damage);
+
+    usb_buf->len = plan->out_len;
+    usb_hal_stat_inc(usb_dev, zero_copy_frames);
+    usb_hal_buf_post(usb_dev, usb_buf);
+    usb_hal_kick_thread(usb_dev);
 
     return 0;
 }
@@ -631,29 +885,46 @@ int usb_hal_add_custom_mode(struct usb_hal* hal, int width, int height, int rate
     return 0;
 }
 
-static void usb_hal_free_buf(struct usb_hal_dev* usb_dev)
+static struct usb_hal_pcpu_stat __percpu *usb_hal_stat_alloc(void)
+{
+    struct usb_hal_pcpu_stat __percpu *pcpu_stat;
+    int cpu;
+
+    pcpu_stat = alloc_percpu(struct usb_hal_pcpu_stat);
+    if (!pcpu_stat) {
+        return NULL;
+    }
+
+    for_each_possible_cpu(cpu) {
+        u64_stats_init(&per_cpu_ptr(pcpu_stat, cpu)->syncp);
+    }
+
+    return pcpu_stat;
+}
+
+static void usb_hal_free_one_buf(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
 {
-    if (!usb_dev->usb_buf.buf) {
+    if (!usb_buf->buf) {
         return;
     }
 
-	switch (usb_dev->usb_buf.type) {
+	switch (usb_buf->type) {
 		case USB_HAL_BUF_TYPE_USB:
-			usb_free_coherent(usb_dev->udev, usb_dev->usb_buf.size, usb_dev->usb_buf.buf, usb_dev->usb_buf.dma_addr);
+			usb_free_coherent(usb_dev->udev, usb_buf->size, usb_buf->buf, usb_buf->dma_addr);
 			break;
 		case USB_HAL_BUF_TYPE_VMALLOC:
-			sg_free_table(usb_dev->usb_buf.sgt);
-			kfree(usb_dev->usb_buf.sgt);
-			vfree(usb_dev->usb_buf.buf);
-			usb_dev->usb_buf.sgt = NULL;
+			kfree(usb_buf->pages);
+			vfree(usb_buf->buf);
+			usb_buf->pages = NULL;
+			usb_buf->page_cnt = 0;
 			break;
 		default:
 			break;
 	}
-	usb_dev->usb_buf.buf = NULL;
+	usb_buf->buf = NULL;
 }
 
-static int usb_dev_vmalloc_buf(struct usb_hal_dev* usb_dev)
+static int usb_dev_vmalloc_buf(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
 {
 	int ret = 0;
 	int i;
@@ -661,21 +932,14 @@ static int usb_dev_vmalloc_buf(struct usb_hal_dev* usb_dev)
 	unsigned int num_pages;
     struct usb_device* udev = usb_dev->udev;
 	
-	usb_dev->usb_buf.buf = vmalloc(USB_HAL_BUF_SIZE);
-	if (!usb_dev->usb_buf.buf) {
+	usb_buf->buf = vmalloc(USB_HAL_BUF_SIZE);
+	if (!usb_buf->buf) {
 		dev_err(&udev->dev, "vmalloc failed!\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
-	memset(usb_dev->usb_buf.buf, 0, USB_HAL_BUF_SIZE);
-
-	usb_dev->usb_buf.sgt = (struct sg_table* )kmalloc(sizeof(struct sg_table), GFP_KERNEL);
-	if (!usb_dev->usb_buf.sgt) {
-		dev_err(&udev->dev, "kmalloc sgt failed!\n");
-		ret = -ENOMEM;
-		goto fail;
-	} 
+	memset(usb_buf->buf, 0, USB_HAL_BUF_SIZE);
 
 	num_pages = (USB_HAL_BUF_SIZE >> PAGE_SHIFT);
 	pages = kmalloc(sizeof(struct page*) * num_pages, GFP_KERNEL);
@@ -686,68 +950,106 @@ static int usb_dev_vmalloc_buf(struct usb_hal_dev* usb_dev)
 	}
 
 	for (i = 0; i < num_pages; i++) {
-		pages[i] = vmalloc_to_page(usb_dev->usb_buf.buf + i * PAGE_SIZE);
+		pages[i] = vmalloc_to_page(usb_buf->buf + i * PAGE_SIZE);
 	}
 
-	ret = sg_alloc_table_from_pages(usb_dev->usb_buf.sgt, pages, num_pages, 0, USB_HAL_BUF_SIZE, 0);
-	if (!ret) {
-		goto success;
-	}
-
-	dev_err(&udev->dev, "alloc table from pages failed!\n");
+	// the transmit engine builds a small scatterlist per urb from these pages
+	usb_buf->pages = pages;
+	usb_buf->page_cnt = num_pages;
+	return 0;
 
 fail:
-	usb_dev->usb_buf.size = 0;
-	usb_dev->usb_buf.len = 0;
-	if (usb_dev->usb_buf.buf) {
-		vfree(usb_dev->usb_buf.buf);
-		usb_dev->usb_buf.buf = NULL;
+	usb_buf->size = 0;
+	usb_buf->len = 0;
+	if (usb_buf->buf) {
+		vfree(usb_buf->buf);
+		usb_buf->buf = NULL;
 	}
 
-	if (usb_dev->usb_buf.sgt) {
-		kfree(usb_dev->usb_buf.sgt);
-		usb_dev->usb_buf.sgt = NULL;
-	}
-	
-success:
-	if (pages) {
-		kfree(pages);
-	}
-	
 	return ret;
 }
 
-static int usb_dev_alloc_buf(struct usb_hal_dev* usb_dev)
+static int usb_dev_alloc_one_buf(struct usb_hal_dev* usb_dev, struct usb_hal_buffer* usb_buf)
 {
     struct usb_device* udev = usb_dev->udev;
 	int ret = 0;
-	usb_dev->usb_buf.size = USB_HAL_BUF_SIZE;
-	usb_dev->usb_buf.len = USB_HAL_BUF_DEF_LEN;
-	usb_dev->usb_buf.buf = usb_alloc_coherent(udev, USB_HAL_BUF_SIZE, GFP_KERNEL,
-                     &usb_dev->usb_buf.dma_addr);
-    if (usb_dev->usb_buf.buf) {
-		usb_dev->usb_buf.type = USB_HAL_BUF_TYPE_USB;
-		dev_info(&udev->dev, "buf type usb\n");
+	usb_buf->size = USB_HAL_BUF_SIZE;
+	usb_buf->len = USB_HAL_BUF_DEF_LEN;
+	usb_buf->buf = usb_alloc_coherent(udev, USB_HAL_BUF_SIZE, GFP_KERNEL,
+                     &usb_buf->dma_addr);
+    if (usb_buf->buf) {
+		usb_buf->type = USB_HAL_BUF_TYPE_USB;
+		dev_info(&udev->dev, "buf%d type usb\n", usb_buf->index);
         goto success;
         
     }
 
-	ret = usb_dev_vmalloc_buf(usb_dev);
+	ret = usb_dev_vmalloc_buf(usb_dev, usb_buf);
 	if (!ret) {
-		usb_dev->usb_buf.type = USB_HAL_BUF_TYPE_VMALLOC;
-		dev_info(&udev->dev, "buf type vmalloc\n");
+		usb_buf->type = USB_HAL_BUF_TYPE_VMALLOC;
+		dev_info(&udev->dev, "buf%d type vmalloc\n", usb_buf->index);
 		goto success;
 	}
 
-    usb_dev->usb_buf.buf = NULL;
-	usb_dev->usb_buf.size = 0;
-	usb_dev->usb_buf.len = 0;
+    usb_buf->buf = NULL;
+	usb_buf->size = 0;
+	usb_buf->len = 0;
 	ret = -ENOMEM;
 
 success:
 	return ret;
 }
 
+static void usb_hal_free_buf(struct usb_hal_dev* usb_dev)
+{
+    int i;
+
+    for (i = 0; i < USB_HAL_BUF_CNT; i++) {
+        usb_hal_free_one_buf(usb_dev, &usb_dev->usb_buf[i]);
+    }
+    usb_hal_free_one_buf(usb_dev, &usb_dev->block_buf);
+
+    // the sender is gone, give back the framebuffers zero-copy frames still hold
+    for (i = 0; i < USB_HAL_ZC_BUF_CNT; i++) {
+        if (usb_dev->zc_buf[i].release) {
+            usb_dev->zc_buf[i].release(usb_dev->zc_buf[i].release_ctx);
+            usb_dev->zc_buf[i].release = NULL;
+        }
+        usb_dev->zc_buf[i].state = USB_HAL_BUF_STATE_FREE;
+    }
+}
+
+static int usb_dev_alloc_buf(struct usb_hal_dev* usb_dev)
+{
+    int i, ret;
+
+    for (i = 0; i < USB_HAL_BUF_CNT; i++) {
+        usb_dev->usb_buf[i].index = i;
+        usb_dev->usb_buf[i].state = USB_HAL_BUF_STATE_FREE;
+        ret = usb_dev_alloc_one_buf(usb_dev, &usb_dev->usb_buf[i]);
+        if (ret) {
+            usb_hal_free_buf(usb_dev);
+            return ret;
+        }
+    }
+
+    for (i = 0; i < USB_HAL_ZC_BUF_CNT; i++) {
+        usb_dev->zc_buf[i].index = USB_HAL_BUF_CNT + 1 + i;
+        usb_dev->zc_buf[i].type = USB_HAL_BUF_TYPE_PAGES;
+        usb_dev->zc_buf[i].state = USB_HAL_BUF_STATE_FREE;
+    }
+
+    if (usb_dev->block_mode) {
+        usb_dev->block_buf.index = USB_HAL_BUF_CNT;
+        if (usb_dev_alloc_one_buf(usb_dev, &usb_dev->block_buf)) {
+            dev_warn(&usb_dev->udev->dev, "alloc block buf failed, block mode disabled\n");
+            usb_dev->block_mode = 0;
+        }
+    }
+
+    return 0;
+}
+
 static struct device * usb_hal_intf_get_dma_device(struct usb_interface *intf)
 {
 #if KERNEL_VERSION(4, 12, 0) <= LINUX_VERSION_CODE
@@ -816,6 +1118,8 @@ struct usb_hal* usb_hal_init(struct usb_interface *interface, const struct usb_d
         return NULL;
     }
 
+    usb_hal_pack_init();
+
     usb_hal = kzalloc(sizeof(*usb_hal), GFP_KERNEL);
     if (!usb_hal) {
         dev_err(&udev->dev, "kzalloc usb_hal failed!\n");
@@ -828,6 +1132,13 @@ struct usb_hal* usb_hal_init(struct usb_interface *interface, const struct usb_d
         goto err;
     }
 
+    usb_dev->pcpu_stat = usb_hal_stat_alloc();
+    if (!usb_dev->pcpu_stat) {
+        dev_err(&udev->dev, "alloc stat failed!\n");
+        goto err;
+    }
+    mutex_init(&usb_dev->stat_lock);
+
     usb_dev->hal_dev = msdisp_hal_find_dev(id, udev);
     if (!usb_dev->hal_dev) {
         dev_err(&udev->dev, "Can't find hal dev! vid=0x%x pid=0x%x\n", id->idVendor, id->idProduct);
@@ -842,7 +1153,9 @@ struct usb_hal* usb_hal_init(struct usb_interface *interface, const struct usb_d
     usb_dev->fifo = fifo;
     usb_dev->index = index;
     usb_dev->vpack_out = USB_HAL_COLOR_FORMAT_YUV422;
+    usb_dev->wire_format = min_t(u8, usb_hal_wire_format, USB_HAL_WIRE_FORMAT_CNT - 1);
     usb_dev->trans_mode = USH_HAL_TRANS_MODE_FRAME;
+    usb_dev->block_mode = (usb_hal_trans_block && usb_dev->hal_dev->funcs->fill_block_header);
     usb_dev->state = USB_HAL_DEV_STATE_UNKNOWN;
 
 
@@ -868,15 +1181,38 @@ struct usb_hal* usb_hal_init(struct usb_interface *interface, const struct usb_d
     usb_dev->state = USB_HAL_DEV_STATE_UNKNOWN;
 	usb_dev->bus_status = MS9132_USB_BUS_STATUS_NORMAL;
 
-    mutex_init(&usb_dev->usb_buf.mutex);
-    sema_init(&usb_dev->sema, 1);
+    spin_lock_init(&usb_dev->buf_lock);
+    spin_lock_init(&usb_dev->event_lock);
+    usb_hal_bw_init(usb_dev);
+    usb_hal_gov_init(usb_dev);
+    usb_hal_init_thread(usb_dev);
+
+    usb_dev->xfer = usb_hal_xfer_create(usb_dev, usb_dev->hal_dev->funcs->get_transfer_bulk_ep());
+    if (!usb_dev->xfer) {
+        dev_err(&udev->dev, "create xfer failed!\n");
+        usb_hal_free_buf(usb_dev);
+        goto err;
+    }
     
+    // conversion falls back to the calling cpu only
+    usb_dev->stripe = usb_hal_stripe_create(usb_dev, index);
+    if (!usb_dev->stripe) {
+        dev_warn(&udev->dev, "create conversion workqueue failed!\n");
+    }
+
     //usb_set_intfdata(interface, usb_hal);
 
     memset(name, 0, 32);
 	snprintf(name, 32, "msdisp%d_send", index);
-	usb_dev->thread_run_flag = 1;
 	usb_dev->thread = kthread_run(usb_hal_state_machine_entry, usb_hal, name);
+	if (IS_ERR(usb_dev->thread)) {
+		dev_err(&udev->dev, "create send thread failed! ret=%ld\n", PTR_ERR(usb_dev->thread));
+		usb_dev->thread = NULL;
+		usb_hal_stripe_destroy(usb_dev->stripe);
+		usb_hal_xfer_destroy(usb_dev->xfer);
+		usb_hal_free_buf(usb_dev);
+		goto err;
+	}
 
 	usb_hal_sysfs_init(interface);
     goto out;
@@ -887,6 +1223,7 @@ err:
     }
 
     if (usb_dev) {
+        free_percpu(usb_dev->pcpu_stat);
         kfree(usb_dev);
         usb_dev = NULL;
     }
@@ -907,18 +1244,19 @@ void usb_hal_destroy(struct usb_hal* hal)
     struct usb_interface *interface = hal->interface;
     int index = usb_dev->index;
 
-    if (usb_dev->thread) {
-        usb_hal_stop_thread(usb_dev);
-        msleep(300);
-        usb_dev->thread = NULL;
-    }
+    usb_hal_stop_thread(usb_dev);
 
 	//sysfs_remove_link(&usb_dev->drm->dev->kobj, "usb_dev");
 	usb_hal_sysfs_exit(interface);
+    usb_hal_debugfs_exit(usb_dev);
+    usb_hal_gov_exit(usb_dev);
+    usb_hal_stripe_destroy(usb_dev->stripe);
+    usb_hal_xfer_destroy(usb_dev->xfer);
     usb_hal_free_buf(usb_dev);
 	if (usb_dev->dma_dev) {
 		put_device(usb_dev->dma_dev);
 	}
+    free_percpu(usb_dev->pcpu_stat);
     kfree(usb_dev);
     kfree(hal);
 	
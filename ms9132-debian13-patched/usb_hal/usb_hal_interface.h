@@ -23,6 +23,19 @@ struct usb_interface;
 struct usb_device_id;
 struct device;
 struct kfifo;
+struct page;
+struct dentry;
+
+/* damage clips passed to usb_hal_update_frame, more than this is sent as a full frame */
+#define USB_HAL_MAX_RECTS       8
+
+/* x2 and y2 are exclusive */
+struct usb_hal_rect {
+    u16 x1;
+    u16 y1;
+    u16 x2;
+    u16 y2;
+};
 
 struct usb_hal_video_mode {
     u16 width;
@@ -52,10 +65,17 @@ int usb_hal_get_vic(struct usb_hal* hal, u16 width, u16 height, u8 rate, u8* vic
 int usb_hal_enable(struct usb_hal* hal, struct usb_hal_video_mode* mode, u32 fourcc);
 int usb_hal_disable(struct usb_hal* hal);
 int usb_hal_is_disabled(struct usb_hal* hal);
-int usb_hal_update_frame(struct usb_hal* hal, u8* buf, int pitch, u32 len, u32 fourcc, int try_lock);
+int usb_hal_update_frame(struct usb_hal* hal, u8* buf, int pitch, u32 len, u32 fourcc, u8* ubuf, u8* vbuf, int uv_pitch,
+    const struct usb_hal_rect* rects, int rect_cnt);
+int usb_hal_update_frame_pages(struct usb_hal* hal, u8* buf, struct page** pages, int pitch, u32 len, u32 fourcc,
+    const struct usb_hal_rect* rects, int rect_cnt, void (*release)(void* ctx), void* ctx);
+u32 usb_hal_get_frame_seq(struct usb_hal* hal);
+void usb_hal_set_frame_done(struct usb_hal* hal, void (*done)(void* ctx, u32 seq), void* ctx);
 int usb_hal_is_support_fourcc(u32 fourcc);
 unsigned int usb_hal_get_bpp_by_fourcc(u32 fourcc);
 int usb_hal_add_custom_mode(struct usb_hal* hal, int width, int height, int rate, unsigned char vic);
+/* per stage histograms in a "hal" dir under parent, removed by usb_hal_destroy */
+void usb_hal_debugfs_init(struct usb_hal* hal, struct dentry* parent);
 
 
 #endif
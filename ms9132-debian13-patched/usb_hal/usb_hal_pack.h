@@ -0,0 +1,42 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_pack.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_PACK_H__
+#define __USB_HAL_PACK_H__
+
+#include <linux/types.h>
+
+/* pick the fastest packer the cpu supports, called at probe */
+void usb_hal_pack_init(void);
+const char* usb_hal_pack_name(void);
+
+/* 32bpp rows to 24bpp, is_rgb keeps the byte order of XRGB/ARGB, otherwise swaps red and blue */
+void usb_hal_pack_rgb32(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb);
+/* 24bpp rows with red and blue swapped */
+void usb_hal_pack_bgr24(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height);
+
+/* 32bpp rows to BT.709 limited range UYVY, width even unless the row ends the frame */
+void usb_hal_pack_yuv422(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 width, u32 height, int is_rgb);
+/*
+ * Rows y..y+rows of a frame with vertically halved chroma (NV12, YUV420) to UYVY.
+ * Luma rows are ypitch bytes apart, chroma rows stride bytes apart, u and v
+ * samples step bytes apart within one.
+ */
+void usb_hal_pack_yuv420(u8* dst, const u8* ybuf, u32 ypitch, const u8* ubuf, const u8* vbuf, u32 stride, u32 step,
+	u32 width, u32 height, u32 y, u32 rows);
+/* 32bpp rows to little endian RGB565, x and y place the rows on the dither pattern */
+void usb_hal_pack_rgb565(u8* dst, const u8* src, u32 pitch, u32 dst_pitch, u32 x, u32 y, u32 width, u32 height, int is_rgb,
+	int dither);
+
+#endif
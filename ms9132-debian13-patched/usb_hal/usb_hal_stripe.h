@@ -0,0 +1,43 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_stripe.h -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#ifndef __USB_HAL_STRIPE_H__
+#define __USB_HAL_STRIPE_H__
+
+#include <linux/types.h>
+
+/* cpus converting one frame at most */
+#define USB_HAL_STRIPE_MAX_WORKERS              8
+/* output bytes below which another cpu isn't worth waking */
+#define USB_HAL_STRIPE_MIN_BYTES                (256 * 1024)
+/* stripes per frame at most, more get merged */
+#define USB_HAL_STRIPE_MAX_CNT                  256
+
+struct usb_hal_dev;
+struct usb_hal_stripe;
+
+struct usb_hal_stripe_ops {
+	/* convert rows y..y+rows, runs on any of the workers */
+	void (*convert)(void* ctx, int y, int rows);
+	/* optional, rows 0..rows are converted, called in order */
+	void (*ready)(void* ctx, int rows);
+};
+
+struct usb_hal_stripe* usb_hal_stripe_create(struct usb_hal_dev* usb_dev, int index);
+void usb_hal_stripe_destroy(struct usb_hal_stripe* stripe);
+int usb_hal_stripe_workers(struct usb_hal_stripe* stripe, u32 bytes);
+u64 usb_hal_stripe_run(struct usb_hal_stripe* stripe, int workers, int height, int rows, const struct usb_hal_stripe_ops* ops,
+	void* ctx);
+
+#endif
@@ -17,96 +17,170 @@
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/usb.h>
+#include <linux/math64.h>
 
 #include "hal_adaptor.h"
 #include "usb_hal_dev.h"
 #include "usb_hal_interface.h"
-//#include "msdisp_common_util.h"
+#include "usb_hal_buf.h"
+#include "usb_hal_pack.h"
+#include "usb_hal_bw.h"
+#include "usb_hal_xfer.h"
+#include "usb_hal_gov.h"
+#include "msdisp_common_util.h"
 
 
 static ssize_t usb_hal_buf_show(struct device* dev, struct device_attribute* attr, char* buf)
 {
     struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
     struct usb_hal_dev* usb_dev = usb_hal->private;
-	struct usb_hal_buffer* usb_buf = &usb_dev->usb_buf;
-	char tmp[256];
+	struct usb_hal_buffer* usb_buf;
+	int i, len = 0;
 
-	*buf = 0;
-	sprintf(tmp, "%s\n", dev->kobj.name);
-	strcat(buf, tmp);
-	sprintf(tmp, "buf size:%d\n", usb_buf->size);
-	strcat(buf, tmp);
-	sprintf(tmp, "buf len:%d\n", usb_buf->len);
-	strcat(buf, tmp);
-	sprintf(tmp, "buf type:%d\n", usb_buf->type);
-	strcat(buf, tmp);
+	len += sysfs_emit_at(buf, len, "name=%s\n", dev->kobj.name);
+	for (i = 0; i < USB_HAL_BUF_CNT; i++) {
+		usb_buf = &usb_dev->usb_buf[i];
+		len += sysfs_emit_at(buf, len, "buf%d size=%d len=%d type=%d state=%s\n", i, usb_buf->size, usb_buf->len, usb_buf->type,
+			usb_hal_buf_state_name(usb_buf->state));
+	}
+	for (i = 0; i < USB_HAL_ZC_BUF_CNT; i++) {
+		usb_buf = &usb_dev->zc_buf[i];
+		len += sysfs_emit_at(buf, len, "zc%d len=%d state=%s\n", i, usb_buf->len, usb_hal_buf_state_name(usb_buf->state));
+	}
+	len += sysfs_emit_at(buf, len, "pack=%s\n", usb_hal_pack_name());
 
-	return strlen(buf);
+	return len;
 }
 
 static ssize_t usb_hal_frame_show(struct device* dev, struct device_attribute* attr, char* buf)
 {
     struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
     struct usb_hal_dev* usb_dev = usb_hal->private;
-    struct usb_hal_dev_frame_stat* stat = &usb_dev->stat;
-	char tmp[256];
-
-	*buf = 0;
-
-	sprintf(tmp, "send total:%lld\n", stat->send_total);
-	strcat(buf, tmp);
-	sprintf(tmp, "send success:%lld\n", stat->send_success);
-	strcat(buf, tmp);
-	sprintf(tmp, "update event count:%lld\n", stat->update_event);
-	strcat(buf, tmp);
-	sprintf(tmp, "period send count:%lld\n", stat->period_send);
-	strcat(buf, tmp);
-	sprintf(tmp, "state error count:%lld\n", stat->state_error);
-	strcat(buf, tmp);
-	sprintf(tmp, "try lock fail:%lld\n", stat->try_lock_fail);
-	strcat(buf, tmp);
-	
-	return strlen(buf);
+    struct usb_hal_dev_frame_gauge* gauge = &usb_dev->gauge;
+    struct usb_hal_dev_frame_stat stat;
+    const u64* base = (const u64*)&usb_dev->stat_base;
+    u64* cnt = (u64*)&stat;
+	int i, len = 0;
+
+	msdisp_common_stat_read(usb_dev->pcpu_stat, &stat);
+	mutex_lock(&usb_dev->stat_lock);
+	for (i = 0; i < sizeof(stat) / sizeof(u64); i++) {
+		cnt[i] -= base[i];
+	}
+	mutex_unlock(&usb_dev->stat_lock);
+
+	len += sysfs_emit_at(buf, len, "send_total=%llu\n", stat.send_total);
+	len += sysfs_emit_at(buf, len, "send_success=%llu\n", stat.send_success);
+	len += sysfs_emit_at(buf, len, "update_event=%llu\n", stat.update_event);
+	len += sysfs_emit_at(buf, len, "period_send=%llu\n", stat.period_send);
+	len += sysfs_emit_at(buf, len, "state_error=%llu\n", stat.state_error);
+	len += sysfs_emit_at(buf, len, "no_free_buf=%llu\n", stat.no_free_buf);
+	len += sysfs_emit_at(buf, len, "urb_submit=%llu\n", stat.urb_submit);
+	len += sysfs_emit_at(buf, len, "urb_complete=%llu\n", stat.urb_complete);
+	len += sysfs_emit_at(buf, len, "urb_error=%llu\n", stat.urb_error);
+	len += sysfs_emit_at(buf, len, "urb_timeout=%llu\n", stat.urb_timeout);
+	len += sysfs_emit_at(buf, len, "trigger_submit=%llu\n", stat.trigger_submit);
+	len += sysfs_emit_at(buf, len, "trigger_error=%llu\n", stat.trigger_error);
+	len += sysfs_emit_at(buf, len, "urb_in_flight=%u\n", gauge->in_flight);
+	len += sysfs_emit_at(buf, len, "urb_in_flight_max=%u\n", gauge->in_flight_max);
+	len += sysfs_emit_at(buf, len, "xfer_bytes=%llu\n", stat.xfer_bytes);
+	len += sysfs_emit_at(buf, len, "xfer_time_us=%llu\n", stat.xfer_time_us);
+	len += sysfs_emit_at(buf, len, "xfer_last_mbps=%u\n", gauge->last_mbps);
+	len += sysfs_emit_at(buf, len, "xfer_avg_mbps=%llu\n", stat.xfer_time_us ? div64_u64(stat.xfer_bytes, stat.xfer_time_us) : 0);
+	len += sysfs_emit_at(buf, len, "stream_frames=%llu\n", stat.stream_frames);
+	len += sysfs_emit_at(buf, len, "stripe_frames=%llu\n", stat.stripe_frames);
+	len += sysfs_emit_at(buf, len, "ready_replaced=%llu\n", stat.ready_replaced);
+	len += sysfs_emit_at(buf, len, "event_wait=%llu\n", stat.event_wait);
+	len += sysfs_emit_at(buf, len, "event_lost=%llu\n", stat.event_lost);
+	len += sysfs_emit_at(buf, len, "frame_latency_us=%u\n", gauge->frame_latency_us);
+	len += sysfs_emit_at(buf, len, "damage_full=%llu\n", stat.damage_full);
+	len += sysfs_emit_at(buf, len, "damage_pixels=%llu\n", stat.damage_pixels);
+	len += sysfs_emit_at(buf, len, "trans_mode=%d\n", usb_dev->trans_mode);
+	len += sysfs_emit_at(buf, len, "block_frames=%llu\n", stat.block_frames);
+	len += sysfs_emit_at(buf, len, "block_rects=%llu\n", stat.block_rects);
+	len += sysfs_emit_at(buf, len, "block_bytes=%llu\n", stat.block_bytes);
+	len += sysfs_emit_at(buf, len, "zero_copy_frames=%llu\n", stat.zero_copy_frames);
+	len += sysfs_emit_at(buf, len, "shape_wait=%llu\n", stat.shape_wait);
+	len += sysfs_emit_at(buf, len, "gov_held=%llu\n", stat.gov_held);
+	len += sysfs_emit_at(buf, len, "gov_unchanged=%llu\n", stat.gov_unchanged);
+
+	return len;
+}
+
+/* any write starts the counters over from zero */
+static ssize_t usb_hal_frame_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+    struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+    struct usb_hal_dev* usb_dev = usb_hal->private;
+    struct usb_hal_dev_frame_stat stat;
+
+	msdisp_common_stat_read(usb_dev->pcpu_stat, &stat);
+	mutex_lock(&usb_dev->stat_lock);
+	usb_dev->stat_base = stat;
+	usb_dev->gauge.in_flight_max = usb_dev->gauge.in_flight;
+	mutex_unlock(&usb_dev->stat_lock);
+
+	return count;
+}
+
+/* per window and kind of traffic: bytes/s, transfers/s, and what the bytes are of the link */
+static ssize_t usb_hal_bandwidth_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	static const int windows[] = { 1, 10, 60 };
+	static const char* const kinds[USB_HAL_BW_KIND_CNT] = {
+		[USB_HAL_BW_DATA] = "data",
+		[USB_HAL_BW_ZLP] = "zlp",
+		[USB_HAL_BW_CTRL] = "ctrl",
+	};
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+	u64 bytes[USB_HAL_BW_KIND_CNT], cnt[USB_HAL_BW_KIND_CNT];
+	u32 util;
+	int k, w, len = 0;
+
+	len += sysfs_emit_at(buf, len, "speed=%s\n", usb_speed_string(usb_dev->udev->speed));
+	len += sysfs_emit_at(buf, len, "capacity_bps=%llu\n", usb_dev->bw_capacity);
+	len += sysfs_emit_at(buf, len, "state=%s\n", usb_dev->bw_high ? "high" : "normal");
+	for (w = 0; w < ARRAY_SIZE(windows); w++) {
+		usb_hal_bw_sum(usb_dev, windows[w], bytes, cnt);
+		for (k = 0; k < USB_HAL_BW_KIND_CNT; k++) {
+			len += sysfs_emit_at(buf, len, "%s_bps_%ds=%llu\n", kinds[k], windows[w], div_u64(bytes[k], windows[w]));
+			len += sysfs_emit_at(buf, len, "%s_cnt_%ds=%llu\n", kinds[k], windows[w], div_u64(cnt[k], windows[w]));
+		}
+		util = usb_hal_bw_util(usb_dev, bytes[USB_HAL_BW_DATA] + bytes[USB_HAL_BW_CTRL], windows[w]);
+		len += sysfs_emit_at(buf, len, "util_%ds=%u.%u\n", windows[w], util / 10, util % 10);
+	}
+
+	return len;
 }
 
 static ssize_t usb_hal_dev_show(struct device* dev, struct device_attribute* attr, char* buf)
 {
     struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
 	struct usb_hal_dev* usb_dev = usb_hal->private;
-	char tmp[96];
-
-	*buf = 0;
-
-	sprintf(tmp, "chip id:0x%x\n", usb_hal->chip_id);
-	strcat(buf, tmp);
-	sprintf(tmp, "video port:0x%x\n", usb_hal->port_type);
-	strcat(buf, tmp);
-	sprintf(tmp, "sdram type:0x%x\n", usb_hal->sdram_type);
-	strcat(buf, tmp);
-	sprintf(tmp, "dev state:0x%x\n", usb_dev->state);
-	strcat(buf, tmp);
-	
-	return strlen(buf);
+	int len = 0;
+
+	len += sysfs_emit_at(buf, len, "chip_id=0x%x\n", usb_hal->chip_id);
+	len += sysfs_emit_at(buf, len, "video_port=0x%x\n", usb_hal->port_type);
+	len += sysfs_emit_at(buf, len, "sdram_type=0x%x\n", usb_hal->sdram_type);
+	len += sysfs_emit_at(buf, len, "dev_state=0x%x\n", usb_dev->state);
+
+	return len;
 }
 
 static ssize_t usb_hal_custom_mode_show(struct device* dev, struct device_attribute* attr, char* buf)
 {
 	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
 	struct usb_hal_dev* usb_dev = usb_hal->private;
-	char tmp[64];
-	int i;
-
-	*buf = 0;
+	int i, len = 0;
 
-	sprintf(tmp, "custom mode cnt:%d\n", usb_dev->custom_mode_cnt);
-	strcat(buf, tmp);
+	len += sysfs_emit_at(buf, len, "custom_mode_cnt=%d\n", usb_dev->custom_mode_cnt);
 	for (i = 0; i < usb_dev->custom_mode_cnt; i++) {
-		sprintf(tmp, "width:%d height:%d rate:%d vid:%d\n", usb_dev->custom_mode[i].width, usb_dev->custom_mode[i].height,\
-			 usb_dev->custom_mode[i].rate, usb_dev->custom_mode[i].vic);
-		strcat(buf, tmp);
+		len += sysfs_emit_at(buf, len, "mode%d width=%d height=%d rate=%d vic=%d\n", i, usb_dev->custom_mode[i].width,
+			usb_dev->custom_mode[i].height, usb_dev->custom_mode[i].rate, usb_dev->custom_mode[i].vic);
 	}
 
-	return strlen(buf);
+	return len;
 }
 
 static ssize_t usb_hal_write_xdata_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
@@ -155,22 +229,168 @@ static ssize_t usb_hal_read_xdata_store(struct device* dev, struct device_attrib
 	return count;
 }
 
+static const char* const usb_hal_wire_format_names[USB_HAL_WIRE_FORMAT_CNT] = {
+	[USB_HAL_WIRE_FORMAT_RGB888] = "rgb888",
+	[USB_HAL_WIRE_FORMAT_RGB565] = "rgb565",
+	[USB_HAL_WIRE_FORMAT_YUV422] = "yuv422",
+};
+
+static ssize_t usb_hal_wire_format_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+
+	return sprintf(buf, "%s\n", usb_hal_wire_format_names[usb_dev->wire_format]);
+}
+
+/* takes effect at the next mode set */
+static ssize_t usb_hal_wire_format_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+	int ret;
+
+	ret = sysfs_match_string(usb_hal_wire_format_names, buf);
+	if (ret < 0)
+		return ret;
+
+	usb_dev->wire_format = ret;
+	dev_info(dev, "wire format:%s\n", usb_hal_wire_format_names[ret]);
+	return count;
+}
+
+static ssize_t usb_hal_shape_rate_kb_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+
+	return sprintf(buf, "%u\n", usb_dev->xfer->shape_rate / 1024);
+}
+
+/* 0 lifts the limit, applies from the next urb on */
+static ssize_t usb_hal_shape_rate_kb_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+	u32 rate;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &rate);
+	if (ret < 0)
+		return ret;
+	if (rate > U32_MAX / 1024)
+		return -EINVAL;
+
+	usb_hal_xfer_set_shaper(usb_dev->xfer, rate * 1024, usb_dev->xfer->shape_burst);
+	dev_info(dev, "shape rate:%u burst:%u\n", usb_dev->xfer->shape_rate, usb_dev->xfer->shape_burst);
+	return count;
+}
+
+static ssize_t usb_hal_shape_burst_kb_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+
+	return sprintf(buf, "%u\n", usb_dev->xfer->shape_burst / 1024);
+}
+
+/* cut to whole packets, between a page and a whole urb */
+static ssize_t usb_hal_shape_burst_kb_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_dev* usb_dev = usb_hal->private;
+	u32 burst;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &burst);
+	if (ret < 0)
+		return ret;
+	if (burst > U32_MAX / 1024)
+		return -EINVAL;
+
+	usb_hal_xfer_set_shaper(usb_dev->xfer, usb_dev->xfer->shape_rate, burst * 1024);
+	dev_info(dev, "shape rate:%u burst:%u\n", usb_dev->xfer->shape_rate, usb_dev->xfer->shape_burst);
+	return count;
+}
+
+static ssize_t usb_hal_governor_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_gov* gov = &((struct usb_hal_dev*)usb_hal->private)->gov;
+	int len = 0;
+
+	len += sysfs_emit_at(buf, len, "enable=%u\n", gov->enable);
+	len += sysfs_emit_at(buf, len, "state=%s\n", usb_hal_gov_state_name(READ_ONCE(gov->state)));
+	len += sysfs_emit_at(buf, len, "load=%u.%u\n", gov->load / 10, gov->load % 10);
+	len += sysfs_emit_at(buf, len, "idle_fps=%u\n", gov->idle_fps);
+	len += sysfs_emit_at(buf, len, "static_fps=%u\n", gov->static_fps);
+	len += sysfs_emit_at(buf, len, "active_pct=%u\n", gov->active_pct);
+	len += sysfs_emit_at(buf, len, "idle_pct=%u\n", gov->idle_pct);
+	len += sysfs_emit_at(buf, len, "hold_ms=%u\n", gov->hold_ms);
+	len += sysfs_emit_at(buf, len, "static_ms=%u\n", gov->static_ms);
+
+	return len;
+}
+
+/* one key=value of what governor_show prints, state and load are read only */
+static ssize_t usb_hal_governor_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	struct usb_hal* usb_hal = usb_intf_device_to_hal_func(dev);
+	struct usb_hal_gov* gov = &((struct usb_hal_dev*)usb_hal->private)->gov;
+	char key[16];
+	u32 val;
+
+	if (sscanf(buf, "%15[^=]=%u", key, &val) != 2)
+		return -EINVAL;
+
+	if (!strcmp(key, "enable")) {
+		gov->enable = !!val;
+	} else if (!strcmp(key, "idle_fps") && val) {
+		gov->idle_fps = val;
+	} else if (!strcmp(key, "static_fps") && val) {
+		gov->static_fps = val;
+	} else if (!strcmp(key, "active_pct") && (val >= gov->idle_pct) && (val <= 100)) {
+		gov->active_pct = val;
+	} else if (!strcmp(key, "idle_pct") && (val <= gov->active_pct)) {
+		gov->idle_pct = val;
+	} else if (!strcmp(key, "hold_ms")) {
+		gov->hold_ms = val;
+	} else if (!strcmp(key, "static_ms")) {
+		gov->static_ms = val;
+	} else {
+		return -EINVAL;
+	}
+
+	dev_info(dev, "governor %s=%u\n", key, val);
+	return count;
+}
+
 
 static DEVICE_ATTR(buf, 0444, usb_hal_buf_show, NULL);
-static DEVICE_ATTR(frame, 0444, usb_hal_frame_show, NULL);
+static DEVICE_ATTR(frame, 0644, usb_hal_frame_show, usb_hal_frame_store);
+static DEVICE_ATTR(bandwidth, 0444, usb_hal_bandwidth_show, NULL);
 static DEVICE_ATTR(hal_dev, 0444, usb_hal_dev_show, NULL);
 static DEVICE_ATTR(custom_mode, 0444, usb_hal_custom_mode_show, NULL);
 static DEVICE_ATTR(write_xdata, 0220, NULL, usb_hal_write_xdata_store);
 static DEVICE_ATTR(read_xdata, 0220, NULL, usb_hal_read_xdata_store);
+static DEVICE_ATTR(wire_format, 0644, usb_hal_wire_format_show, usb_hal_wire_format_store);
+static DEVICE_ATTR(shape_rate_kb, 0644, usb_hal_shape_rate_kb_show, usb_hal_shape_rate_kb_store);
+static DEVICE_ATTR(shape_burst_kb, 0644, usb_hal_shape_burst_kb_show, usb_hal_shape_burst_kb_store);
+static DEVICE_ATTR(governor, 0644, usb_hal_governor_show, usb_hal_governor_store);
 
 
 static struct attribute* usb_hal_attribute[] = {
 	&dev_attr_buf.attr,
 	&dev_attr_frame.attr,
+	&dev_attr_bandwidth.attr,
 	&dev_attr_hal_dev.attr,
 	&dev_attr_custom_mode.attr,
 	&dev_attr_write_xdata.attr,
 	&dev_attr_read_xdata.attr,
+	&dev_attr_wire_format.attr,
+	&dev_attr_shape_rate_kb.attr,
+	&dev_attr_shape_burst_kb.attr,
+	&dev_attr_governor.attr,
 	NULL
 };
 
@@ -1,12 +1,18 @@
 #ifndef __USB_HAL_THREAD_H__
 #define __USB_HAL_THREAD_H__
 
+/* idle keepalive period, ms */
 #define USB_HAL_BUF_TIMEOUT	2000
-#define USB_HAL_BUF_WAIT_TIME  20
+
+/* usb_hal_dev thread_flags bits */
+#define USB_HAL_THREAD_KICK     0
+#define USB_HAL_THREAD_REFRESH  1
 
 struct usb_hal_dev;
 
 int usb_hal_state_machine_entry(void* data);
+void usb_hal_init_thread(struct usb_hal_dev* usb_dev);
+void usb_hal_kick_thread(struct usb_hal_dev* usb_dev);
 void usb_hal_stop_thread(struct usb_hal_dev *usb_dev);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,524 @@
+/* Copyright (C) 2023 MacroSilicon Technology Co., Ltd.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * usb_hal_xfer.c -- Drm driver for MacroSilicon chip 913x and 912x
+ */
+
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/scatterlist.h>
+#include <linux/usb.h>
+
+#include "usb_hal_dev.h"
+#include "usb_hal_xfer.h"
+#include "usb_hal_bw.h"
+#include "usb_hal_trace.h"
+#include "hal_adaptor.h"
+
+/*
+ * A frame is cut into chunk_size pieces and sent with up to USB_HAL_XFER_URB_CNT
+ * urbs queued on the bulk endpoint. Every completion hands its urb the next chunk,
+ * so the host controller always has work queued until the whole frame is out.
+ * chunk_size is a multiple of wMaxPacketSize, so only the last urb of a frame may
+ * end with a short packet and the device sees the same stream as with one big urb.
+ *
+ * The producer may start a frame before it is fully written (streaming). Urbs
+ * then only cover bytes below the ready watermark, cut down to whole packets, and
+ * usb_hal_xfer_publish() pushes the watermark forward as stripes are converted.
+ *
+ * The last urb carries URB_ZERO_PACKET, and once it completes the trigger_frame
+ * control urb is submitted from the completion, so the end of a frame costs no
+ * round trip through the thread. The frame is done when the trigger completes.
+ *
+ * Optionally a token bucket paces the urbs: each one waits until shape_burst worth
+ * of its bytes have accrued at shape_rate, and shape_timer picks the frame up again
+ * once they have. This leaves gaps in which the host controller serves the other
+ * endpoints on it, see XHCI_CONTENTION.md, at the cost of frames taking longer.
+ */
+
+static unsigned int usb_hal_shape_rate_kb = 0;
+module_param_named(shape_rate_kb, usb_hal_shape_rate_kb, uint, 0644);
+MODULE_PARM_DESC(shape_rate_kb, "Bulk rate limit in KB/s for new devices, 0 to disable (default: 0)");
+
+static unsigned short usb_hal_shape_burst_kb = 64;
+module_param_named(shape_burst_kb, usb_hal_shape_burst_kb, ushort, 0644);
+MODULE_PARM_DESC(shape_burst_kb, "Largest burst in KB sent at once while the rate is limited (default: 64)");
+
+static void usb_hal_xfer_complete(struct urb* urb);
+static void usb_hal_xfer_trigger_complete(struct urb* urb);
+
+static int usb_hal_xfer_fill_sg(struct usb_hal_xfer_urb* xurb, struct usb_hal_buffer* buf, u32 offset, u32 len)
+{
+	u32 page = (offset >> PAGE_SHIFT);
+	u32 page_off = (offset & ~PAGE_MASK);
+	u32 seg;
+	int i, cnt;
+
+	cnt = DIV_ROUND_UP(page_off + len, PAGE_SIZE);
+	sg_init_table(xurb->sg, cnt);
+	for (i = 0; i < cnt; i++) {
+		seg = min_t(u32, len, PAGE_SIZE - page_off);
+		sg_set_page(&xurb->sg[i], buf->pages[page + i], seg, page_off);
+		len -= seg;
+		page_off = 0;
+	}
+
+	return cnt;
+}
+
+/* bytes the next urb may carry, 0 if it has to wait for the producer */
+static u32 usb_hal_xfer_next_len_locked(struct usb_hal_xfer* xfer)
+{
+	u32 chunk = (xfer->shape_rate ? xfer->shape_burst : xfer->chunk_size);
+	u32 len = min_t(u32, xfer->len - xfer->offset, chunk);
+
+	if (xfer->offset + len > xfer->ready) {
+		len = (xfer->ready > xfer->offset) ? (xfer->ready - xfer->offset) : 0;
+		// not the last urb of the frame, must end on a packet boundary
+		if (xfer->maxp) {
+			len -= (len % xfer->maxp);
+		}
+	}
+
+	return len;
+}
+
+/* called with xfer->lock held */
+static int usb_hal_xfer_submit_locked(struct usb_hal_xfer* xfer, struct usb_hal_xfer_urb* xurb, u32 len, gfp_t mem_flags)
+{
+	struct usb_hal_dev* usb_dev = xfer->usb_dev;
+	struct usb_hal_buffer* buf = xfer->buf;
+	struct usb_hal_dev_frame_gauge* gauge = &usb_dev->gauge;
+	struct urb* urb = xurb->urb;
+	u32 offset = xfer->offset;
+	int ret;
+
+	usb_fill_bulk_urb(urb, usb_dev->udev, xfer->pipe, buf->buf + offset, len, usb_hal_xfer_complete, xurb);
+	urb->transfer_flags = 0;
+	// the frame must end with a short packet, a zero length one if needed
+	if (offset + len >= xfer->len) {
+		urb->transfer_flags |= URB_ZERO_PACKET;
+	}
+	if ((USB_HAL_BUF_TYPE_USB == buf->type) || (USB_HAL_BUF_TYPE_DMA == buf->type)) {
+		urb->transfer_dma = buf->dma_addr + offset;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	} else if ((USB_HAL_BUF_TYPE_VMALLOC == buf->type) || (USB_HAL_BUF_TYPE_PAGES == buf->type)) {
+		urb->transfer_buffer = NULL;
+		urb->num_sgs = usb_hal_xfer_fill_sg(xurb, buf, offset, len);
+		urb->sg = xurb->sg;
+	}
+
+	usb_anchor_urb(urb, &xfer->anchor);
+	ret = usb_submit_urb(urb, mem_flags);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		if (!xfer->status) {
+			xfer->status = ret;
+		}
+		usb_hal_stat_inc(usb_dev, urb_error);
+		return ret;
+	}
+
+	trace_usb_hal_urb_submit(usb_dev->index, buf->frame_seq, offset, len);
+	xurb->busy = 1;
+	xfer->offset += len;
+	xfer->in_flight++;
+	usb_hal_stat_inc(usb_dev, urb_submit);
+	gauge->in_flight = xfer->in_flight;
+	if (gauge->in_flight > gauge->in_flight_max) {
+		gauge->in_flight_max = gauge->in_flight;
+	}
+
+	return 0;
+}
+
+/* show the frame just sent, lock held; 0 when the trigger urb is on its way */
+static int usb_hal_xfer_trigger_locked(struct usb_hal_xfer* xfer)
+{
+	struct usb_hal_dev* usb_dev = xfer->usb_dev;
+	unsigned char index = ((0 == usb_dev->frame_index) ? 1 : 0);
+	int ret;
+
+	ret = usb_dev->hal_dev->funcs->fill_trigger_urb(usb_dev->udev, xfer->trigger_urb, xfer->trigger_setup, xfer->trigger_buf,
+		USB_HAL_XFER_TRIGGER_LEN, index, USB_HAL_XFER_TRIGGER_DELAY, usb_hal_xfer_trigger_complete, xfer);
+	if (!ret) {
+		usb_anchor_urb(xfer->trigger_urb, &xfer->anchor);
+		ret = usb_submit_urb(xfer->trigger_urb, GFP_ATOMIC);
+		if (ret) {
+			usb_unanchor_urb(xfer->trigger_urb);
+		}
+	}
+
+	if (ret) {
+		usb_hal_stat_inc(usb_dev, trigger_error);
+		xfer->status = ret;
+		return ret;
+	}
+
+	trace_usb_hal_trigger(usb_dev->index, xfer->buf->frame_seq, index, 1);
+	usb_dev->frame_index = index;
+	xfer->trigger_busy = 1;
+	usb_hal_stat_inc(usb_dev, trigger_submit);
+	return 0;
+}
+
+/* take len bytes from the bucket, or arm shape_timer for when they are there; lock held */
+static int usb_hal_xfer_shape_locked(struct usb_hal_xfer* xfer, u32 len)
+{
+	ktime_t now = ktime_get();
+	s64 ns = ktime_to_ns(ktime_sub(now, xfer->shape_time));
+
+	if (xfer->shape_wait) {
+		return -EAGAIN;
+	}
+
+	// a full bucket refills in at most a second at any rate that is set
+	ns = clamp_t(s64, ns, 0, NSEC_PER_SEC);
+	xfer->shape_tokens = min_t(u64, xfer->shape_tokens + div_u64((u64)ns * xfer->shape_rate, NSEC_PER_SEC), xfer->shape_burst);
+	xfer->shape_time = now;
+
+	if (xfer->shape_tokens >= len) {
+		xfer->shape_tokens -= len;
+		return 0;
+	}
+
+	ns = div_u64((u64)(len - xfer->shape_tokens) * NSEC_PER_SEC, xfer->shape_rate);
+	xfer->shape_wait = 1;
+	usb_hal_stat_inc(xfer->usb_dev, shape_wait);
+	hrtimer_start(&xfer->shape_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+	return -EAGAIN;
+}
+
+/* queue as much of the frame as idle urbs and the ready watermark allow, lock held */
+static void usb_hal_xfer_pump_locked(struct usb_hal_xfer* xfer, gfp_t mem_flags)
+{
+	u32 len;
+	int i;
+
+	for (i = 0; (i < USB_HAL_XFER_URB_CNT) && !xfer->status && (xfer->offset < xfer->len); i++) {
+		if (xfer->urbs[i].busy) {
+			continue;
+		}
+
+		len = usb_hal_xfer_next_len_locked(xfer);
+		if (!len) {
+			break;
+		}
+
+		if (xfer->shape_rate && usb_hal_xfer_shape_locked(xfer, len)) {
+			break;
+		}
+
+		(void)usb_hal_xfer_submit_locked(xfer, &xfer->urbs[i], len, mem_flags);
+	}
+
+	if (xfer->finished || xfer->in_flight || xfer->trigger_busy) {
+		return;
+	}
+
+	if (!xfer->status && (xfer->offset < xfer->len)) {
+		return;
+	}
+
+	// every bulk urb of the frame is back
+	if (!xfer->status) {
+		xfer->trigger_start = ktime_get();
+		msdisp_common_hist_add(&xfer->usb_dev->hist_xfer, ktime_us_delta(xfer->trigger_start, xfer->start));
+		usb_hal_bw_add(xfer->usb_dev, USB_HAL_BW_DATA, 0, 1);
+		// URB_ZERO_PACKET only adds one when the frame ends on a packet boundary
+		if (xfer->maxp && xfer->len && !(xfer->len % xfer->maxp)) {
+			usb_hal_bw_add(xfer->usb_dev, USB_HAL_BW_ZLP, 0, 1);
+		}
+	}
+
+	if (!xfer->status && xfer->trigger_enable && !usb_hal_xfer_trigger_locked(xfer)) {
+		return;
+	}
+
+	xfer->finished = 1;
+	complete(&xfer->done);
+}
+
+static void usb_hal_xfer_complete(struct urb* urb)
+{
+	struct usb_hal_xfer_urb* xurb = urb->context;
+	struct usb_hal_xfer* xfer = xurb->xfer;
+	struct usb_hal_dev* usb_dev = xfer->usb_dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	trace_usb_hal_urb_complete(xfer->usb_dev->index, xfer->buf->frame_seq, urb->status, urb->actual_length);
+	xurb->busy = 0;
+	xfer->in_flight--;
+	usb_hal_stat_inc(usb_dev, urb_complete);
+	if (urb->status) {
+		usb_hal_stat_inc(usb_dev, urb_error);
+		if (!xfer->status) {
+			xfer->status = urb->status;
+		}
+	} else {
+		xfer->completed += urb->actual_length;
+	}
+	// what made it onto the bus, also of frames that failed later
+	usb_hal_bw_add(usb_dev, USB_HAL_BW_DATA, urb->actual_length, 0);
+
+	// refill the ring with the next chunk of the frame
+	usb_hal_xfer_pump_locked(xfer, GFP_ATOMIC);
+	usb_dev->gauge.in_flight = xfer->in_flight;
+	spin_unlock_irqrestore(&xfer->lock, flags);
+}
+
+/* enough tokens for the next urb */
+static enum hrtimer_restart usb_hal_xfer_shape_timer_fn(struct hrtimer* timer)
+{
+	struct usb_hal_xfer* xfer = container_of(timer, struct usb_hal_xfer, shape_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	xfer->shape_wait = 0;
+	if (xfer->buf) {
+		usb_hal_xfer_pump_locked(xfer, GFP_ATOMIC);
+	}
+	spin_unlock_irqrestore(&xfer->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void usb_hal_xfer_trigger_complete(struct urb* urb)
+{
+	struct usb_hal_xfer* xfer = urb->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	trace_usb_hal_trigger_complete(xfer->usb_dev->index, xfer->buf->frame_seq, urb->status);
+	xfer->trigger_busy = 0;
+	if (urb->status) {
+		usb_hal_stat_inc(xfer->usb_dev, trigger_error);
+		if (!xfer->status) {
+			xfer->status = urb->status;
+		}
+	} else {
+		msdisp_common_hist_add(&xfer->usb_dev->hist_trigger, ktime_us_delta(ktime_get(), xfer->trigger_start));
+		usb_hal_bw_add(xfer->usb_dev, USB_HAL_BW_CTRL, sizeof(struct usb_ctrlrequest) + USB_HAL_XFER_TRIGGER_LEN, 1);
+	}
+
+	xfer->finished = 1;
+	complete(&xfer->done);
+	spin_unlock_irqrestore(&xfer->lock, flags);
+}
+
+/* start sending len bytes of buf, of which the first ready bytes are already written */
+void usb_hal_xfer_begin(struct usb_hal_xfer* xfer, struct usb_hal_buffer* buf, u32 len, u32 ready)
+{
+	unsigned long flags;
+
+	if (len > buf->size) {
+		len = buf->size;
+	}
+
+	reinit_completion(&xfer->done);
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	xfer->buf = buf;
+	xfer->len = len;
+	xfer->ready = min_t(u32, ready, len);
+	xfer->offset = 0;
+	xfer->completed = 0;
+	xfer->status = 0;
+	xfer->finished = 0;
+	xfer->trigger_busy = 0;
+	xfer->start = ktime_get();
+	usb_hal_xfer_pump_locked(xfer, GFP_ATOMIC);
+	spin_unlock_irqrestore(&xfer->lock, flags);
+}
+
+void usb_hal_xfer_publish(struct usb_hal_xfer* xfer, u32 ready)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	if (ready > xfer->ready) {
+		xfer->ready = min_t(u32, ready, xfer->len);
+		usb_hal_xfer_pump_locked(xfer, GFP_ATOMIC);
+	}
+	spin_unlock_irqrestore(&xfer->lock, flags);
+}
+
+int usb_hal_xfer_wait(struct usb_hal_xfer* xfer)
+{
+	struct usb_hal_dev* usb_dev = xfer->usb_dev;
+	unsigned long flags;
+	u32 timeout = USB_HAL_XFER_TIMEOUT;
+	int ret;
+	s64 us;
+
+	// a shaped frame takes len / rate on top of what the bus needs
+	spin_lock_irqsave(&xfer->lock, flags);
+	if (xfer->shape_rate) {
+		timeout += (u32)div_u64((u64)xfer->len * MSEC_PER_SEC, xfer->shape_rate);
+	}
+	spin_unlock_irqrestore(&xfer->lock, flags);
+
+	if (!wait_for_completion_timeout(&xfer->done, msecs_to_jiffies(timeout))) {
+		spin_lock_irqsave(&xfer->lock, flags);
+		if (!xfer->status) {
+			xfer->status = -ETIMEDOUT;
+		}
+		spin_unlock_irqrestore(&xfer->lock, flags);
+
+		usb_hal_stat_inc(usb_dev, urb_timeout);
+		// the timer may have been cancelled before it cleared the wait
+		hrtimer_cancel(&xfer->shape_timer);
+		spin_lock_irqsave(&xfer->lock, flags);
+		xfer->shape_wait = 0;
+		spin_unlock_irqrestore(&xfer->lock, flags);
+		usb_kill_anchored_urbs(&xfer->anchor);
+	}
+
+	ret = xfer->status;
+	if (!ret) {
+		us = ktime_us_delta(ktime_get(), xfer->start);
+		usb_hal_stat_add(usb_dev, xfer_bytes, xfer->completed);
+		usb_hal_stat_add(usb_dev, xfer_time_us, us);
+		// bytes per us is MB/s
+		if (us > 0) {
+			usb_dev->gauge.last_mbps = (u32)div_u64(xfer->completed, (u32)us);
+		}
+	}
+
+	return ret;
+}
+
+/* chain trigger_frame after every frame, only while the device is enabled */
+void usb_hal_xfer_set_trigger(struct usb_hal_xfer* xfer, int enable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	xfer->trigger_enable = (enable && xfer->trigger_urb);
+	spin_unlock_irqrestore(&xfer->lock, flags);
+}
+
+/* rate in bytes per second, 0 for no limit; burst is cut to whole packets */
+void usb_hal_xfer_set_shaper(struct usb_hal_xfer* xfer, u32 rate, u32 burst)
+{
+	unsigned long flags;
+
+	burst = clamp_t(u32, burst, PAGE_SIZE, USB_HAL_XFER_CHUNK_SIZE);
+	if (xfer->maxp) {
+		burst -= (burst % xfer->maxp);
+	}
+
+	spin_lock_irqsave(&xfer->lock, flags);
+	xfer->shape_rate = rate;
+	xfer->shape_burst = burst;
+	xfer->shape_tokens = burst;
+	xfer->shape_time = ktime_get();
+	spin_unlock_irqrestore(&xfer->lock, flags);
+}
+
+int usb_hal_xfer_send(struct usb_hal_xfer* xfer, struct usb_hal_buffer* buf, u32 len)
+{
+	usb_hal_xfer_begin(xfer, buf, len, len);
+	return usb_hal_xfer_wait(xfer);
+}
+
+struct usb_hal_xfer* usb_hal_xfer_create(struct usb_hal_dev* usb_dev, int ep)
+{
+	struct usb_device* udev = usb_dev->udev;
+	struct usb_hal_xfer* xfer;
+	u16 maxp;
+	int i;
+
+	xfer = kzalloc(sizeof(*xfer), GFP_KERNEL);
+	if (!xfer) {
+		return NULL;
+	}
+
+	xfer->usb_dev = usb_dev;
+	init_usb_anchor(&xfer->anchor);
+	spin_lock_init(&xfer->lock);
+	init_completion(&xfer->done);
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+	hrtimer_setup(&xfer->shape_timer, usb_hal_xfer_shape_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&xfer->shape_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	xfer->shape_timer.function = usb_hal_xfer_shape_timer_fn;
+#endif
+	xfer->pipe = usb_sndbulkpipe(udev, ep);
+
+#if KERNEL_VERSION(5, 19, 0) <= LINUX_VERSION_CODE
+	maxp = usb_maxpacket(udev, xfer->pipe);
+#else
+	maxp = usb_maxpacket(udev, xfer->pipe, 1);
+#endif
+	xfer->maxp = maxp;
+	xfer->chunk_size = USB_HAL_XFER_CHUNK_SIZE;
+	if (maxp) {
+		xfer->chunk_size -= (xfer->chunk_size % maxp);
+	}
+
+	for (i = 0; i < USB_HAL_XFER_URB_CNT; i++) {
+		xfer->urbs[i].xfer = xfer;
+		xfer->urbs[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!xfer->urbs[i].urb) {
+			goto err;
+		}
+
+		// zero-copy frames may come along any time, not only with vmalloc buffers
+		xfer->urbs[i].sg = kmalloc_array(USB_HAL_XFER_CHUNK_PAGES + 1, sizeof(struct scatterlist), GFP_KERNEL);
+		if (!xfer->urbs[i].sg) {
+			goto err;
+		}
+	}
+
+	if (usb_dev->hal_dev->funcs->fill_trigger_urb) {
+		xfer->trigger_urb = usb_alloc_urb(0, GFP_KERNEL);
+		xfer->trigger_setup = kmalloc(sizeof(struct usb_ctrlrequest), GFP_KERNEL);
+		xfer->trigger_buf = kmalloc(USB_HAL_XFER_TRIGGER_LEN, GFP_KERNEL);
+		if (!xfer->trigger_urb || !xfer->trigger_setup || !xfer->trigger_buf) {
+			goto err;
+		}
+	}
+
+	usb_hal_xfer_set_shaper(xfer, usb_hal_shape_rate_kb * 1024, usb_hal_shape_burst_kb * 1024);
+
+	dev_info(&udev->dev, "xfer urbs:%d chunk:%u maxpacket:%u shape:%u/%u\n", USB_HAL_XFER_URB_CNT, xfer->chunk_size, maxp,
+		xfer->shape_rate, xfer->shape_burst);
+	return xfer;
+
+err:
+	usb_hal_xfer_destroy(xfer);
+	return NULL;
+}
+
+void usb_hal_xfer_destroy(struct usb_hal_xfer* xfer)
+{
+	int i;
+
+	if (!xfer) {
+		return;
+	}
+
+	hrtimer_cancel(&xfer->shape_timer);
+	usb_kill_anchored_urbs(&xfer->anchor);
+	for (i = 0; i < USB_HAL_XFER_URB_CNT; i++) {
+		usb_free_urb(xfer->urbs[i].urb);
+		kfree(xfer->urbs[i].sg);
+	}
+	usb_free_urb(xfer->trigger_urb);
+	kfree(xfer->trigger_setup);
+	kfree(xfer->trigger_buf);
+
+	kfree(xfer);
+}